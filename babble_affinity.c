@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "babble_affinity.h"
+
+/* affinity mask of the server when it started */
+static cpu_set_t server_cpus;
+static int server_cpus_read = 0;
+
+static cpu_set_t* get_server_cpus(void)
+{
+    if(!server_cpus_read){
+        if(sched_getaffinity(0, sizeof(cpu_set_t), &server_cpus) == -1){
+            long i, n = sysconf(_SC_NPROCESSORS_ONLN);
+
+            CPU_ZERO(&server_cpus);
+            for(i=0; i<n && i<CPU_SETSIZE; i++){
+                CPU_SET(i, &server_cpus);
+            }
+        }
+        server_cpus_read = 1;
+    }
+
+    return &server_cpus;
+}
+
+int affinity_nb_cpus(void)
+{
+    int n = CPU_COUNT(get_server_cpus());
+
+    return (n > 0)? n : 1;
+}
+
+int affinity_plan(int nb_io, int *io_cpus, int nb_exec, int *exec_cpus)
+{
+    cpu_set_t *set = get_server_cpus();
+    int cpus[CPU_SETSIZE];
+    int nb_cpus=0, nb_io_cpus, i;
+
+    for(i=0; i<CPU_SETSIZE; i++){
+        if(CPU_ISSET(i, set)){
+            cpus[nb_cpus++] = i;
+        }
+    }
+
+    if(nb_cpus < 2){
+        return -1;
+    }
+
+    /* at least one CPU for the executors */
+    nb_io_cpus = (nb_io < nb_cpus)? nb_io : nb_cpus - 1;
+
+    for(i=0; i<nb_io; i++){
+        io_cpus[i] = cpus[i % nb_io_cpus];
+    }
+    for(i=0; i<nb_exec; i++){
+        exec_cpus[i] = cpus[nb_io_cpus + i % (nb_cpus - nb_io_cpus)];
+    }
+
+    return 0;
+}
+
+int affinity_pin_self(int cpu)
+{
+    cpu_set_t set;
+
+    if(cpu == -1){
+        set = *get_server_cpus();
+    }
+    else{
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set)){
+        fprintf(stderr, "Warning -- could not pin thread to cpu %d\n", cpu);
+        return -1;
+    }
+
+    return 0;
+}
+
+int affinity_thread_create(pthread_t *thread, int cpu, void *(*run)(void*), void *arg)
+{
+    pthread_attr_t attr;
+    cpu_set_t set;
+    int res;
+
+    if(cpu == -1){
+        return pthread_create(thread, NULL, run, arg);
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &set);
+    res = pthread_create(thread, &attr, run, arg);
+    pthread_attr_destroy(&attr);
+
+    return res;
+}
@@ -0,0 +1,33 @@
+#ifndef __BABBLE_AFFINITY_H__
+#define __BABBLE_AFFINITY_H__
+
+#include <pthread.h>
+
+/**** Placement of the server threads (server option -a) ****/
+
+/* the CPUs the server may run on (its affinity mask) are split in two
+ * disjoint sets: the first ones for the I/O threads (event loops and
+ * their acceptors), the others for the executors. Each thread is
+ * pinned to a single CPU of its set (round robin)
+   + per-thread state is allocated and initialized while running on
+     the CPU of the thread, so that its pages are placed on the local
+     NUMA node (first touch)
+*/
+
+/* nb of CPUs the server may run on */
+int affinity_nb_cpus(void);
+
+/* fill io_cpus[nb_io] and exec_cpus[nb_exec] with the CPU of each
+ * thread */
+/* returns -1 if there are not enough CPUs for two sets */
+int affinity_plan(int nb_io, int *io_cpus, int nb_exec, int *exec_cpus);
+
+/* pin the calling thread to cpu (-1: back to all the CPUs of the
+ * server) */
+int affinity_pin_self(int cpu);
+
+/* pthread_create() of a thread pinned to cpu from its start (-1: not
+ * pinned) */
+int affinity_thread_create(pthread_t *thread, int cpu, void *(*run)(void*), void *arg);
+
+#endif
@@ -1,16 +1,49 @@
 #ifndef __BABBLE_CLIENT_H__
 #define __BABBLE_CLIENT_H__
 
+#include "babble_types.h"
+
+/* protocol of the next connections (PROTOCOL_TEXT by default) */
+void client_set_protocol(protocol_t protocol);
+
 /* connect with server */
 int connect_to_server(char* host, int port);
+
+/* local clients: AF_UNIX socket, or shared memory rings set up
+ * through it (see babble_shm.h) */
+int connect_to_unix_server(char* path);
+int connect_to_shm_server(char* path);
+
+/* close a connection, whatever its transport */
+void disconnect_from_server(int sock);
 unsigned long client_login(int sock, char* id);
 
 /* interact for tests */
 int client_follow(int sock, char* id, int with_streaming);
+int client_unfollow(int sock, char* id);
 int client_follow_count(int sock);
 int client_publish(int sock, char* msg, int with_streaming);
 int client_timeline(int sock, int size_out);
 int client_rdv(int sock);
 
+/* ask the server to push the publications of the followed clients */
+/* returns the nb of publications pushed before the ack, -1 on error */
+int client_subscribe(int sock);
+
+/* wait for the next push frame */
+/* returns the nb of publications it holds */
+int client_recv_push(int sock);
+
+/* pipelined commands (binary protocol only): the request is sent
+ * with the id req_id, without waiting for the answer */
+int client_publish_pipelined(int sock, char* msg, unsigned long req_id);
+int client_timeline_pipelined(int sock, unsigned long req_id);
+
+/* receive the next answer to a pipelined command, whatever the order
+ * they were sent in; its id is stored in req_id */
+/* returns the timeline size for a TIMELINE, 0 for the other commands,
+ * -1 if the answer could not be received or is an error */
+int client_pipeline_recv(int sock, unsigned long *req_id);
+
 
 #endif
@@ -4,6 +4,7 @@
 #include <strings.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
@@ -12,7 +13,27 @@
 #include "babble_types.h"
 #include "babble_communication.h"
 #include "babble_utils.h"
+#include "babble_protocol.h"
+#include "babble_shm.h"
 
+/* protocol used by the new connections */
+static protocol_t client_protocol = PROTOCOL_TEXT;
+
+void client_set_protocol(protocol_t protocol)
+{
+    client_protocol = protocol;
+}
+
+/* the magic selects the binary protocol on the server side */
+static int select_protocol(int sockfd)
+{
+    if(client_protocol == PROTOCOL_V2
+       && network_write(sockfd, BABBLE_V2_MAGIC_SIZE, BABBLE_V2_MAGIC) != BABBLE_V2_MAGIC_SIZE){
+        return -1;
+    }
+
+    return 0;
+}
 
 int connect_to_server(char* host, int port)
 {
@@ -48,51 +69,205 @@ int connect_to_server(char* host, int port)
         return -1;
     }
 
+    if(select_protocol(sockfd) == -1){
+        close(sockfd);
+        return -1;
+    }
+
     return sockfd;
 }
 
+static int unix_connect(char* path)
+{
+    struct sockaddr_un serv_addr;
 
-unsigned long client_login(int sock, char* id)
+    if(strlen(path) >= sizeof(serv_addr.sun_path)){
+        fprintf(stderr,"Error -- socket path too long: %s\n", path);
+        return -1;
+    }
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0){
+        perror("ERROR opening socket");
+        return -1;
+    }
+
+    bzero((char *) &serv_addr, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    strcpy(serv_addr.sun_path, path);
+
+    if (connect(sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0){
+        perror("ERROR connecting");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+int connect_to_unix_server(char* path)
 {
+    int sockfd = unix_connect(path);
+
+    if(sockfd != -1 && select_protocol(sockfd) == -1){
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+int connect_to_shm_server(char* path)
+{
+    int sockfd = unix_connect(path);
+    shm_channel_t *ch;
+
+    if(sockfd == -1){
+        return -1;
+    }
+
+    if((ch = shm_channel_create(sockfd)) == NULL){
+        close(sockfd);
+        return -1;
+    }
+
+    /* from now on, network_*() on sockfd go through the rings */
+    shm_channel_register(ch);
+
+    if(select_protocol(sockfd) == -1){
+        disconnect_from_server(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+void disconnect_from_server(int sock)
+{
+    shm_channel_t *ch = shm_channel_lookup(sock);
+
+    if(ch != NULL){
+        shm_channel_unregister(sock);
+        shm_channel_destroy(ch);
+    }
+
+    close(sock);
+}
+
+
+/* send command cid (with its argument, or NULL) to the server */
+static int send_command(int sock, int cid, int ack_req, char *arg)
+{
+    if(client_protocol == PROTOCOL_V2){
+        char buffer[BABBLE_V2_REQUEST_MAX];
+        int size = proto_encode_command(buffer, cid, ack_req, arg, 0, 0);
+
+        return (network_write(sock, size, buffer) == size) ? 0 : -1;
+    }
+
     char buffer[BABBLE_BUFFER_SIZE];
     bzero(buffer, BABBLE_BUFFER_SIZE);
 
+    snprintf(buffer, BABBLE_BUFFER_SIZE, "%s%d%s%s\n", ack_req ? "" : "S ", cid, arg ? " " : "", arg ? arg : "");
+
+    if (network_send(sock, strlen(buffer)+1, buffer) != strlen(buffer)+1){
+        return -1;
+    }
+
+    return 0;
+}
+
+/* receive the answer to command cid */
+/* returns -1 if it could not be received, 1 if it is not the expected
+ * answer (eg an error) */
+static int recv_answer(int sock, int cid, answer_t *answer)
+{
+    char* ack=NULL;
+    int res=0;
+
+    if(client_protocol == PROTOCOL_V2){
+        int op;
+        long size = network_recv_v2(sock, (void**) &ack);
+
+        if(size == -1){
+            return -1;
+        }
+
+        if(proto_decode_answer(ack, size, &op, answer) == -1 || op != cid){
+            res = 1;
+        }
+
+        free(ack);
+        return res;
+    }
+
+    if(network_recv(sock, (void**) &ack) == -1){
+        return -1;
+    }
+
+    /* check if answer is ok */
+    switch(cid){
+    case LOGIN:
+        answer->value = parse_login_ack(ack);
+        break;
+    case FOLLOW:
+        res = (strstr(ack, "follow") == NULL);
+        break;
+    case PUBLISH:
+        res = (strstr(ack, "{") == NULL);
+        break;
+    case FOLLOW_COUNT:
+        answer->value = parse_fcount_ack(ack);
+        break;
+    case RDV:
+        res = (strstr(ack, "rdv_ack") == NULL);
+        break;
+    case SUBSCRIBE:
+        res = (strstr(ack, "subscribed") == NULL);
+        break;
+    case UNFOLLOW:
+        res = (strstr(ack, "unfollow") == NULL);
+        break;
+    }
+
+    free(ack);
+    return res;
+}
+
+
+unsigned long client_login(int sock, char* id)
+{
+    answer_t answer;
+
     if(strlen(id) > BABBLE_ID_SIZE){
         fprintf(stderr,"Error -- invalid client id (too long): %s\n", id);
         fprintf(stderr,"Max id size is %d\n", BABBLE_ID_SIZE);
         return 0;
     }
     
-    snprintf(buffer, BABBLE_BUFFER_SIZE, "%d %s\n", LOGIN, id);
-
-    
-    if (network_send(sock, strlen(buffer)+1, buffer) != strlen(buffer)+1){
+    if (send_command(sock, LOGIN, 1, id) == -1){
         perror("ERROR writing to socket");
-        close(sock);
+        disconnect_from_server(sock);
         return 0;
     }
     
-    char* login_ack=NULL;
-    
-    if(network_recv(sock, (void**) &login_ack) == -1){
+    answer.value = 0;
+
+    if(recv_answer(sock, LOGIN, &answer) == -1){
         perror("ERROR reading from socket");
-        close(sock);
+        disconnect_from_server(sock);
         return 0;
     }
 
-    /* parsing the answer to get the key */
-    unsigned long key=parse_login_ack(login_ack);
-    
-    free(login_ack);
-    
-    return key;
+    /* key of the client */
+    return answer.value;
 }
 
 
 int client_follow(int sock, char* id, int with_streaming)
 {
-    char buffer[BABBLE_BUFFER_SIZE];
-    bzero(buffer, BABBLE_BUFFER_SIZE);
+    answer_t answer;
+    int res;
 
     if(strlen(id) > BABBLE_ID_SIZE){
         fprintf(stderr,"Error -- invalid client id (too long): %s\n", id);
@@ -100,35 +275,19 @@ int client_follow(int sock, char* id, int with_streaming)
         return -1;
     }
 
-    if(with_streaming){
-        snprintf(buffer, BABBLE_BUFFER_SIZE, "S %d %s\n", FOLLOW, id);
-    }
-    else{
-        snprintf(buffer, BABBLE_BUFFER_SIZE, "%d %s\n", FOLLOW, id);
-    }
-
-    if (network_send(sock, strlen(buffer)+1, buffer) != strlen(buffer)+1){
+    if (send_command(sock, FOLLOW, !with_streaming, id) == -1){
         fprintf(stderr,"Error -- sending FOLLOW message\n");
         return -1;
     }
 
     if(!with_streaming){
-        char* ack=NULL;
-        
-        if(network_recv(sock, (void**) &ack) == -1){
+        if((res = recv_answer(sock, FOLLOW, &answer)) == -1){
             perror("ERROR reading from socket");
-            close(sock);
+            disconnect_from_server(sock);
             return -1;
         }
 
-        /* check if answer is ok */
-        if(strstr(ack, "follow")!=NULL){
-            free(ack);
-            return 0;
-        }
-
-        free(ack);
-        return -1;
+        return res ? -1 : 0;
     }
     else{
         usleep(100);
@@ -139,39 +298,57 @@ int client_follow(int sock, char* id, int with_streaming)
 }
 
 
-int client_follow_count(int sock)
+int client_unfollow(int sock, char* id)
 {
-    char buffer[BABBLE_BUFFER_SIZE];
-    bzero(buffer, BABBLE_BUFFER_SIZE);
+    answer_t answer;
+    int res;
 
-    snprintf(buffer, BABBLE_BUFFER_SIZE, "%d\n", FOLLOW_COUNT);
+    if(strlen(id) > BABBLE_ID_SIZE){
+        fprintf(stderr,"Error -- invalid client id (too long): %s\n", id);
+        fprintf(stderr,"Max id size is %d\n", BABBLE_ID_SIZE);
+        return -1;
+    }
 
-    if (network_send(sock, strlen(buffer)+1, buffer) != strlen(buffer)+1){
+    if (send_command(sock, UNFOLLOW, 1, id) == -1){
+        fprintf(stderr,"Error -- sending UNFOLLOW message\n");
+        return -1;
+    }
+
+    if((res = recv_answer(sock, UNFOLLOW, &answer)) == -1){
+        perror("ERROR reading from socket");
+        disconnect_from_server(sock);
+        return -1;
+    }
+
+    return res ? -1 : 0;
+}
+
+
+int client_follow_count(int sock)
+{
+    answer_t answer;
+
+    if (send_command(sock, FOLLOW_COUNT, 1, NULL) == -1){
         fprintf(stderr,"Error -- sending FOLLOW_COUNT message\n");
         return -1;
     }
 
-    char* count_ack=NULL;
-    
-    if(network_recv(sock, (void**) &count_ack) == -1){
+    answer.value = -1;
+
+    if(recv_answer(sock, FOLLOW_COUNT, &answer) == -1){
         perror("ERROR reading from socket");
-        close(sock);
+        disconnect_from_server(sock);
         return 0;
     }
     
-    /* parsing the answer to get the key */
-    int count=parse_fcount_ack(count_ack);
-    
-    free(count_ack);
-    
-    return count;
+    return (int) answer.value;
 }
 
 
 int client_publish(int sock, char* msg, int with_streaming)
 {
-    char buffer[BABBLE_BUFFER_SIZE];
-    bzero(buffer, BABBLE_BUFFER_SIZE);
+    answer_t answer;
+    int res;
 
     if(strlen(msg) > BABBLE_SIZE){
         fprintf(stderr,"Error -- invalid msg (too long): %s\n", msg);
@@ -179,35 +356,19 @@ int client_publish(int sock, char* msg, int with_streaming)
         return -1;
     }
 
-    if(with_streaming){
-        snprintf(buffer, BABBLE_BUFFER_SIZE, "S %d %s\n", PUBLISH, msg);
-    }
-    else{
-        snprintf(buffer, BABBLE_BUFFER_SIZE, "%d %s\n", PUBLISH, msg);
-    }
-
-    if (network_send(sock, strlen(buffer)+1, buffer) != strlen(buffer)+1){
+    if (send_command(sock, PUBLISH, !with_streaming, msg) == -1){
         fprintf(stderr,"Error -- sending PUBLISH message\n");
         return -1;
     }
 
     if(!with_streaming){
-        char* ack=NULL;
-        
-        if(network_recv(sock, (void**) &ack) == -1){
+        if((res = recv_answer(sock, PUBLISH, &answer)) == -1){
             perror("ERROR reading from socket");
-            close(sock);
+            disconnect_from_server(sock);
             return -1;
         }
 
-        /* check if answer is ok */
-        if(strstr(ack, "{")!=NULL){
-            free(ack);
-            return 0;
-        }
-
-        free(ack);
-        return -1;
+        return res ? -1 : 0;
     }
     else{
         usleep(100);
@@ -217,21 +378,44 @@ int client_publish(int sock, char* msg, int with_streaming)
     return 0;
 }
 
+/* binary protocol: the whole timeline comes in a single frame */
+static int client_timeline_v2(int sock, int size_out)
+{
+    answer_t items[BABBLE_TIMELINE_MAX];
+    char *recv_buf;
+    int total_items;
+    long size;
+
+    if((size = network_recv_v2(sock, (void**) &recv_buf)) == -1){
+        perror("ERROR reading from socket");
+        return -1;
+    }
+
+    int nb_items = proto_decode_timeline(recv_buf, size, &total_items, items, BABBLE_TIMELINE_MAX);
+    free(recv_buf);
+
+    if(nb_items == -1){
+        perror("ERROR in timeline protocol");
+        return size_out ? 0 : -1;
+    }
+
+    return total_items;
+}
+
 /* return the size of the timeline */
 /* if size_out is set, always return timeline size. Otherwise simply
  * return -1 in case of error */
 int client_timeline(int sock, int size_out)
 {
-    char buffer[BABBLE_BUFFER_SIZE];
-    bzero(buffer, BABBLE_BUFFER_SIZE);
-    
-    snprintf(buffer, BABBLE_BUFFER_SIZE, "%d\n", TIMELINE);
-
-    if (network_send(sock, strlen(buffer)+1, buffer) != strlen(buffer)+1){
+    if (send_command(sock, TIMELINE, 1, NULL) == -1){
         fprintf(stderr,"Error -- sending TIMELINE message\n");
         return -1;
     }
 
+    if(client_protocol == PROTOCOL_V2){
+        return client_timeline_v2(sock, size_out);
+    }
+
     int *nb_items, i=0;
     char *recv_buf;
     int total_items;
@@ -269,30 +453,177 @@ int client_timeline(int sock, int size_out)
 
 int client_rdv(int sock)
 {
-    char buffer[BABBLE_BUFFER_SIZE];
-    bzero(buffer, BABBLE_BUFFER_SIZE);
+    answer_t answer;
+    int res;
 
-    snprintf(buffer, BABBLE_BUFFER_SIZE, "%d\n", RDV);
- 
-    if (network_send(sock, strlen(buffer)+1, buffer) != strlen(buffer)+1){
+    if (send_command(sock, RDV, 1, NULL) == -1){
         fprintf(stderr,"Error -- sending RDV message\n");
         return -1;
     }
     
-    char* ack=NULL;
-        
-    if(network_recv(sock, (void**) &ack) == -1){
+    if((res = recv_answer(sock, RDV, &answer)) == -1){
         perror("ERROR reading from socket");
-        close(sock);
+        disconnect_from_server(sock);
         return -1;
     }
 
-    /* check if answer is ok */
-    if(strstr(ack, "rdv_ack")!=NULL){
-        free(ack);
-        return 0;
+    return res ? -1 : 0;
+}
+
+
+/* receive a frame; if it is a push, returns the nb of publications
+ * it holds, otherwise 0 and the frame is checked as the answer to
+ * SUBSCRIBE (res set to 1 if it is not) */
+static int recv_push_frame(int sock, int *res)
+{
+    char *recv_buf;
+    long size;
+    int nb_items=0;
+
+    if(client_protocol == PROTOCOL_V2){
+        if((size = network_recv_v2(sock, (void**) &recv_buf)) == -1){
+            return -1;
+        }
+
+        if(size > 0 && (unsigned char) recv_buf[0] == BABBLE_V2_PUSH){
+            nb_items = proto_decode_push(recv_buf, size, NULL, 0);
+        }
+        else{
+            answer_t answer;
+            int cid;
+            *res = (proto_decode_answer(recv_buf, size, &cid, &answer) == -1 || cid != SUBSCRIBE);
+        }
+        free(recv_buf);
+        return nb_items;
     }
 
-    free(ack);
-    return -1;
+    if(network_recv(sock, (void**) &recv_buf) == -1){
+        return -1;
+    }
+
+    if(strncmp(recv_buf, "  > ", 4) == 0){
+        nb_items = 1;
+    }
+    else{
+        *res = (strstr(recv_buf, "subscribed") == NULL);
+    }
+    free(recv_buf);
+    return nb_items;
+}
+
+int client_subscribe(int sock)
+{
+    int res=-1, nb_pushed=0, n;
+
+    if (send_command(sock, SUBSCRIBE, 1, NULL) == -1){
+        fprintf(stderr,"Error -- sending SUBSCRIBE message\n");
+        return -1;
+    }
+
+    /* publications can be pushed before the ack */
+    while(res == -1){
+        if((n = recv_push_frame(sock, &res)) == -1){
+            perror("ERROR reading from socket");
+            return -1;
+        }
+        nb_pushed += n;
+    }
+
+    return res ? -1 : nb_pushed;
+}
+
+int client_recv_push(int sock)
+{
+    int res=-1, n;
+
+    if((n = recv_push_frame(sock, &res)) == -1){
+        perror("ERROR reading from socket");
+        return -1;
+    }
+
+    if(res != -1){
+        fprintf(stderr,"Error -- unexpected answer while subscribed\n");
+        return -1;
+    }
+
+    return n;
+}
+
+
+/* pipelined commands: the request carries an id, echoed in the answer */
+static int send_pipelined(int sock, int cid, char *arg, unsigned long req_id)
+{
+    char buffer[BABBLE_V2_REQUEST_MAX];
+    int size;
+
+    if(client_protocol != PROTOCOL_V2){
+        fprintf(stderr,"Error -- pipelined commands require the binary protocol\n");
+        return -1;
+    }
+
+    size = proto_encode_command(buffer, cid, 1, arg, 1, req_id);
+
+    return (network_write(sock, size, buffer) == size) ? 0 : -1;
+}
+
+int client_publish_pipelined(int sock, char* msg, unsigned long req_id)
+{
+    if(strlen(msg) > BABBLE_SIZE){
+        fprintf(stderr,"Error -- invalid msg (too long): %s\n", msg);
+        fprintf(stderr,"Max msg size is %d\n", BABBLE_SIZE);
+        return -1;
+    }
+
+    if(send_pipelined(sock, PUBLISH, msg, req_id) == -1){
+        fprintf(stderr,"Error -- sending PUBLISH message\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int client_timeline_pipelined(int sock, unsigned long req_id)
+{
+    if(send_pipelined(sock, TIMELINE, NULL, req_id) == -1){
+        fprintf(stderr,"Error -- sending TIMELINE message\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int client_pipeline_recv(int sock, unsigned long *req_id)
+{
+    answer_t answer;
+    char *recv_buf;
+    uint64_t id;
+    int op, with_req_id, cid, total, res;
+    long size;
+
+    if((size = network_recv_v2(sock, (void**) &recv_buf)) == -1){
+        perror("ERROR reading from socket");
+        return -1;
+    }
+
+    if(proto_decode_opcode(recv_buf, size, &op, &with_req_id, &id) == -1 || !with_req_id){
+        fprintf(stderr,"Error -- answer without request id\n");
+        free(recv_buf);
+        return -1;
+    }
+    *req_id = id;
+
+    if((op & BABBLE_V2_CID_MASK) == TIMELINE){
+        res = proto_decode_timeline(recv_buf, size, &total, NULL, 0);
+        res = (res == -1) ? -1 : total;
+    }
+    else{
+        res = proto_decode_answer(recv_buf, size, &cid, &answer);
+        if(res == 0 && answer.error){
+            fprintf(stderr,"Error -- request %lu failed\n", *req_id);
+            res = -1;
+        }
+    }
+
+    free(recv_buf);
+    return res;
 }
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "babble_client_set.h"
+
+#define CLIENT_SET_MIN_SLOTS 4
+
+
+/* same mix as the registration table: the keys are djb2 hashes */
+static unsigned long slot_of(client_set_t *set, unsigned long key)
+{
+    return ((key * 0x9E3779B97F4A7C15UL) >> 32) & set->mask;
+}
+
+int client_set_init(client_set_t *set)
+{
+    set->slots = calloc(CLIENT_SET_MIN_SLOTS, sizeof(client_set_slot_t));
+    set->mask = CLIENT_SET_MIN_SLOTS - 1;
+    set->nb = 0;
+
+    if(set->slots == NULL){
+        fprintf(stderr, "Error -- no memory for the client set\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void client_set_destroy(client_set_t *set)
+{
+    free(set->slots);
+    set->slots = NULL;
+}
+
+/* move the clients to a table of nb_slots slots */
+/* returns -1 if there is not enough memory, the set is unchanged */
+static int set_resize(client_set_t *set, unsigned long nb_slots)
+{
+    client_set_slot_t *old = set->slots;
+    client_set_slot_t *slots = calloc(nb_slots, sizeof(client_set_slot_t));
+    unsigned long old_mask = set->mask, i, j;
+
+    if(slots == NULL){
+        return -1;
+    }
+
+    set->slots = slots;
+    set->mask = nb_slots - 1;
+
+    for(i=0; i<=old_mask; i++){
+        if(old[i].client == NULL){
+            continue;
+        }
+        for(j = slot_of(set, old[i].key); set->slots[j].client != NULL; j = (j+1) & set->mask);
+        set->slots[j] = old[i];
+    }
+    free(old);
+
+    return 0;
+}
+
+/* slot of key, or the free slot ending its probe sequence */
+static unsigned long set_find(client_set_t *set, unsigned long key)
+{
+    unsigned long i = slot_of(set, key);
+
+    while(set->slots[i].client != NULL && set->slots[i].key != key){
+        i = (i+1) & set->mask;
+    }
+
+    return i;
+}
+
+int client_set_contains(client_set_t *set, unsigned long key)
+{
+    return set->slots[set_find(set, key)].client != NULL;
+}
+
+int client_set_add(client_set_t *set, unsigned long key, struct client_data *client)
+{
+    unsigned long i = set_find(set, key);
+
+    if(set->slots[i].client != NULL){
+        return 0;
+    }
+
+    /* at least one slot remains free */
+    if(set->nb + 1 > (set->mask + 1) / 4 * 3){
+        if(set_resize(set, 2 * (set->mask + 1)) == -1){
+            fprintf(stderr, "Error -- no memory to grow the client set\n");
+            return -1;
+        }
+        i = set_find(set, key);
+    }
+
+    set->slots[i].key = key;
+    set->slots[i].client = client;
+    __atomic_store_n(&set->nb, set->nb + 1, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+int client_set_remove(client_set_t *set, unsigned long key)
+{
+    unsigned long i = set_find(set, key), j, home;
+
+    if(set->slots[i].client == NULL){
+        return 0;
+    }
+
+    /* the clients after i in the same cluster move back to i if their
+     * home slot is not in (i, j] */
+    for(j = (i+1) & set->mask; set->slots[j].client != NULL; j = (j+1) & set->mask){
+        home = slot_of(set, set->slots[j].key);
+        if((i <= j) ? (home <= i || home > j) : (home <= i && home > j)){
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
+    }
+    set->slots[i].client = NULL;
+    __atomic_store_n(&set->nb, set->nb - 1, __ATOMIC_RELAXED);
+
+    /* on failure, the set stays larger than needed */
+    if(set->mask + 1 > CLIENT_SET_MIN_SLOTS && set->nb < (set->mask + 1) / 8){
+        set_resize(set, (set->mask + 1) / 2);
+    }
+
+    return 1;
+}
+
+struct client_data** client_set_members(client_set_t *set, int *nb)
+{
+    struct client_data **clients = malloc((set->nb + 1) * sizeof(struct client_data*));
+    unsigned long i;
+    int n=0;
+
+    if(clients == NULL){
+        return NULL;
+    }
+
+    for(i=0; i<=set->mask; i++){
+        if(set->slots[i].client != NULL){
+            clients[n++] = set->slots[i].client;
+        }
+    }
+    *nb = n;
+
+    return clients;
+}
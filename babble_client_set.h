@@ -0,0 +1,43 @@
+#ifndef __BABBLE_CLIENT_SET_H__
+#define __BABBLE_CLIENT_SET_H__
+
+struct client_data;
+
+/* set of clients, indexed by key (open addressing with linear probing,
+ * removals shift the following slots back instead of leaving
+ * tombstones) */
+/* it grows when 3/4 full and shrinks when 1/8 full, so that its size
+ * follows the nb of clients it holds */
+/* the caller serializes the accesses, except for reading nb; the
+ * clients are scanned through the slots that are not NULL */
+typedef struct client_set_slot{
+    unsigned long key;
+    struct client_data *client;    /* NULL if the slot is free */
+} client_set_slot_t;
+
+typedef struct client_set{
+    client_set_slot_t *slots;
+    unsigned long mask;    /* nb of slots - 1 */
+    int nb;                /* nb of clients, stored atomically */
+} client_set_t;
+
+/* returns -1 if there is not enough memory (the set can still be
+ * destroyed) */
+int client_set_init(client_set_t *set);
+void client_set_destroy(client_set_t *set);
+
+int client_set_contains(client_set_t *set, unsigned long key);
+
+/* returns 1 if client was added, 0 if it was already in the set, -1
+ * if there is not enough memory to grow the set */
+int client_set_add(client_set_t *set, unsigned long key, struct client_data *client);
+
+/* returns 1 if the client was removed, 0 if it was not in the set */
+int client_set_remove(client_set_t *set, unsigned long key);
+
+/* array of the clients of the set (to be freed by the caller), their
+ * nb is stored in nb */
+/* returns NULL if there is not enough memory */
+struct client_data** client_set_members(client_set_t *set, int *nb);
+
+#endif
@@ -1,367 +1,796 @@
-#include <stdio.h>
-#include <unistd.h>
-#include <strings.h>
-#include <stdlib.h>
-#include <string.h>
-#include <assert.h>
-
-#include "babble_server.h"
-#include "babble_utils.h"
-#include "babble_types.h"
-#include "babble_communication.h"
-#include "babble_registration.h"
-#include "babble_commands.h"
-
-int process_command(command_t *cmd)
-{
-    int res=0;
-    lock_client_data();
-    
-    switch(cmd->cid){
-    case LOGIN:
-        res = run_login_command(cmd);
-        break;
-    case PUBLISH:
-        res = run_publish_command(cmd);
-        break;
-    case FOLLOW:
-        res = run_follow_command(cmd);
-        break;
-    case TIMELINE:
-        res = run_timeline_command(cmd);
-        break;
-    case FOLLOW_COUNT:
-        res = run_fcount_command(cmd);
-        break;
-    case RDV:
-        res = run_rdv_command(cmd);
-        break;
-    default:
-        fprintf(stderr,"Error -- Unknown command id\n");
-        unlock_client_data();
-        return -1;
-    }
-    
-    unlock_client_data();
-
-    if(res){
-        fprintf(stderr,"Error -- Failed to run command ");
-        display_command(cmd, stderr);
-    }
-
-    return res;
-}
-
-
-/* freeing client_data_t struct */
-static void free_client_data(client_data_t *client)
-{
-    if(client == NULL){
-        return;
-    }
-
-
-    /* IMPORTANT: we choose not to free client_data_t structures when
-     * a client disconnects. The reason is that pointers to this data
-     * structure are stored if several places in the code, and so,
-     * freeing properly would be a complex operation */
-    
-    /*publication_t *item= client->pub_list, *previous;
-
-    while(item!=NULL){
-        previous=item;
-        item = item->next;
-        free(previous);
-    }
-
-    free(client);*/
-}
-
-/* stores an error message in the answer_set of a command */
-void generate_cmd_error(command_t *cmd)
-{
-    /* lookup client */
-    client_data_t *client = registration_lookup(cmd->key);
-
-    if(client == NULL){
-        fprintf(stderr, "Error -- no client found\n");
-        return;
-    }
-
-    cmd->answer.size = -1;
-    cmd->answer.aset = malloc(sizeof(answer_t));
-
-    if(cmd->cid == LOGIN || cmd->cid == PUBLISH || cmd->cid == FOLLOW){
-        snprintf(cmd->answer.aset->msg, BABBLE_BUFFER_SIZE,"%s[%ld]: ERROR -> %d { %s } \n", client->client_name, time(NULL)-server_start, cmd->cid, cmd->msg);
-    }
-    else{
-        snprintf(cmd->answer.aset->msg, BABBLE_BUFFER_SIZE,"%s[%ld]: ERROR -> %d \n", client->client_name, time(NULL)-server_start, cmd->cid);
-
-    }
-}
-
-
-int run_login_command(command_t *cmd)
-{
-    struct timespec tt;
-    clock_gettime(CLOCK_REALTIME, &tt);
-    
-    /* compute hash of the new client id */
-    cmd->key = hash(cmd->msg);
-    
-    client_data_t *client_data=malloc(sizeof(client_data_t));
-    
-    strncpy(client_data->client_name, cmd->msg, BABBLE_ID_SIZE);
-    client_data->sock = cmd->sock;
-    client_data->key=cmd->key;
-    client_data->pub_set=publication_set_create();
-    client_data->last_timeline=(uint64_t)1000000000 * tt.tv_sec + tt.tv_nsec;
-    /* by default, we follow ourself*/
-    client_data->followed[0]=client_data;
-    client_data->nb_followed=1;
-    client_data->nb_follower=1;
-
-    if(registration_insert(client_data)){
-        free(client_data->pub_set);
-        free(client_data);
-        generate_cmd_error(cmd);
-        return -1;
-    }
-    
-    printf("### New client %s (key = %lu)\n", client_data->client_name, client_data->key);
-
-    /* answer to client */
-    cmd->answer.size = -1;
-    cmd->answer.aset = malloc(sizeof(answer_t));
-    
-    snprintf(cmd->answer.aset->msg, BABBLE_BUFFER_SIZE,"%s[%ld]: registered with key %lu\n", client_data->client_name, tt.tv_sec - server_start, client_data->key);
-    
-    return 0;
-}
-
-
-int run_publish_command(command_t *cmd)
-{    
-    client_data_t *client = registration_lookup(cmd->key);
-    
-    if(client == NULL){
-        fprintf(stderr, "Error -- no client found\n");
-        generate_cmd_error(cmd);
-        return -1;
-    }
-    
-    publication_t *pub = publication_set_insert(client->pub_set, cmd->msg);
-    
-    printf("### Client %s published { %s } at date %ld\n", client->client_name, pub->msg, pub->date);
-
-    /* answer to client */
-    cmd->answer.size = -1;
-    cmd->answer.aset = malloc(sizeof(answer_t));
-
-    snprintf(cmd->answer.aset->msg, BABBLE_BUFFER_SIZE,"%s[%ld]: { %s }\n", client->client_name, pub->date, pub->msg);
-    
-    return 0;
-}
-
-
-int run_follow_command(command_t *cmd)
-{
-    client_data_t *client = registration_lookup(cmd->key);
-    
-    if(client == NULL){
-        fprintf(stderr, "Error -- no client found\n");
-        generate_cmd_error(cmd);
-        return -1;
-    }
-
-    /* compute hash of the client to follow */
-    unsigned long f_key = hash(cmd->msg);
-
-    /* lookup client to follow */
-    client_data_t *f_client = registration_lookup(f_key);
-    
-    if(f_client == NULL){
-        generate_cmd_error(cmd);        
-        return 0;
-    }
-    
-    /* if client is not already followed, add it*/
-    int i=0;
-
-    for(i=0; i<client->nb_followed; i++){
-        if(client->followed[i]->key == f_key){
-            break;
-        }
-    }
-    
-    if(i == client->nb_followed){
-        printf("### Client %s followed %s\n", client->client_name, f_client->client_name);
-        client->followed[i]=f_client;
-        client->nb_followed++;
-        f_client->nb_follower++;
-    }
-
-    
-    /* answer to client */
-    cmd->answer.size = -1;
-    cmd->answer.aset = malloc(sizeof(answer_t));
-
-    snprintf(cmd->answer.aset->msg, BABBLE_BUFFER_SIZE,"%s[%ld]: follow %s\n", client->client_name, time(NULL)-server_start, f_client->client_name);
-
-    return 0;
-}
-
-
-int run_timeline_command(command_t *cmd)
-{
-    int i=0;
-    timeline_item_t *pub_list=NULL;
-    int item_count=0;
-    
-    /* get current time to know up to when we publish*/
-    struct timespec tt;
-    clock_gettime(CLOCK_REALTIME, &tt);
-
-    uint64_t end_time= (uint64_t)1000000000 * tt.tv_sec + tt.tv_nsec;
-
-    /* lookup client */
-    client_data_t *client = registration_lookup(cmd->key);
-
-    if(client == NULL){
-        fprintf(stderr, "Error -- no client found\n");
-        generate_cmd_error(cmd);
-        return -1;
-    }
-
-    /* start from where we finished last time*/
-    uint64_t start_time=client->last_timeline;
-
-    /* gather publications over all followed clients */
-    for(i=0; i < client->nb_followed; i++){
-        client_data_t *f_client=client->followed[i];
-        publication_t *pub=NULL;
-
-        timeline_item_t *time_iter=pub_list, *prev;
-        /* add recent items to the totally ordered list */
-        while((pub = publication_set_getnext(f_client->pub_set, pub, start_time)) != NULL){
-            /* if publication is more recent than the timeline
-               command, we do not consider it */
- 
-            if(pub->ndate > end_time){
-                break;
-            }
-            printf("### Client %s got publication { %s }\n", client->client_name, pub->msg);
-            timeline_item_t *item=malloc(sizeof(timeline_item_t));
-            item->pub=pub;
-            item->client= f_client;
-            item->next = NULL;
-
-            while(time_iter!=NULL && time_iter->pub->date < pub->date){
-                prev = time_iter;
-                time_iter = time_iter->next;
-            }
-
-            /* insert in first position */
-            if(time_iter == pub_list){
-                pub_list = item;
-                item->next=time_iter;
-            }
-            else{
-                item->next=time_iter;
-                prev->next=item;
-            }
-            item_count++;
-            time_iter = item;
-        }
-    }
-
-
-    /* now that we have a full timeline, we generate the messages to
-     * the client */
-    
-    /* save number of items to transmit */
-    cmd->answer.size = item_count;
-    
-    /* generate each item*/
-    answer_t *current_answer=NULL;
-    timeline_item_t *time_iter=pub_list;
-    while(time_iter != NULL){
-        if(current_answer == NULL){
-            current_answer = malloc(sizeof(answer_t));
-            current_answer->next=NULL;
-            cmd->answer.aset = current_answer;
-        }
-        else{
-            current_answer->next = malloc(sizeof(answer_t));
-            current_answer = current_answer->next;
-            current_answer->next=NULL;
-        }
-                
-        snprintf(current_answer->msg, BABBLE_BUFFER_SIZE,"    %s[%ld]: %s\n", time_iter->client->client_name, time_iter->pub->date, time_iter->pub->msg);
-    
-        time_iter = time_iter->next;
-    }
-
-    client->last_timeline = end_time;
-    
-    return 0;
-}
-
-
-int run_fcount_command(command_t *cmd)
-{
-    /* lookup client */
-    client_data_t *client = registration_lookup(cmd->key);
-
-    if(client == NULL){
-        fprintf(stderr, "Error -- no client found\n");
-        generate_cmd_error(cmd);
-        return -1;
-    }
-    
-    /* answer to client */
-    cmd->answer.size = -1;
-    cmd->answer.aset = malloc(sizeof(answer_t));
-    
-    snprintf(cmd->answer.aset->msg, BABBLE_BUFFER_SIZE,"%s[%ld]: has %d followers\n", client->client_name, time(NULL) - server_start, client->nb_follower);
-    
-    return 0;
-}
-
-int run_rdv_command(command_t *cmd)
-{
-    /* lookup client */
-    client_data_t *client = registration_lookup(cmd->key);
-    
-    if(client == NULL){
-        fprintf(stderr, "Error -- no client found\n");
-        generate_cmd_error(cmd);
-        return -1;
-    }
-    
-    /* answer to client */
-    cmd->answer.size = -1;
-    cmd->answer.aset = malloc(sizeof(answer_t));
-    
-    snprintf(cmd->answer.aset->msg, BABBLE_BUFFER_SIZE,"%s[%ld]: rdv_ack\n", client->client_name, time(NULL) - server_start);
-    
-    return 0;
-}
-
-
-int unregisted_client(command_t *cmd)
-{
-    assert(cmd->cid == UNREGISTER);
-    
-    /* remove client */
-    client_data_t *client = registration_remove(cmd->key);
-
-    if(client != NULL){
-        printf("### Unregister client %s (key = %lu)\n", client->client_name, client->key);
-
-        free_client_data(client);
-    }
-    
-
-    return 0;
-}
+#include <stdio.h>
+#include <unistd.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "babble_server.h"
+#include "babble_utils.h"
+#include "babble_types.h"
+#include "babble_communication.h"
+#include "babble_registration.h"
+#include "babble_epoch.h"
+#include "babble_commands.h"
+#include "babble_slab.h"
+
+/* locking
+   + the commands of a client are run in order, one at a time (see the
+     mailbox of its session): only commands of different clients race
+   + commands run in an epoch critical section: a client_data_t they
+     looked up cannot be freed before they complete, even if the
+     client unregisters in the meantime (the lookups in the
+     registration table take no lock, whatever the shard)
+   + a command modifying a client takes its lock; an edge of the
+     follow graph is added or removed (FOLLOW, UNFOLLOW, UNREGISTER)
+     with the locks of both clients held, the smallest key first.
+     Under its lock, a client flagged unregistered must not be linked
+     anymore
+   + the subscribers of a client have their own lock, always taken
+     last (no other client lock is taken while holding it)
+   + publications are appended under the lock of their author but
+     read without any lock (see babble_publication_set.h), and the
+     nb of followers is read atomically: FOLLOW_COUNT, RDV and the
+     scans of TIMELINE run concurrently with anything
+*/
+int process_command(command_t *cmd)
+{
+    int res=0;
+
+    epoch_enter();
+    
+    switch(cmd->cid){
+    case LOGIN:
+        res = run_login_command(cmd);
+        break;
+    case PUBLISH:
+        res = run_publish_command(cmd);
+        break;
+    case FOLLOW:
+        res = run_follow_command(cmd);
+        break;
+    case TIMELINE:
+        res = run_timeline_command(cmd);
+        break;
+    case FOLLOW_COUNT:
+        res = run_fcount_command(cmd);
+        break;
+    case RDV:
+        res = run_rdv_command(cmd);
+        break;
+    case SUBSCRIBE:
+        res = run_subscribe_command(cmd);
+        break;
+    case UNFOLLOW:
+        res = run_unfollow_command(cmd);
+        break;
+    default:
+        fprintf(stderr,"Error -- Unknown command id\n");
+        epoch_exit();
+        return -1;
+    }
+    
+    epoch_exit();
+
+    if(res){
+        fprintf(stderr,"Error -- Failed to run command ");
+        display_command(cmd, stderr);
+    }
+
+    return res;
+}
+
+
+/* freeing client_data_t struct */
+/* called once no command can see the client anymore (see
+ * unregisted_client()) */
+static void free_client_data(void *ptr)
+{
+    client_data_t *client = ptr;
+
+    publication_set_destroy(client->pub_set);
+    client_set_destroy(&client->followed);
+    client_set_destroy(&client->followers);
+    free(client->subscribers);
+
+    pthread_mutex_destroy(&client->lock);
+    pthread_mutex_destroy(&client->subscribers_lock);
+    registration_client_free(client);
+}
+
+/* lock two clients in the key order */
+static void lock_clients(client_data_t *c1, client_data_t *c2)
+{
+    if(c1 == c2){
+        pthread_mutex_lock(&c1->lock);
+        return;
+    }
+    if(c1->key > c2->key){
+        client_data_t *tmp = c1;
+        c1 = c2;
+        c2 = tmp;
+    }
+    pthread_mutex_lock(&c1->lock);
+    pthread_mutex_lock(&c2->lock);
+}
+
+static void unlock_clients(client_data_t *c1, client_data_t *c2)
+{
+    pthread_mutex_unlock(&c1->lock);
+    if(c1 != c2){
+        pthread_mutex_unlock(&c2->lock);
+    }
+}
+
+/* add client to the subscribers of author */
+/* returns -1 if there is not enough memory, the subscribers of author
+ * are unchanged */
+static int subscriber_add(client_data_t *author, client_data_t *client)
+{
+    pthread_mutex_lock(&author->subscribers_lock);
+    if(author->nb_subscribers == author->max_subscribers){
+        int max = author->max_subscribers ? 2 * author->max_subscribers : 4;
+        client_data_t **subscribers = realloc(author->subscribers, max * sizeof(client_data_t*));
+
+        if(subscribers == NULL){
+            pthread_mutex_unlock(&author->subscribers_lock);
+            fprintf(stderr, "Error -- no memory for the subscribers of %s\n", author->client_name);
+            return -1;
+        }
+        author->subscribers = subscribers;
+        author->max_subscribers = max;
+    }
+
+    author->subscribers[author->nb_subscribers++] = client;
+    pthread_mutex_unlock(&author->subscribers_lock);
+
+    return 0;
+}
+
+static void subscriber_remove(client_data_t *author, client_data_t *client)
+{
+    int i;
+
+    pthread_mutex_lock(&author->subscribers_lock);
+    for(i=0; i<author->nb_subscribers; i++){
+        if(author->subscribers[i] == client){
+            author->subscribers[i] = author->subscribers[--author->nb_subscribers];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&author->subscribers_lock);
+}
+
+/* allocate a single answer about client, stored in the answer_set of
+ * the command */
+/* returns NULL if there is not enough memory: nothing is sent */
+static answer_t* new_answer(command_t *cmd, client_data_t *client, long date)
+{
+    answer_t *answer = slab_alloc(&answer_pool);
+
+    if(answer == NULL){
+        fprintf(stderr, "Error -- no memory for the answer\n");
+        cmd->answer.size = -2;
+        cmd->answer.aset = NULL;
+        return NULL;
+    }
+
+    answer->error = 0;
+    strncpy(answer->name, client->client_name, BABBLE_ID_SIZE);
+    answer->name[BABBLE_ID_SIZE] = '\0';
+    answer->date = date;
+    answer->msg[0] = '\0';
+    answer->value = 0;
+    answer->next = NULL;
+
+    cmd->answer.size = -1;
+    cmd->answer.aset = answer;
+
+    return answer;
+}
+
+/* stores an error message in the answer_set of a command */
+void generate_cmd_error(command_t *cmd)
+{
+    /* lookup client */
+    client_data_t *client = registration_lookup(cmd->key);
+
+    if(client == NULL){
+        /* the client left: nothing to answer */
+        fprintf(stderr, "Error -- no client found\n");
+        cmd->answer.size = -2;
+        return;
+    }
+
+    answer_t *answer = new_answer(cmd, client, time(NULL)-server_start);
+    if(answer == NULL){
+        return;
+    }
+    answer->error = 1;
+
+    if(cmd->cid == LOGIN || cmd->cid == PUBLISH || cmd->cid == FOLLOW || cmd->cid == UNFOLLOW){
+        strncpy(answer->msg, cmd->msg, BABBLE_SIZE);
+        answer->msg[BABBLE_SIZE] = '\0';
+    }
+}
+
+
+int run_login_command(command_t *cmd)
+{
+    struct timespec tt;
+    clock_gettime(CLOCK_REALTIME, &tt);
+    
+    /* compute hash of the new client id */
+    cmd->key = hash(cmd->msg);
+    
+    client_data_t *client_data=registration_client_alloc(cmd->key);
+    publication_set_t *pub_set=publication_set_create();
+
+    if(client_data == NULL || pub_set == NULL){
+        fprintf(stderr, "Error -- no memory for client %s\n", cmd->msg);
+        if(client_data != NULL){
+            client_data->key = cmd->key;
+            registration_client_free(client_data);
+        }
+        if(pub_set != NULL){
+            publication_set_destroy(pub_set);
+        }
+        return -1;
+    }
+    
+    strncpy(client_data->client_name, cmd->msg, BABBLE_ID_SIZE);
+    client_data->sock = cmd->sock;
+    client_data->key=cmd->key;
+    client_data->pub_set=pub_set;
+    client_data->last_timeline=(uint64_t)1000000000 * tt.tv_sec + tt.tv_nsec;
+    /* by default, we follow ourself*/
+    /* (both sets are initialized, so that both can be destroyed) */
+    int no_sets = client_set_init(&client_data->followed);
+    no_sets |= client_set_init(&client_data->followers);
+    if(!no_sets){
+        client_set_add(&client_data->followed, client_data->key, client_data);
+        client_set_add(&client_data->followers, client_data->key, client_data);
+    }
+    pthread_mutex_init(&client_data->lock, NULL);
+    client_data->unregistered = 0;
+    client_data->session = cmd->session;
+    client_data->subscribed = 0;
+    pthread_mutex_init(&client_data->subscribers_lock, NULL);
+    client_data->subscribers = NULL;
+    client_data->nb_subscribers = 0;
+    client_data->max_subscribers = 0;
+
+    /* the ack is allocated first: a registered client always gets
+     * it */
+    answer_t *answer = new_answer(cmd, client_data, tt.tv_sec - server_start);
+
+    if(answer == NULL || no_sets || registration_insert(client_data)){
+        publication_set_destroy(client_data->pub_set);
+        client_set_destroy(&client_data->followed);
+        client_set_destroy(&client_data->followers);
+        pthread_mutex_destroy(&client_data->lock);
+        pthread_mutex_destroy(&client_data->subscribers_lock);
+        registration_client_free(client_data);
+        /* the ack becomes the error */
+        if(answer != NULL){
+            answer->error = 1;
+            strncpy(answer->msg, cmd->msg, BABBLE_SIZE);
+            answer->msg[BABBLE_SIZE] = '\0';
+        }
+        return -1;
+    }
+    
+    printf("### New client %s (key = %lu)\n", client_data->client_name, client_data->key);
+
+    /* answer to client */
+    answer->value = client_data->key;
+    
+    return 0;
+}
+
+
+int run_publish_command(command_t *cmd)
+{    
+    client_data_t *client = registration_lookup(cmd->key);
+    
+    if(client == NULL){
+        fprintf(stderr, "Error -- no client found\n");
+        generate_cmd_error(cmd);
+        return -1;
+    }
+    
+    pthread_mutex_lock(&client->lock);
+    publication_t *pub = publication_set_insert(client->pub_set, cmd->msg);
+
+    if(pub == NULL){
+        pthread_mutex_unlock(&client->lock);
+        fprintf(stderr, "Error -- no memory for the publication of %s\n", client->client_name);
+        generate_cmd_error(cmd);
+        return -1;
+    }
+    
+    printf("### Client %s published { %s } at date %ld\n", client->client_name, pub->msg, pub->date);
+
+    /* fan out to the subscribed followers */
+    int i;
+    pthread_mutex_lock(&client->subscribers_lock);
+    for(i=0; i<client->nb_subscribers; i++){
+        session_push_publication(client->subscribers[i]->session, client->client_name, pub);
+    }
+    pthread_mutex_unlock(&client->subscribers_lock);
+    pthread_mutex_unlock(&client->lock);
+
+    /* answer to client */
+    answer_t *answer = new_answer(cmd, client, pub->date);
+    if(answer == NULL){
+        return -1;
+    }
+    strncpy(answer->msg, pub->msg, BABBLE_SIZE);
+    answer->msg[BABBLE_SIZE] = '\0';
+    
+    return 0;
+}
+
+
+int run_follow_command(command_t *cmd)
+{
+    client_data_t *client = registration_lookup(cmd->key);
+    
+    if(client == NULL){
+        fprintf(stderr, "Error -- no client found\n");
+        generate_cmd_error(cmd);
+        return -1;
+    }
+
+    /* compute hash of the client to follow */
+    unsigned long f_key = hash(cmd->msg);
+
+    /* lookup client to follow */
+    client_data_t *f_client = registration_lookup(f_key);
+    
+    if(f_client == NULL){
+        generate_cmd_error(cmd);        
+        return 0;
+    }
+    
+    lock_clients(client, f_client);
+
+    /* one of them is leaving */
+    if(client->unregistered || f_client->unregistered){
+        unlock_clients(client, f_client);
+        generate_cmd_error(cmd);
+        return 0;
+    }
+
+    /* if client is not already followed, add it*/
+    int added = client_set_add(&client->followed, f_key, f_client);
+
+    if(added == 1 && client_set_add(&f_client->followers, client->key, client) == -1){
+        client_set_remove(&client->followed, f_key);
+        added = -1;
+    }
+    if(added == 1 && client->subscribed && subscriber_add(f_client, client) == -1){
+        client_set_remove(&f_client->followers, client->key);
+        client_set_remove(&client->followed, f_key);
+        added = -1;
+    }
+    if(added == 1){
+        printf("### Client %s followed %s\n", client->client_name, f_client->client_name);
+    }
+    unlock_clients(client, f_client);
+
+    if(added == -1){
+        generate_cmd_error(cmd);
+        return 0;
+    }
+
+    
+    /* answer to client */
+    answer_t *answer = new_answer(cmd, client, time(NULL)-server_start);
+    if(answer == NULL){
+        return -1;
+    }
+    strncpy(answer->msg, f_client->client_name, BABBLE_ID_SIZE);
+    answer->msg[BABBLE_ID_SIZE] = '\0';
+
+    return 0;
+}
+
+
+static void free_timeline_items(timeline_item_t *item)
+{
+    timeline_item_t *prev;
+
+    while(item != NULL){
+        prev = item;
+        item = item->next;
+        slab_free(&timeline_item_pool, prev);
+    }
+}
+
+static void free_answer_list(answer_t *item)
+{
+    answer_t *prev;
+
+    while(item != NULL){
+        prev = item;
+        item = item->next;
+        slab_free(&answer_pool, prev);
+    }
+}
+
+int run_timeline_command(command_t *cmd)
+{
+    unsigned long i;
+    timeline_item_t *pub_list=NULL;
+    int item_count=0, no_memory=0;
+    
+    /* get current time to know up to when we publish*/
+    struct timespec tt;
+    clock_gettime(CLOCK_REALTIME, &tt);
+
+    uint64_t end_time= (uint64_t)1000000000 * tt.tv_sec + tt.tv_nsec;
+
+    /* lookup client */
+    client_data_t *client = registration_lookup(cmd->key);
+
+    if(client == NULL){
+        fprintf(stderr, "Error -- no client found\n");
+        generate_cmd_error(cmd);
+        return -1;
+    }
+
+    /* concurrent TIMELINE of the same client would get the same
+     * items */
+    pthread_mutex_lock(&client->lock);
+
+    /* start from where we finished last time*/
+    uint64_t start_time=client->last_timeline;
+
+    /* gather publications over all followed clients */
+    for(i=0; i <= client->followed.mask && !no_memory; i++){
+        client_data_t *f_client=client->followed.slots[i].client;
+        publication_cursor_t cursor;
+        publication_t *pub;
+
+        if(f_client == NULL){
+            continue;
+        }
+
+        /* a publication dated before end_time could still be on its
+         * way to the set */
+        publication_set_wait_insert(f_client->pub_set);
+
+        timeline_item_t *time_iter=pub_list, *prev;
+        /* add recent items to the totally ordered list; if publication
+           is more recent than the timeline command, we do not consider
+           it */
+        publication_set_seek(f_client->pub_set, start_time, &cursor);
+        while((pub = publication_set_next(&cursor, end_time)) != NULL){
+            printf("### Client %s got publication { %s }\n", client->client_name, pub->msg);
+            timeline_item_t *item=slab_alloc(&timeline_item_pool);
+            if(item == NULL){
+                no_memory = 1;
+                break;
+            }
+            item->pub=pub;
+            item->client= f_client;
+            item->next = NULL;
+
+            while(time_iter!=NULL && time_iter->pub->date < pub->date){
+                prev = time_iter;
+                time_iter = time_iter->next;
+            }
+
+            /* insert in first position */
+            if(time_iter == pub_list){
+                pub_list = item;
+                item->next=time_iter;
+            }
+            else{
+                item->next=time_iter;
+                prev->next=item;
+            }
+            item_count++;
+            time_iter = item;
+        }
+    }
+
+
+    /* now that we have a full timeline, we generate the messages to
+     * the client */
+    
+    /* save number of items to transmit */
+    cmd->answer.size = item_count;
+    
+    /* generate each item*/
+    answer_t *current_answer=NULL;
+    timeline_item_t *time_iter=pub_list;
+    while(time_iter != NULL && !no_memory){
+        answer_t *answer = slab_alloc(&answer_pool);
+
+        if(answer == NULL){
+            no_memory = 1;
+            break;
+        }
+        answer->next = NULL;
+        if(current_answer == NULL){
+            cmd->answer.aset = answer;
+        }
+        else{
+            current_answer->next = answer;
+        }
+        current_answer = answer;
+
+        current_answer->error = 0;
+        strncpy(current_answer->name, time_iter->client->client_name, BABBLE_ID_SIZE);
+        current_answer->name[BABBLE_ID_SIZE] = '\0';
+        current_answer->date = time_iter->pub->date;
+        strncpy(current_answer->msg, time_iter->pub->msg, BABBLE_SIZE);
+        current_answer->msg[BABBLE_SIZE] = '\0';
+    
+        timeline_item_t *done = time_iter;
+        time_iter = time_iter->next;
+        slab_free(&timeline_item_pool, done);
+    }
+
+    /* the publications are sent by the next TIMELINE */
+    if(no_memory){
+        pthread_mutex_unlock(&client->lock);
+        fprintf(stderr, "Error -- no memory for the timeline of %s\n", client->client_name);
+        free_timeline_items(time_iter);
+        free_answer_list(cmd->answer.aset);
+        generate_cmd_error(cmd);
+        return -1;
+    }
+
+    client->last_timeline = end_time;
+    pthread_mutex_unlock(&client->lock);
+    
+    return 0;
+}
+
+
+int run_fcount_command(command_t *cmd)
+{
+    /* lookup client */
+    client_data_t *client = registration_lookup(cmd->key);
+
+    if(client == NULL){
+        fprintf(stderr, "Error -- no client found\n");
+        generate_cmd_error(cmd);
+        return -1;
+    }
+    
+    /* answer to client */
+    answer_t *answer = new_answer(cmd, client, time(NULL) - server_start);
+    if(answer == NULL){
+        return -1;
+    }
+    answer->value = __atomic_load_n(&client->followers.nb, __ATOMIC_RELAXED);
+    
+    return 0;
+}
+
+int run_rdv_command(command_t *cmd)
+{
+    /* lookup client */
+    client_data_t *client = registration_lookup(cmd->key);
+    
+    if(client == NULL){
+        fprintf(stderr, "Error -- no client found\n");
+        generate_cmd_error(cmd);
+        return -1;
+    }
+    
+    /* answer to client */
+    if(new_answer(cmd, client, time(NULL) - server_start) == NULL){
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+int run_subscribe_command(command_t *cmd)
+{
+    /* lookup client */
+    client_data_t *client = registration_lookup(cmd->key);
+    unsigned long i, j;
+    int no_memory = 0;
+    
+    if(client == NULL){
+        fprintf(stderr, "Error -- no client found\n");
+        generate_cmd_error(cmd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&client->lock);
+    if(!client->subscribed && !client->unregistered){
+        for(i=0; i<=client->followed.mask; i++){
+            if(client->followed.slots[i].client != NULL
+               && subscriber_add(client->followed.slots[i].client, client) == -1){
+                no_memory = 1;
+                break;
+            }
+        }
+        if(no_memory){
+            /* back to the unsubscribed state */
+            for(j=0; j<i; j++){
+                if(client->followed.slots[j].client != NULL){
+                    subscriber_remove(client->followed.slots[j].client, client);
+                }
+            }
+        }
+        else{
+            printf("### Client %s subscribed\n", client->client_name);
+            client->subscribed = 1;
+        }
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    if(no_memory){
+        generate_cmd_error(cmd);
+        return 0;
+    }
+    
+    /* answer to client */
+    if(new_answer(cmd, client, time(NULL) - server_start) == NULL){
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+/* remove the edge from client to f_client, if any */
+/* returns 1 if it was removed */
+static int unlink_clients(client_data_t *client, client_data_t *f_client)
+{
+    int removed;
+
+    lock_clients(client, f_client);
+    removed = client_set_remove(&client->followed, f_client->key);
+    if(removed){
+        client_set_remove(&f_client->followers, client->key);
+        /* nothing is pushed to the session anymore */
+        if(client->subscribed){
+            subscriber_remove(f_client, client);
+        }
+    }
+    unlock_clients(client, f_client);
+
+    return removed;
+}
+
+
+int run_unfollow_command(command_t *cmd)
+{
+    client_data_t *client = registration_lookup(cmd->key);
+    
+    if(client == NULL){
+        fprintf(stderr, "Error -- no client found\n");
+        generate_cmd_error(cmd);
+        return -1;
+    }
+
+    /* lookup client to unfollow */
+    unsigned long f_key = hash(cmd->msg);
+    client_data_t *f_client = registration_lookup(f_key);
+
+    /* a client cannot stop following itself */
+    if(f_client == NULL || f_client == client){
+        generate_cmd_error(cmd);
+        return 0;
+    }
+
+    if(unlink_clients(client, f_client)){
+        printf("### Client %s unfollowed %s\n", client->client_name, f_client->client_name);
+    }
+
+    /* answer to client */
+    answer_t *answer = new_answer(cmd, client, time(NULL)-server_start);
+    if(answer == NULL){
+        return -1;
+    }
+    strncpy(answer->msg, f_client->client_name, BABBLE_ID_SIZE);
+    answer->msg[BABBLE_ID_SIZE] = '\0';
+
+    return 0;
+}
+
+
+/* a client of set other than client, or NULL (called with the lock of
+ * client held) */
+static client_data_t* other_member(client_set_t *set, client_data_t *client)
+{
+    unsigned long i;
+
+    for(i=0; i<=set->mask; i++){
+        if(set->slots[i].client != NULL && set->slots[i].client != client){
+            return set->slots[i].client;
+        }
+    }
+
+    return NULL;
+}
+
+/* unlink the edges of an unregistered client one by one, without
+ * allocating: the client lock is released before taking the locks of
+ * both clients */
+static void unlink_all_in_place(client_data_t *client)
+{
+    client_data_t *other;
+
+    while(1){
+        pthread_mutex_lock(&client->lock);
+        if((other = other_member(&client->followed, client)) != NULL){
+            pthread_mutex_unlock(&client->lock);
+            unlink_clients(client, other);
+        }
+        else if((other = other_member(&client->followers, client)) != NULL){
+            pthread_mutex_unlock(&client->lock);
+            unlink_clients(other, client);
+        }
+        else{
+            pthread_mutex_unlock(&client->lock);
+            return;
+        }
+    }
+}
+
+/* the caller is in an epoch critical section */
+int unregisted_client(command_t *cmd)
+{
+    client_data_t **followed, **followers;
+    int i, nb_followed, nb_followers;
+
+    assert(cmd->cid == UNREGISTER);
+
+    /* remove client */
+    client_data_t *client = registration_remove(cmd->key);
+
+    if(client == NULL){
+        return 0;
+    }
+
+    printf("### Unregister client %s (key = %lu)\n", client->client_name, client->key);
+
+    /* from now on, nobody can follow it: its edges are the ones of
+     * the sets */
+    pthread_mutex_lock(&client->lock);
+    client->unregistered = 1;
+    followed = client_set_members(&client->followed, &nb_followed);
+    followers = client_set_members(&client->followers, &nb_followers);
+    pthread_mutex_unlock(&client->lock);
+
+    /* no memory for the snapshots: the sets are scanned again for
+     * each edge */
+    if(followed == NULL || followers == NULL){
+        free(followed);
+        free(followers);
+        unlink_all_in_place(client);
+        epoch_retire(client, free_client_data);
+        return 0;
+    }
+
+    /* an edge may be removed meanwhile (UNFOLLOW, the other client
+     * leaving): unlinking is idempotent */
+    for(i=0; i<nb_followed; i++){
+        if(followed[i] != client){
+            unlink_clients(client, followed[i]);
+        }
+    }
+    for(i=0; i<nb_followers; i++){
+        if(followers[i] != client){
+            unlink_clients(followers[i], client);
+        }
+    }
+    free(followed);
+    free(followers);
+
+    /* the commands in progress may still use it */
+    epoch_retire(client, free_client_data);
+
+    return 0;
+}
@@ -1,19 +1,100 @@
 #include "babble_communication.h"
 #include "babble_types.h"
+#include "babble_shm.h"
 
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
-/* writing data of file descriptor */
-static int write_data(int fd, unsigned long size, void* buf)
+/* skip the w first bytes of the iovcnt buffers of iov */
+static void iov_advance(struct iovec **iov, int *iovcnt, unsigned long w)
+{
+    while(*iovcnt > 0 && w >= (*iov)->iov_len){
+        w -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if(*iovcnt > 0){
+        (*iov)->iov_base = (char*) (*iov)->iov_base + w;
+        (*iov)->iov_len -= w;
+    }
+}
+
+/* local clients using the shared memory transport: the frames go
+ * through the rings, the socket is only used to detect a dead server */
+static long shm_writev_data(shm_channel_t *ch, struct iovec *iov, int iovcnt, unsigned long size)
+{
+    unsigned long total_sent=0, w;
+
+    while(total_sent < size){
+        w = shm_channel_writev(ch, iov, iovcnt);
+        if(w > 0){
+            total_sent += w;
+            iov_advance(&iov, &iovcnt, w);
+            shm_channel_notify(ch);
+        }
+        else if(!shm_channel_prepare_wait_write(ch) && shm_channel_wait(ch) == -1){
+            break;
+        }
+    }
+
+    return (total_sent == size) ? total_sent : -1;
+}
+
+static int shm_read_data(shm_channel_t *ch, unsigned long size, void* buf)
+{
+    unsigned long total_recv=0, r;
+
+    while(total_recv < size){
+        r = shm_channel_read(ch, (char*) buf+total_recv, size - total_recv);
+        if(r > 0){
+            total_recv += r;
+            shm_channel_notify(ch);
+        }
+        else if(!shm_channel_prepare_wait_read(ch) && shm_channel_wait(ch) == -1){
+            break;
+        }
+    }
+
+    return (total_recv == size) ? total_recv : -1;
+}
+
+/* writing the iovcnt buffers of iov on file descriptor, with as few
+ * syscalls as possible (iov is modified) */
+/* works on non-blocking sockets too: we wait for the socket to be
+ * writable when the kernel buffer is full */
+static long writev_data(int fd, struct iovec *iov, int iovcnt, unsigned long size)
 {
     unsigned long total_sent=0;
+    ssize_t w;
+    shm_channel_t *ch = shm_channel_lookup(fd);
+
+    if(ch != NULL){
+        return shm_writev_data(ch, iov, iovcnt, size);
+    }
 
     do {
-        total_sent += write(fd, ((char*) buf+total_sent), size - total_sent);
-    } while(total_sent < size && errno != EINTR );
+        w = writev(fd, iov, iovcnt);
+        if(w > 0){
+            total_sent += w;
+
+            /* skip what has been written */
+            iov_advance(&iov, &iovcnt, w);
+        }
+        else if(w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            poll(&pfd, 1, -1);
+        }
+        else if(w == -1 && errno != EINTR){
+            break;
+        }
+    } while(total_sent < size);
 
     
     if(total_sent < size){
@@ -27,10 +108,23 @@ static int write_data(int fd, unsigned long size, void* buf)
 static int read_data(int fd, unsigned long size, void* buf)
 {
     unsigned long total_recv=0;
+    ssize_t r;
+    shm_channel_t *ch = shm_channel_lookup(fd);
 
-    do {
-        total_recv += read(fd, ((char*) buf+total_recv), size - total_recv);
-    } while(total_recv < size && errno == EINTR);
+    if(ch != NULL){
+        return shm_read_data(ch, size, buf);
+    }
+
+    /* large frames (eg binary timelines) can come in several pieces */
+    while(total_recv < size){
+        r = read(fd, ((char*) buf+total_recv), size - total_recv);
+        if(r > 0){
+            total_recv += r;
+        }
+        else if(r == 0 || errno != EINTR){
+            break;
+        }
+    }
 
     if(total_recv < size){
         fprintf(stderr,"received only %lu/%lu bytes\n", total_recv, size);
@@ -44,18 +138,44 @@ static int read_data(int fd, unsigned long size, void* buf)
 
 int network_send(int fd, unsigned long size, void* buf)
 {   
-    if(write_data(fd, sizeof(unsigned long), &size) != sizeof(unsigned long)){
-        perror("writing on socket");
-        return -1;
-    }
+    struct iovec msg = { .iov_base = buf, .iov_len = size };
 
-    
-    if(write_data(fd, size, buf) != size){
-        perror("writing on socket");
-        return -1;
+    return (network_sendv(fd, 1, &msg) == -1) ? -1 : size;
+}
+
+
+long network_sendv(int fd, int count, struct iovec *msgs)
+{
+    unsigned long headers[BABBLE_SENDV_BATCH];
+    struct iovec iov[2 * BABBLE_SENDV_BATCH];
+    long total_payload=0;
+    int i, n;
+
+    while(count > 0){
+        unsigned long size=0;
+
+        n = (count < BABBLE_SENDV_BATCH) ? count : BABBLE_SENDV_BATCH;
+
+        /* header and payload of each msg, in a single writev() */
+        for(i=0; i<n; i++){
+            headers[i] = msgs[i].iov_len;
+            iov[2*i].iov_base = &headers[i];
+            iov[2*i].iov_len = sizeof(unsigned long);
+            iov[2*i+1] = msgs[i];
+            size += sizeof(unsigned long) + msgs[i].iov_len;
+            total_payload += msgs[i].iov_len;
+        }
+
+        if(writev_data(fd, iov, 2*n, size) == -1){
+            perror("writing on socket");
+            return -1;
+        }
+
+        msgs += n;
+        count -= n;
     }
-    
-    return size;
+
+    return total_payload;
 }
 
 
@@ -82,3 +202,260 @@ int network_recv(int fd, void **buf)
     return payload_size;
 }
 
+
+long network_write(int fd, unsigned long size, void* buf)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+
+    if(writev_data(fd, &iov, 1, size) == -1){
+        perror("writing on socket");
+        return -1;
+    }
+
+    return size;
+}
+
+long network_recv_v2(int fd, void **buf)
+{
+    unsigned long payload_size = 0;
+    unsigned char c;
+    int shift=0;
+
+    /* varint header, byte per byte */
+    do {
+        if(read_data(fd, 1, &c) != 1 || shift >= 64){
+            return -1;
+        }
+        payload_size |= (unsigned long)(c & 0x7f) << shift;
+        shift += 7;
+    } while(c & 0x80);
+
+    char* recv_buf = (char*) malloc(payload_size ? payload_size : 1);
+
+    if(read_data(fd, payload_size, recv_buf) != payload_size){
+        free(recv_buf);
+        return -1;
+    }
+
+    *buf = (void*)recv_buf;
+
+    return payload_size;
+}
+
+
+int network_buffer_init(network_buffer_t *nb, char *data, unsigned long size)
+{
+    /* size has to be a power of 2 */
+    if(size == 0 || (size & (size-1)) != 0){
+        fprintf(stderr,"Error -- invalid receive buffer size %lu\n", size);
+        return -1;
+    }
+
+    nb->data = data;
+    nb->size = size;
+    nb->head = 0;
+    nb->tail = 0;
+
+    return 0;
+}
+
+unsigned long network_buffer_free_segment(network_buffer_t *nb, char **start)
+{
+    unsigned long offset = nb->tail & (nb->size-1);
+    unsigned long free_bytes = nb->size - (nb->tail - nb->head);
+
+    *start = nb->data + offset;
+
+    return (offset + free_bytes > nb->size) ? nb->size - offset : free_bytes;
+}
+
+void network_buffer_commit(network_buffer_t *nb, unsigned long len)
+{
+    nb->tail += len;
+}
+
+long network_buffer_fill(int fd, network_buffer_t *nb)
+{
+    struct iovec iov[2];
+    unsigned long free_bytes = nb->size - (nb->tail - nb->head);
+    int iovcnt = 1;
+    ssize_t r;
+
+    iov[0].iov_len = network_buffer_free_segment(nb, (char**) &iov[0].iov_base);
+
+    /* free space wraps around the end of the buffer */
+    if(iov[0].iov_len < free_bytes){
+        iov[1].iov_base = nb->data;
+        iov[1].iov_len = free_bytes - iov[0].iov_len;
+        iovcnt = 2;
+    }
+
+    r = readv(fd, iov, iovcnt);
+    if(r > 0){
+        nb->tail += r;
+    }
+
+    return r;
+}
+
+long network_buffer_fill_fds(int fd, network_buffer_t *nb, int *fds, int max_fds, int *nb_fds)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    char control[CMSG_SPACE(sizeof(int) * BABBLE_SHM_NB_FDS)];
+    unsigned long free_bytes = nb->size - (nb->tail - nb->head);
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    iov[0].iov_len = network_buffer_free_segment(nb, (char**) &iov[0].iov_base);
+    if(iov[0].iov_len < free_bytes){
+        iov[1].iov_base = nb->data;
+        iov[1].iov_len = free_bytes - iov[0].iov_len;
+        msg.msg_iovlen = 2;
+    }
+
+    *nb_fds = 0;
+    r = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if(r > 0){
+        nb->tail += r;
+    }
+
+    for(cmsg = CMSG_FIRSTHDR(&msg); r >= 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *received = (int*) CMSG_DATA(cmsg);
+            int i;
+
+            /* the ones we cannot store are closed */
+            for(i=0; i<n; i++){
+                if(*nb_fds < max_fds){
+                    fds[(*nb_fds)++] = received[i];
+                }
+                else{
+                    close(received[i]);
+                }
+            }
+        }
+    }
+
+    return r;
+}
+
+/* copy len bytes starting at position pos of the ring in dst */
+static void network_buffer_copy(network_buffer_t *nb, unsigned long pos, unsigned long len, char *dst)
+{
+    unsigned long offset = pos & (nb->size-1);
+    unsigned long first = (offset + len > nb->size) ? nb->size - offset : len;
+
+    memcpy(dst, nb->data + offset, first);
+    memcpy(dst + first, nb->data, len - first);
+}
+
+int network_buffer_peek(network_buffer_t *nb, char *dst, unsigned long len)
+{
+    if(nb->tail - nb->head < len){
+        return -1;
+    }
+
+    network_buffer_copy(nb, nb->head, len, dst);
+
+    return 0;
+}
+
+void network_buffer_consume(network_buffer_t *nb, unsigned long len)
+{
+    nb->head += len;
+}
+
+int network_buffer_next_frame(network_buffer_t *nb, char *scratch, char **payload, unsigned long *size)
+{
+    unsigned long payload_size;
+    unsigned long available = nb->tail - nb->head;
+
+    if(available < sizeof(unsigned long)){
+        return 0;
+    }
+
+    network_buffer_copy(nb, nb->head, sizeof(unsigned long), (char*) &payload_size);
+
+    if(payload_size > nb->size - sizeof(unsigned long)){
+        fprintf(stderr,"Error -- frame too large: %lu bytes\n", payload_size);
+        return -1;
+    }
+
+    if(available < sizeof(unsigned long) + payload_size){
+        return 0;
+    }
+
+    unsigned long start = nb->head + sizeof(unsigned long);
+    unsigned long offset = start & (nb->size-1);
+
+    /* the payload is handed out in place when it is contiguous and
+     * already '\0' terminated; otherwise it is rebuilt in scratch */
+    if(payload_size > 0 && offset + payload_size <= nb->size && nb->data[offset + payload_size - 1] == '\0'){
+        *payload = nb->data + offset;
+    }
+    else{
+        network_buffer_copy(nb, start, payload_size, scratch);
+        scratch[payload_size] = '\0';
+        *payload = scratch;
+    }
+
+    *size = payload_size;
+    nb->head = start + payload_size;
+
+    return 1;
+}
+
+int network_buffer_next_frame_v2(network_buffer_t *nb, char *scratch, char **payload, unsigned long *size)
+{
+    unsigned long payload_size=0;
+    unsigned long available = nb->tail - nb->head;
+    unsigned long header=0;
+    unsigned char c;
+
+    /* varint header */
+    do {
+        if(header == available){
+            return 0;
+        }
+        if(header == 9){
+            fprintf(stderr,"Error -- invalid frame header\n");
+            return -1;
+        }
+        c = nb->data[(nb->head + header) & (nb->size-1)];
+        payload_size |= (unsigned long)(c & 0x7f) << (7*header);
+        header++;
+    } while(c & 0x80);
+
+    if(payload_size > nb->size - header){
+        fprintf(stderr,"Error -- frame too large: %lu bytes\n", payload_size);
+        return -1;
+    }
+
+    if(available < header + payload_size){
+        return 0;
+    }
+
+    unsigned long start = nb->head + header;
+    unsigned long offset = start & (nb->size-1);
+
+    if(offset + payload_size <= nb->size){
+        *payload = nb->data + offset;
+    }
+    else{
+        network_buffer_copy(nb, start, payload_size, scratch);
+        *payload = scratch;
+    }
+
+    *size = payload_size;
+    nb->head = start + payload_size;
+
+    return 1;
+}
@@ -1,6 +1,7 @@
 #ifndef __BABBLE_COMMUNICATION_H__
 #define __BABBLE_COMMUNICATION_H__
 
+#include <sys/uio.h>
 
 /**** Implementation of the communication protocol ****/
 
@@ -15,9 +16,62 @@
 /* send the buffer buf of size "size" using the file descriptor fd */
 int network_send(int fd, unsigned long size, void* buf);
 
+/* send count msgs (one packet each) using the file descriptor fd */
+/* headers and payloads are gathered in a single writev() */
+/* returns the number of payload bytes sent */
+long network_sendv(int fd, int count, struct iovec *msgs);
+
 /* recv data from the file descriptor fd */
 /* a buffer is allocated to store the data, its size is returned */
 int network_recv(int fd, void **buf);
 
+/* same for the binary protocol (v2), whose headers are varints */
+/* network_write() sends size bytes that are already framed */
+long network_write(int fd, unsigned long size, void* buf);
+long network_recv_v2(int fd, void **buf);
+
+/**** Streaming decoder ****/
+
+/* ring buffer storing the bytes received on a connection; frames are
+ * decoded in place, without allocation */
+typedef struct network_buffer{
+    char *data;
+    unsigned long size;    /* power of 2 */
+    unsigned long head;    /* next byte to decode */
+    unsigned long tail;    /* next byte to fill */
+} network_buffer_t;
+
+/* use the size bytes of data as a ring buffer */
+int network_buffer_init(network_buffer_t *nb, char *data, unsigned long size);
+
+/* read as much as possible from fd into the ring (single readv) */
+/* returns the number of bytes read, 0 on end of file, -1 on error
+ * (errno is set, EAGAIN when nothing is available) */
+long network_buffer_fill(int fd, network_buffer_t *nb);
+
+/* same with recvmsg(): the file descriptors passed along the bytes
+ * (SCM_RIGHTS) are stored in fds (at most max_fds, the others are
+ * closed) */
+long network_buffer_fill_fds(int fd, network_buffer_t *nb, int *fds, int max_fds, int *nb_fds);
+
+/* contiguous free space of the ring, to be filled by someone else
+ * (eg io_uring), and then committed */
+unsigned long network_buffer_free_segment(network_buffer_t *nb, char **start);
+void network_buffer_commit(network_buffer_t *nb, unsigned long len);
+
+/* decode the next frame of the ring */
+/* returns 1 and a '\0' terminated view of the payload, valid until
+ * the next call; 0 if the frame is not complete yet, -1 if it can
+ * never fit in the ring. scratch (ring size + 1 bytes) is used when
+ * the payload has to be rebuilt */
+int network_buffer_next_frame(network_buffer_t *nb, char *scratch, char **payload, unsigned long *size);
+
+/* same for the binary protocol: the body is not '\0' terminated */
+int network_buffer_next_frame_v2(network_buffer_t *nb, char *scratch, char **payload, unsigned long *size);
+
+/* copy the len first bytes of the ring in dst, without consuming
+ * them; returns -1 if less than len bytes are available */
+int network_buffer_peek(network_buffer_t *nb, char *dst, unsigned long len);
+void network_buffer_consume(network_buffer_t *nb, unsigned long len);
 
 #endif
@@ -2,20 +2,85 @@
 #define __BABBLE_CONFIG_H__
 
 #define BABBLE_BACKLOG 100
+/* pause of an acceptor when the server runs out of fds or kernel
+ * memory (in ms): the pending connections wait in the backlog
+ * meanwhile */
+#define BABBLE_ACCEPT_BACKOFF 50
 
 #define BABBLE_PORT 5656
-#define MAX_CLIENT 1000
-#define MAX_FOLLOW MAX_CLIENT
+/* the registration table is split in shards (at most 256), each one
+ * with its own hash table */
+#define BABBLE_REGISTRATION_SHARDS 16
+/* initial slots of the table of a shard (power of 2): it doubles
+ * when half full */
+#define BABBLE_REGISTRATION_SLOTS 64
+/* freed client_data_t kept by a shard for the next registrations */
+#define BABBLE_REGISTRATION_ARENA_SIZE 64
 
 #define BABBLE_BUFFER_SIZE 256
 #define BABBLE_SIZE 64
+/* publications stored in a chunk of the set of an author */
+#define BABBLE_PUBLICATION_CHUNK 32
+/* retention of the publications, off by default (0 means no limit;
+ * enabled with the server options -r, -R, -m): the oldest chunks of an
+ * author are evicted once it has more than retention_count
+ * publications or once they are older than retention_age seconds, and
+ * the oldest chunks of all the authors are evicted while the chunks
+ * exceed memory_budget bytes. The chunk an author is filling is never
+ * evicted */
+#define BABBLE_RETENTION_COUNT 0
+#define BABBLE_RETENTION_AGE 0
+#define BABBLE_MEMORY_BUDGET 0
+/* period of the eviction thread (in ms) */
+#define BABBLE_EVICTION_PERIOD 1000
 #define BABBLE_ID_SIZE 16
 
 #define BABBLE_DELIMITER " "
 
 #define BABBLE_TIMELINE_MAX 20
 
-#define BABBLE_COMMUNICATION_THREADS 20
-#define BABBLE_EXECUTOR_THREADS 10
+/* threads of the server, unless given on the command line: an I/O
+ * thread (event loop handling client sockets, server option -i) per
+ * BABBLE_CPUS_PER_IO_THREAD CPUs the server may run on, and an
+ * executor (server option -e) per remaining CPU, at least
+ * BABBLE_MIN_EXECUTORS */
+#define BABBLE_CPUS_PER_IO_THREAD 4
+#define BABBLE_MIN_EXECUTORS 2
+/* threads accepting connections (server option -n) are one per I/O
+ * thread by default, each one with its own listening socket and
+ * feeding its own event loop */
+#define BABBLE_EPOLL_EVENTS 64
+/* per-session ring buffer for received and not yet decoded frames
+ * (power of 2) */
+#define BABBLE_RECV_BUFFER_SIZE 4096
+/* max msgs framed in a single writev() */
+#define BABBLE_SENDV_BATCH 64
+
+/* per-session outbound queues: the queue grows by chunks; above the
+ * high watermark the backpressure policy applies (server options -w,
+ * -l, -b), paused reads resume below the low watermark */
+#define BABBLE_OUTBOUND_CHUNK_SIZE 4096
+#define BABBLE_OUTBOUND_HIGH_WATERMARK (1024*1024)
+#define BABBLE_OUTBOUND_LOW_WATERMARK (256*1024)
+/* pausing the reads does not slow down the publications pushed to a
+ * client: with the pause policy, they are dropped once its queue
+ * exceeds BABBLE_OUTBOUND_PUSH_CAP times the high watermark */
+#define BABBLE_OUTBOUND_PUSH_CAP 4
+
+/* io_uring backend (server option -u) */
+#define BABBLE_URING_ENTRIES 256
+/* max sessions per ring (fixed files / registered buffers slots) */
+#define BABBLE_URING_SESSIONS 1024
+/* per-session registered buffer for the bytes being written */
+#define BABBLE_SEND_BUFFER_SIZE 16384
+
+/* shared memory transport for local clients: size of each of the two
+ * rings (power of 2), max fds of a process using it */
+#define BABBLE_SHM_RING_SIZE (64*1024)
+#define BABBLE_SHM_MAX_FDS 4096
+
+/* on SIGTERM, time given to the clients to read their answers (in
+ * seconds) */
+#define BABBLE_DRAIN_TIMEOUT 5
 
 #endif
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "babble_epoch.h"
+
+/* one per thread that ever entered a critical section */
+typedef struct epoch_record{
+    unsigned long epoch;    /* global epoch observed when entering */
+    int active;             /* in a critical section */
+    struct epoch_record *next;
+} epoch_record_t;
+
+/* an object waiting for the end of its grace period */
+typedef struct retired{
+    void *ptr;
+    void (*free_fn)(void*);
+    unsigned long epoch;    /* global epoch when retired */
+    struct retired *next;
+} retired_t;
+
+static unsigned long global_epoch = 0;
+static epoch_record_t *records = NULL;
+static __thread epoch_record_t *self = NULL;
+
+/* limbo lists: the objects retired in epoch e wait in limbo[e % 3],
+ * which is emptied in one step when the global epoch reaches e+2 (it
+ * then holds no object of a later epoch): a retirement or a collection
+ * never walks the objects still in their grace period */
+#define EPOCH_NB_LIMBOS 3
+
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired_t *limbo[EPOCH_NB_LIMBOS];
+static int limbo_len[EPOCH_NB_LIMBOS];
+static int nb_retired = 0;
+
+
+static epoch_record_t* get_record(void)
+{
+    if(self != NULL){
+        return self;
+    }
+
+    self = malloc(sizeof(epoch_record_t));
+    bzero(self, sizeof(epoch_record_t));
+
+    /* records are never removed: the threads of the server live as
+     * long as it does */
+    self->next = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    while(!__atomic_compare_exchange_n(&records, &self->next, self, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+    return self;
+}
+
+void epoch_enter(void)
+{
+    epoch_record_t *rec = get_record();
+
+    __atomic_store_n(&rec->active, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rec->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* free the objects whose grace period ended when the global epoch
+ * reached epoch */
+static void collect(unsigned long epoch)
+{
+    retired_t *item, *to_free=NULL;
+    int i = (epoch + 1) % EPOCH_NB_LIMBOS;
+
+    pthread_mutex_lock(&retired_lock);
+    /* if the epoch advanced again meanwhile, the next advance frees
+     * this list along with the objects of its own epoch */
+    if(__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) == epoch){
+        to_free = limbo[i];
+        limbo[i] = NULL;
+        __atomic_sub_fetch(&nb_retired, limbo_len[i], __ATOMIC_RELAXED);
+        limbo_len[i] = 0;
+    }
+    pthread_mutex_unlock(&retired_lock);
+
+    while(to_free != NULL){
+        item = to_free;
+        to_free = item->next;
+        item->free_fn(item->ptr);
+        free(item);
+    }
+}
+
+/* the global epoch advances once all the active threads observed it;
+ * the thread advancing it collects the objects retired two epochs
+ * before */
+static void try_advance(void)
+{
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    epoch_record_t *rec;
+
+    for(rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next){
+        if(__atomic_load_n(&rec->active, __ATOMIC_SEQ_CST) && __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST) != epoch){
+            return;
+        }
+    }
+
+    if(__atomic_compare_exchange_n(&global_epoch, &epoch, epoch+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+        collect(epoch+1);
+    }
+}
+
+void epoch_exit(void)
+{
+    epoch_record_t *rec = get_record();
+
+    __atomic_store_n(&rec->active, 0, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&nb_retired, __ATOMIC_RELAXED)){
+        try_advance();
+    }
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void*))
+{
+    retired_t *item = malloc(sizeof(retired_t));
+
+    /* without a record of the object, it cannot be freed safely */
+    if(item == NULL){
+        fprintf(stderr, "Warning -- no memory to retire an object, leaked\n");
+        return;
+    }
+    item->ptr = ptr;
+    item->free_fn = free_fn;
+
+    pthread_mutex_lock(&retired_lock);
+    /* ptr is already unlinked: only the threads already in a critical
+     * section can still see it */
+    item->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    item->next = limbo[item->epoch % EPOCH_NB_LIMBOS];
+    limbo[item->epoch % EPOCH_NB_LIMBOS] = item;
+    limbo_len[item->epoch % EPOCH_NB_LIMBOS]++;
+    __atomic_add_fetch(&nb_retired, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&retired_lock);
+}
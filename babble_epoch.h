@@ -0,0 +1,26 @@
+#ifndef __BABBLE_EPOCH_H__
+#define __BABBLE_EPOCH_H__
+
+/**** Epoch-based memory reclamation ****/
+
+/* a thread reading shared objects without holding their lock does it
+ * between epoch_enter() and epoch_exit() (critical sections cannot be
+ * nested). An object unlinked from the shared structures is handed to
+ * epoch_retire(): it is freed once every thread that could still see
+ * it has left its critical section
+   + the global epoch only advances when all the threads in a
+     critical section have observed it
+   + an object retired in epoch e is freed when the global epoch
+     reaches e+2
+   + the threads leaving their critical sections try to advance the
+     global epoch; the one that advances it to e frees all the
+     objects retired in e-2 at once
+*/
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+/* free_fn(ptr) is called when no reader can see ptr anymore */
+void epoch_retire(void *ptr, void (*free_fn)(void*));
+
+#endif
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "babble_event_loop.h"
+#include "babble_server.h"
+#include "babble_session.h"
+#include "babble_affinity.h"
+
+static event_loop_t *event_loops;
+static int nb_event_loops;
+
+/* unregister the socket and drop the reference of the loop */
+static void event_loop_close_session(event_loop_t *loop, session_t *sess)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sess->handle, NULL);
+    if(sess->shm != NULL){
+        /* the client still holds the doorbell: it has to be removed
+         * explicitly */
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sess->shm->wait_fd, NULL);
+    }
+    sess->loop_closed = 1;
+    session_shutdown(sess);
+    session_disconnect(sess);
+    session_put(sess);
+}
+
+/* shared memory transport: move what the client wrote in the ring
+ * into the receive buffer and decode it */
+static int event_loop_read_shm(session_t *sess)
+{
+    shm_channel_t *ch = sess->shm;
+    unsigned long len, r, total;
+    char *start;
+
+    shm_channel_ack(ch);
+
+    /* the doorbell also tells that there is room for our answers */
+    if(session_flush(sess) == -1){
+        return -1;
+    }
+
+    while(1){
+        if(__atomic_load_n(&sess->reads_paused, __ATOMIC_ACQUIRE)){
+            return 0;
+        }
+
+        total=0;
+        do {
+            len = network_buffer_free_segment(&sess->recv, &start);
+            r = (len > 0) ? shm_channel_read(ch, start, len) : 0;
+            network_buffer_commit(&sess->recv, r);
+            total += r;
+        } while(r > 0 && r == len);
+
+        if(total == 0){
+            /* the client rings the doorbell for its next frames */
+            if(shm_channel_prepare_wait_read(ch)){
+                continue;
+            }
+            return 0;
+        }
+
+        /* the client may wait for room in the ring */
+        shm_channel_notify(ch);
+
+        if(session_decode(sess) == -1){
+            return -1;
+        }
+    }
+}
+
+/* read everything available on the socket (we are edge-triggered) */
+/* returns -1 if the session has to be closed */
+static int event_loop_read(session_t *sess)
+{
+    long r;
+
+    while(1){
+        if(sess->shm != NULL){
+            return event_loop_read_shm(sess);
+        }
+
+        /* too much is waiting to be sent to the client: the remaining
+         * bytes stay in the socket until the queue is drained */
+        if(__atomic_load_n(&sess->reads_paused, __ATOMIC_ACQUIRE)){
+            return 0;
+        }
+
+        /* the handshake of the shared memory transport comes with
+         * file descriptors */
+        if(sess->local && sess->protocol == PROTOCOL_UNKNOWN){
+            r = network_buffer_fill_fds(sess->handle, &sess->recv, sess->passed_fds, BABBLE_SHM_NB_FDS, &sess->nb_passed_fds);
+        }
+        else{
+            r = network_buffer_fill(sess->handle, &sess->recv);
+        }
+
+        if(r == 0){
+            return -1;
+        }
+        if(r == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0;
+            }
+            perror("reading from socket");
+            return -1;
+        }
+
+        /* all the complete frames received are processed at once */
+        if(session_decode(sess) == -1){
+            return -1;
+        }
+    }
+}
+
+static void* event_loop_run(void *arg)
+{
+    event_loop_t *loop = (event_loop_t*) arg;
+    struct epoll_event events[BABBLE_EPOLL_EVENTS];
+    int i, n, stop=0;
+
+    while(1){
+        n = epoll_wait(loop->epfd, events, BABBLE_EPOLL_EVENTS, -1);
+
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        /* a session can be reported twice in a batch (its socket and
+         * its doorbell): the batch holds a reference on each event, so
+         * that a session closed by an event stays valid for the next
+         * ones */
+        for(i=0; i<n; i++){
+            if(events[i].data.ptr != NULL){
+                session_get((session_t*) events[i].data.ptr);
+            }
+        }
+
+        for(i=0; i<n; i++){
+            session_t *sess = (session_t*) events[i].data.ptr;
+
+            /* the stop eventfd */
+            if(sess == NULL){
+                stop = 1;
+                continue;
+            }
+
+            if(sess->loop_closed){
+                continue;
+            }
+
+            /* the socket is writable again: send what is queued */
+            if((events[i].events & EPOLLOUT) && session_flush(sess) == -1){
+                event_loop_close_session(loop, sess);
+                continue;
+            }
+
+            if(events[i].events & (EPOLLHUP | EPOLLERR)){
+                event_loop_close_session(loop, sess);
+                continue;
+            }
+
+            /* the client of the rings closed its socket */
+            if(sess->shm != NULL && (events[i].events & EPOLLRDHUP)){
+                event_loop_close_session(loop, sess);
+                continue;
+            }
+
+            if((events[i].events & (EPOLLIN | EPOLLRDHUP)) && event_loop_read(sess) == -1){
+                event_loop_close_session(loop, sess);
+            }
+        }
+
+        for(i=0; i<n; i++){
+            if(events[i].data.ptr != NULL){
+                session_put((session_t*) events[i].data.ptr);
+            }
+        }
+
+        if(stop){
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int event_loop_init(int nb_loops, const int *cpus)
+{
+    int i;
+
+    if(nb_loops < 1){
+        nb_loops = 1;
+    }
+
+    event_loops = malloc(nb_loops * sizeof(event_loop_t));
+    nb_event_loops = nb_loops;
+
+    for(i=0; i<nb_loops; i++){
+        struct epoll_event ev;
+
+        event_loops[i].epfd = epoll_create1(0);
+        if(event_loops[i].epfd == -1){
+            perror("epoll_create1");
+            return -1;
+        }
+
+        event_loops[i].stop_fd = eventfd(0, 0);
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if(event_loops[i].stop_fd == -1 || epoll_ctl(event_loops[i].epfd, EPOLL_CTL_ADD, event_loops[i].stop_fd, &ev) == -1){
+            perror("stop eventfd");
+            return -1;
+        }
+
+        if(affinity_thread_create(&event_loops[i].thread, cpus? cpus[i] : -1, event_loop_run, &event_loops[i])){
+            fprintf(stderr,"Error -- failed to create event loop thread\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int event_loop_add_session(session_t *sess, int loop_id)
+{
+    event_loop_t *loop = &event_loops[loop_id % nb_event_loops];
+    struct epoll_event ev;
+
+    sess->loop = loop;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = sess;
+
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sess->handle, &ev) == -1){
+        perror("epoll_ctl");
+        session_put(sess);
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_loop_attach_shm(session_t *sess)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = sess;
+
+    if(epoll_ctl(sess->loop->epfd, EPOLL_CTL_ADD, sess->shm->wait_fd, &ev) == -1){
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    return 0;
+}
+
+void event_loop_resume_reads(session_t *sess)
+{
+    struct epoll_event ev;
+
+    /* ringing our own doorbell wakes the loop up */
+    if(sess->shm != NULL){
+        uint64_t one=1;
+        if(write(sess->shm->wait_fd, &one, sizeof(one)) == -1){
+            perror("shm doorbell");
+        }
+        return;
+    }
+
+    /* re-arming the socket reports it again if data is available */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = sess;
+
+    epoll_ctl(sess->loop->epfd, EPOLL_CTL_MOD, sess->handle, &ev);
+}
+
+void event_loop_shutdown(void)
+{
+    uint64_t one=1;
+    int i;
+
+    for(i=0; i<nb_event_loops; i++){
+        if(write(event_loops[i].stop_fd, &one, sizeof(one)) == -1){
+            perror("stop eventfd");
+        }
+    }
+
+    for(i=0; i<nb_event_loops; i++){
+        pthread_join(event_loops[i].thread, NULL);
+    }
+}
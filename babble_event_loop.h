@@ -0,0 +1,38 @@
+#ifndef __BABBLE_EVENT_LOOP_H__
+#define __BABBLE_EVENT_LOOP_H__
+
+#include <pthread.h>
+
+#include "babble_types.h"
+
+/* an epoll reactor: reads client sockets (edge-triggered,
+ * non-blocking), decodes frames and hands them to the server, and
+ * flushes the outbound queues the socket could not take at once */
+typedef struct event_loop{
+    int epfd;
+    int stop_fd;    /* eventfd, written to stop the loop */
+    pthread_t thread;
+} event_loop_t;
+
+/* start nb_loops event loop threads, loop i pinned to cpus[i] (cpus
+ * can be NULL) */
+int event_loop_init(int nb_loops, const int *cpus);
+
+/* register a new session (non-blocking socket) in the loop loop_id
+ * (modulo the number of loops) */
+/* the loop takes over the reference of the caller */
+int event_loop_add_session(session_t *sess, int loop_id);
+
+/* the session switched to the shared memory transport: wait on its
+ * doorbell too (called by the loop of the session) */
+int event_loop_attach_shm(session_t *sess);
+
+/* the outbound queue of the session has been drained: read the
+ * client again (can be called from any thread) */
+void event_loop_resume_reads(session_t *sess);
+
+/* stop the event loop threads and join them (the sessions are left as
+ * they are) */
+void event_loop_shutdown(void);
+
+#endif
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "babble_protocol.h"
+
+int proto_put_varint(char *buf, uint64_t value)
+{
+    int n=0;
+
+    while(value >= 0x80){
+        buf[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (char)value;
+
+    return n;
+}
+
+int proto_get_varint(const char *buf, unsigned long size, uint64_t *value)
+{
+    uint64_t v=0;
+    int shift=0;
+    unsigned long n=0;
+
+    while(n < size && n < BABBLE_VARINT_MAX){
+        unsigned char c = buf[n++];
+
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80)){
+            *value = v;
+            return n;
+        }
+        shift += 7;
+    }
+
+    return -1;
+}
+
+int proto_put_string(char *buf, const char *str)
+{
+    unsigned long len = strlen(str);
+    int n = proto_put_varint(buf, len);
+
+    memcpy(buf + n, str, len);
+
+    return n + len;
+}
+
+int proto_get_string(const char *buf, unsigned long size, char *dst, unsigned long max)
+{
+    uint64_t len;
+    int n = proto_get_varint(buf, size, &len);
+
+    if(n == -1 || len > size - n){
+        return -1;
+    }
+
+    unsigned long copy = (len < max) ? len : max-1;
+    memcpy(dst, buf + n, copy);
+    dst[copy] = '\0';
+
+    return n + len;
+}
+
+
+/* opcode, and request id if any */
+static int encode_opcode(char *buf, int op, int with_req_id, uint64_t req_id)
+{
+    if(!with_req_id){
+        buf[0] = op;
+        return 1;
+    }
+
+    buf[0] = op | BABBLE_V2_REQID;
+    return 1 + proto_put_varint(buf + 1, req_id);
+}
+
+int proto_decode_opcode(const char *body, unsigned long size, int *op, int *with_req_id, uint64_t *req_id)
+{
+    int n;
+
+    if(size == 0){
+        return -1;
+    }
+
+    *op = (unsigned char) body[0] & ~BABBLE_V2_REQID;
+    *with_req_id = (body[0] & BABBLE_V2_REQID) != 0;
+    *req_id = 0;
+
+    if(!*with_req_id){
+        return 1;
+    }
+
+    if((n = proto_get_varint(body + 1, size - 1, req_id)) == -1){
+        return -1;
+    }
+
+    return 1 + n;
+}
+
+
+int proto_encode_command(char *buf, int cid, int ack_req, const char *arg, int with_req_id, uint64_t req_id)
+{
+    char body[BABBLE_V2_REQUEST_MAX];
+    int size=0, n;
+
+    size += encode_opcode(body, cid | (ack_req ? 0 : BABBLE_V2_NOACK), with_req_id, req_id);
+    if(arg != NULL){
+        size += proto_put_string(body + size, arg);
+    }
+
+    n = proto_put_varint(buf, size);
+    memcpy(buf + n, body, size);
+
+    return n + size;
+}
+
+int proto_decode_command(char *body, unsigned long size, command_t *cmd)
+{
+    int op, h, n;
+
+    if((h = proto_decode_opcode(body, size, &op, &cmd->with_req_id, &cmd->req_id)) == -1){
+        fprintf(stderr,"Error -- truncated request\n");
+        return -1;
+    }
+
+    cmd->cid = op & BABBLE_V2_CID_MASK;
+    cmd->answer_exp = !(op & BABBLE_V2_NOACK);
+    cmd->answer.size=-1;
+    cmd->answer.aset=NULL;
+    cmd->msg[0]='\0';
+
+    switch(cmd->cid){
+    case LOGIN:
+    case FOLLOW:
+    case UNFOLLOW:
+        n = proto_get_string(body+h, size-h, cmd->msg, BABBLE_ID_SIZE+1);
+        break;
+    case PUBLISH:
+        n = proto_get_string(body+h, size-h, cmd->msg, BABBLE_SIZE+1);
+        break;
+    case TIMELINE:
+    case FOLLOW_COUNT:
+    case RDV:
+    case SUBSCRIBE:
+        n = 0;
+        break;
+    default:
+        fprintf(stderr,"Error -- invalid client command -> %d\n", cmd->cid);
+        return -1;
+    }
+
+    if(n == -1 || (cmd->cid != PUBLISH && cmd->cid != RDV && cmd->cid != FOLLOW && cmd->cid != UNFOLLOW && !cmd->answer_exp)){
+        fprintf(stderr,"Error -- invalid request -> %d\n", cmd->cid);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* fields common to all the single answers */
+static int encode_answer_header(char *buf, answer_t *answer)
+{
+    int n=0;
+
+    n += proto_put_string(buf + n, answer->name);
+    n += proto_put_varint(buf + n, answer->date);
+
+    return n;
+}
+
+int proto_encode_answer(char *buf, command_t *cmd)
+{
+    answer_t *answer = cmd->answer.aset;
+    int n=0;
+
+    if(cmd->answer.size >= 0){
+        /* timeline: only the last BABBLE_TIMELINE_MAX are sent */
+        int to_send = (cmd->answer.size > BABBLE_TIMELINE_MAX) ? BABBLE_TIMELINE_MAX : cmd->answer.size;
+        int to_skip = cmd->answer.size - to_send;
+
+        n += encode_opcode(buf, cmd->cid, cmd->with_req_id, cmd->req_id);
+        n += proto_put_varint(buf + n, cmd->answer.size);
+        n += proto_put_varint(buf + n, to_send);
+
+        for(; answer != NULL; answer = answer->next){
+            if(to_skip > 0){
+                to_skip--;
+                continue;
+            }
+            n += proto_put_string(buf + n, answer->name);
+            n += proto_put_varint(buf + n, answer->date);
+            n += proto_put_string(buf + n, answer->msg);
+        }
+
+        return n;
+    }
+
+    if(answer->error){
+        n += encode_opcode(buf, BABBLE_V2_ERROR, cmd->with_req_id, cmd->req_id);
+        buf[n++] = cmd->cid;
+        n += encode_answer_header(buf + n, answer);
+        n += proto_put_string(buf + n, answer->msg);
+        return n;
+    }
+
+    n += encode_opcode(buf, cmd->cid, cmd->with_req_id, cmd->req_id);
+    n += encode_answer_header(buf + n, answer);
+
+    switch(cmd->cid){
+    case LOGIN:
+        n += proto_put_varint(buf + n, answer->value);
+        break;
+    case PUBLISH:
+    case FOLLOW:
+    case UNFOLLOW:
+        n += proto_put_string(buf + n, answer->msg);
+        break;
+    case FOLLOW_COUNT:
+        n += proto_put_varint(buf + n, answer->value);
+        break;
+    default:
+        break;
+    }
+
+    return n;
+}
+
+int proto_encode_push(char *buf, answer_t *items, int max)
+{
+    answer_t *item;
+    int n=0, nb_items=0;
+
+    for(item = items; item != NULL && nb_items < max; item = item->next){
+        nb_items++;
+    }
+
+    buf[n++] = BABBLE_V2_PUSH;
+    n += proto_put_varint(buf + n, nb_items);
+
+    for(item = items; nb_items > 0; item = item->next, nb_items--){
+        n += proto_put_string(buf + n, item->name);
+        n += proto_put_varint(buf + n, item->date);
+        n += proto_put_string(buf + n, item->msg);
+    }
+
+    return n;
+}
+
+int proto_decode_answer(char *body, unsigned long size, int *cid, answer_t *answer)
+{
+    unsigned long n;
+    uint64_t v;
+    int r, op, with_req_id;
+
+    if((r = proto_decode_opcode(body, size, &op, &with_req_id, &v)) == -1){
+        return -1;
+    }
+    n = r;
+
+    *cid = op & BABBLE_V2_CID_MASK;
+    answer->error = (*cid == BABBLE_V2_ERROR);
+    answer->msg[0] = '\0';
+    answer->value = 0;
+
+    /* id of the failed command */
+    if(answer->error){
+        if(n >= size){
+            return -1;
+        }
+        n++;
+    }
+
+    if((r = proto_get_string(body + n, size - n, answer->name, BABBLE_ID_SIZE+1)) == -1){
+        return -1;
+    }
+    n += r;
+    if((r = proto_get_varint(body + n, size - n, &v)) == -1){
+        return -1;
+    }
+    n += r;
+    answer->date = v;
+
+    if(answer->error || *cid == PUBLISH || *cid == FOLLOW || *cid == UNFOLLOW){
+        r = proto_get_string(body + n, size - n, answer->msg, BABBLE_SIZE+1);
+    }
+    else if(*cid == LOGIN || *cid == FOLLOW_COUNT){
+        r = proto_get_varint(body + n, size - n, &v);
+        answer->value = v;
+    }
+    else{
+        r = 0;
+    }
+
+    return (r == -1) ? -1 : 0;
+}
+
+int proto_decode_timeline(char *body, unsigned long size, int *total, answer_t *items, int max)
+{
+    unsigned long n;
+    uint64_t v, nb_items;
+    int r, i, op, with_req_id;
+
+    if((r = proto_decode_opcode(body, size, &op, &with_req_id, &v)) == -1 || (op & BABBLE_V2_CID_MASK) != TIMELINE){
+        return -1;
+    }
+    n = r;
+
+    if((r = proto_get_varint(body + n, size - n, &v)) == -1){
+        return -1;
+    }
+    n += r;
+    *total = v;
+
+    if((r = proto_get_varint(body + n, size - n, &nb_items)) == -1){
+        return -1;
+    }
+    n += r;
+
+    for(i=0; i < nb_items; i++){
+        answer_t item;
+        answer_t *dst = (i < max) ? &items[i] : &item;
+
+        if((r = proto_get_string(body + n, size - n, dst->name, BABBLE_ID_SIZE+1)) == -1){
+            return -1;
+        }
+        n += r;
+        if((r = proto_get_varint(body + n, size - n, &v)) == -1){
+            return -1;
+        }
+        n += r;
+        dst->date = v;
+        if((r = proto_get_string(body + n, size - n, dst->msg, BABBLE_SIZE+1)) == -1){
+            return -1;
+        }
+        n += r;
+        dst->error = 0;
+    }
+
+    return nb_items;
+}
+
+int proto_decode_push(char *body, unsigned long size, answer_t *items, int max)
+{
+    unsigned long n=1;
+    uint64_t v, nb_items;
+    int r, i;
+
+    if(size == 0 || (unsigned char) body[0] != BABBLE_V2_PUSH){
+        return -1;
+    }
+
+    if((r = proto_get_varint(body + n, size - n, &nb_items)) == -1){
+        return -1;
+    }
+    n += r;
+
+    for(i=0; i < nb_items; i++){
+        answer_t item;
+        answer_t *dst = (i < max) ? &items[i] : &item;
+
+        if((r = proto_get_string(body + n, size - n, dst->name, BABBLE_ID_SIZE+1)) == -1){
+            return -1;
+        }
+        n += r;
+        if((r = proto_get_varint(body + n, size - n, &v)) == -1){
+            return -1;
+        }
+        n += r;
+        dst->date = v;
+        if((r = proto_get_string(body + n, size - n, dst->msg, BABBLE_SIZE+1)) == -1){
+            return -1;
+        }
+        n += r;
+        dst->error = 0;
+    }
+
+    return nb_items;
+}
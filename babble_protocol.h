@@ -0,0 +1,110 @@
+#ifndef __BABBLE_PROTOCOL_H__
+#define __BABBLE_PROTOCOL_H__
+
+#include <stdint.h>
+
+#include "babble_types.h"
+
+/**** Binary protocol (v2) ****/
+
+/* a client selects it by sending BABBLE_V2_MAGIC as the very first
+ * bytes of the connection (a text frame can never start with them:
+ * it would announce a payload of more than 800MB); otherwise the
+ * connection keeps using the text protocol
+
+   + each frame is a varint (LEB128) length followed by the body
+   + the body starts with a 1-byte opcode:
+     -- bits 0-5: command id, or BABBLE_V2_ERROR in an answer
+     -- BABBLE_V2_NOACK (requests only): no answer expected (the
+        streaming 'S' variant of the text protocol)
+     -- BABBLE_V2_REQID: a varint request id follows the opcode; the
+        answer carries the same flag and id, so that a client can
+        pipeline requests and match answers in any order
+   + strings are a varint length followed by the bytes (no '\0')
+   + integers and dates are varints
+
+   requests: LOGIN, PUBLISH, FOLLOW, UNFOLLOW carry one string, the
+   other commands nothing
+
+   answers: [op][client name][date] followed by
+     -- LOGIN: varint key
+     -- PUBLISH: string msg
+     -- FOLLOW, UNFOLLOW: string (un)followed client
+     -- FOLLOW_COUNT: varint nb of followers
+     -- RDV: nothing
+     -- ERROR: the id of the failed command is stored right after op,
+        the payload of the command follows the date
+   except TIMELINE: [op][total nb of items][nb of items sent] and, for
+   each item, [author][date][msg]
+
+   once SUBSCRIBE is acknowledged, the server also sends unsolicited
+   frames with the publications of the followed clients:
+   [BABBLE_V2_PUSH][nb of items] and, for each item, [author][date][msg]
+*/
+
+#define BABBLE_V2_MAGIC "BBL2"
+#define BABBLE_V2_MAGIC_SIZE 4
+
+#define BABBLE_V2_CID_MASK 0x3f
+#define BABBLE_V2_ERROR 0x3f
+#define BABBLE_V2_PUSH 0x3e
+#define BABBLE_V2_NOACK 0x80
+#define BABBLE_V2_REQID 0x40
+
+/* max size of an encoded varint */
+#define BABBLE_VARINT_MAX 10
+
+/* max size of a frame (header included) sent by the server */
+#define BABBLE_V2_FRAME_MAX (BABBLE_VARINT_MAX + 1 + 3*BABBLE_VARINT_MAX \
+                             + BABBLE_TIMELINE_MAX * (3*BABBLE_VARINT_MAX + BABBLE_ID_SIZE + BABBLE_SIZE))
+
+/* max size of a request (header included) */
+#define BABBLE_V2_REQUEST_MAX (BABBLE_VARINT_MAX + 1 + 2*BABBLE_VARINT_MAX + BABBLE_SIZE)
+
+/* encoding helpers: return the number of bytes written in buf */
+int proto_put_varint(char *buf, uint64_t value);
+int proto_put_string(char *buf, const char *str);
+
+/* decoding helpers: return the number of bytes consumed, -1 if the
+ * input (size bytes) is truncated */
+int proto_get_varint(const char *buf, unsigned long size, uint64_t *value);
+/* the string is truncated to max-1 bytes and '\0' terminated */
+int proto_get_string(const char *buf, unsigned long size, char *dst, unsigned long max);
+
+/* encode a request in buf, frame header included (arg can be NULL) */
+/* req_id is only sent if with_req_id is set */
+/* returns the size of the frame */
+int proto_encode_command(char *buf, int cid, int ack_req, const char *arg, int with_req_id, uint64_t req_id);
+
+/* decode the opcode of a body, and the request id that may follow */
+/* returns the number of bytes consumed */
+int proto_decode_opcode(const char *body, unsigned long size, int *op, int *with_req_id, uint64_t *req_id);
+
+/* decode the body of a request into cmd (cid, answer_exp, req_id,
+ * msg) */
+int proto_decode_command(char *body, unsigned long size, command_t *cmd);
+
+/* encode the answer of a processed command in buf (at least
+ * BABBLE_V2_FRAME_MAX bytes), frame header excluded */
+/* returns the size of the body */
+int proto_encode_answer(char *buf, command_t *cmd);
+
+/* decode a single answer; *cid is set to the opcode command id
+ * (BABBLE_V2_ERROR for errors) */
+int proto_decode_answer(char *body, unsigned long size, int *cid, answer_t *answer);
+
+/* decode a timeline answer: the total nb of items is returned in
+ * total, and at most max items are stored in items */
+/* returns the nb of items received */
+int proto_decode_timeline(char *body, unsigned long size, int *total, answer_t *items, int max);
+
+/* encode a push frame with at most max items of the list, frame
+ * header excluded (buf holds at least BABBLE_V2_FRAME_MAX bytes) */
+/* returns the size of the body */
+int proto_encode_push(char *buf, answer_t *items, int max);
+
+/* decode a push frame: at most max items are stored in items */
+/* returns the nb of items received */
+int proto_decode_push(char *body, unsigned long size, answer_t *items, int max);
+
+#endif
@@ -2,63 +2,544 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sched.h>
+#include <errno.h>
 
 #include "babble_publication_set.h"
 #include "babble_server.h"
+#include "babble_epoch.h"
+
+#define PUBLICATION_INDEX_MIN 4
+
+/* chunks of the sets (the evicted ones are not counted, even if they
+ * are not freed yet) */
+static unsigned long nb_chunks = 0;
+static unsigned long nb_evicted = 0;
+
+/* retention (0: no limit) */
+static int retention_count = 0;
+static uint64_t retention_age = 0;      /* in ns */
+static unsigned long budget_chunks = 0;
+
+/* all the sets */
+static pthread_mutex_t sets_lock = PTHREAD_MUTEX_INITIALIZER;
+static publication_set_t *sets = NULL;
+static int nb_sets = 0;
+
+/* eviction thread */
+static pthread_t eviction_thread;
+static pthread_mutex_t eviction_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t eviction_cond = PTHREAD_COND_INITIALIZER;
+static int eviction_stopping = 0;
+
+static publication_index_t* index_alloc(int size)
+{
+    publication_index_t *index = malloc(sizeof(publication_index_t) + size * sizeof(publication_chunk_t*));
+
+    if(index == NULL){
+        return NULL;
+    }
+    index->nb_chunks = 0;
+    index->size = size;
+
+    return index;
+}
 
 publication_set_t* publication_set_create(void)
 {
     publication_set_t* new_set= malloc(sizeof(publication_set_t));
+
+    if(new_set == NULL){
+        return NULL;
+    }
     new_set->first = NULL;
     new_set->last = NULL;
+    new_set->index = index_alloc(PUBLICATION_INDEX_MIN);
+    if(new_set->index == NULL){
+        free(new_set);
+        return NULL;
+    }
+    new_set->last_ndate = 0;
+    new_set->inserting = 0;
+    pthread_mutex_init(&new_set->lock, NULL);
+    new_set->refs = 0;
+    new_set->destroyed = 0;
+
+    pthread_mutex_lock(&sets_lock);
+    new_set->prev_set = NULL;
+    new_set->next_set = sets;
+    if(sets != NULL){
+        sets->prev_set = new_set;
+    }
+    sets = new_set;
+    __atomic_store_n(&nb_sets, nb_sets + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sets_lock);
 
     return new_set;
 }
 
+static void set_free(publication_set_t *set)
+{
+    publication_chunk_t *chunk = set->first, *next;
+
+    while(chunk != NULL){
+        next = chunk->next;
+        free(chunk);
+        __atomic_sub_fetch(&nb_chunks, 1, __ATOMIC_RELAXED);
+        chunk = next;
+    }
+    pthread_mutex_destroy(&set->lock);
+    free(set->index);
+    free(set);
+}
+
+void publication_set_destroy(publication_set_t *set)
+{
+    int held;
+
+    pthread_mutex_lock(&sets_lock);
+    if(set->prev_set != NULL){
+        set->prev_set->next_set = set->next_set;
+    }
+    else{
+        sets = set->next_set;
+    }
+    if(set->next_set != NULL){
+        set->next_set->prev_set = set->prev_set;
+    }
+    __atomic_store_n(&nb_sets, nb_sets - 1, __ATOMIC_RELAXED);
+    /* the eviction thread frees it when it releases it */
+    held = (set->refs > 0);
+    set->destroyed = held;
+    pthread_mutex_unlock(&sets_lock);
+
+    if(!held){
+        set_free(set);
+    }
+}
+
+void publication_set_retention(int max_count, int max_age, unsigned long budget)
+{
+    retention_count = max_count;
+    retention_age = (uint64_t)1000000000 * max_age;
+    budget_chunks = budget / sizeof(publication_chunk_t);
+}
+
+unsigned long publication_set_nb_chunks(void)
+{
+    return __atomic_load_n(&nb_chunks, __ATOMIC_RELAXED);
+}
+
+unsigned long publication_set_nb_evicted(void)
+{
+    return __atomic_load_n(&nb_evicted, __ATOMIC_RELAXED);
+}
+
+static uint64_t now_ndate(void)
+{
+    struct timespec tt;
+
+    clock_gettime(CLOCK_REALTIME, &tt);
+    return (uint64_t)1000000000 * tt.tv_sec + tt.tv_nsec;
+}
+
+/* evict the oldest chunks of the set that are dated up to cutoff, or
+ * that hold more than the retention count; the last one is kept
+ * (called with the lock of the set held) */
+/* returns the nb of chunks evicted */
+static int set_evict(publication_set_t *set, uint64_t cutoff)
+{
+    publication_index_t *index = set->index, *shorter;
+    int nb = index->nb_chunks, n = 0, i;
+    long retained;
+
+    if(nb < 2){
+        return 0;
+    }
+
+    retained = (long)(nb - 1) * BABBLE_PUBLICATION_CHUNK + __atomic_load_n(&set->last->count, __ATOMIC_ACQUIRE);
+
+    /* all the chunks but the last one are full */
+    while(n < nb - 1){
+        if(index->chunks[n]->ndates[BABBLE_PUBLICATION_CHUNK-1] <= cutoff
+           || (retention_count && retained - BABBLE_PUBLICATION_CHUNK >= retention_count)){
+            retained -= BABBLE_PUBLICATION_CHUNK;
+            n++;
+        }
+        else{
+            break;
+        }
+    }
+
+    if(n == 0){
+        return 0;
+    }
+
+    /* the chunks are evicted next time */
+    if((shorter = index_alloc(index->size)) == NULL){
+        return 0;
+    }
+    memcpy(shorter->chunks, index->chunks + n, (nb - n) * sizeof(publication_chunk_t*));
+    shorter->nb_chunks = nb - n;
+    __atomic_store_n(&set->index, shorter, __ATOMIC_RELEASE);
+    set->first = shorter->chunks[0];
+
+    /* readers may still search the old index, or read the chunks */
+    for(i=0; i<n; i++){
+        epoch_retire(index->chunks[i], free);
+    }
+    epoch_retire(index, free);
+    __atomic_sub_fetch(&nb_chunks, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&nb_evicted, n, __ATOMIC_RELAXED);
+
+    return n;
+}
+
+/* date up to which the chunks are evicted because of their age */
+static uint64_t age_cutoff(uint64_t now)
+{
+    return (retention_age && now > retention_age)? now - retention_age : 0;
+}
+
+/* add a chunk, already holding a publication, at the end of the
+ * index */
+/* returns -1 if the index cannot grow */
+static int index_append(publication_set_t *set, publication_chunk_t *chunk)
+{
+    publication_index_t *index = set->index;
+
+    if(index->nb_chunks == index->size){
+        publication_index_t *larger = index_alloc(2 * index->size);
+
+        if(larger == NULL){
+            return -1;
+        }
+        memcpy(larger->chunks, index->chunks, index->nb_chunks * sizeof(publication_chunk_t*));
+        larger->nb_chunks = index->nb_chunks;
+        __atomic_store_n(&set->index, larger, __ATOMIC_RELEASE);
+        /* readers may still search the old one */
+        epoch_retire(index, free);
+        index = larger;
+    }
+
+    index->chunks[index->nb_chunks] = chunk;
+    __atomic_store_n(&index->nb_chunks, index->nb_chunks + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
 
 publication_t* publication_set_insert(publication_set_t *set, char* msg)
 {
+    publication_chunk_t *chunk = set->last;
+    publication_t *pub;
     struct timespec tt;
-    
-    publication_t *pub= malloc(sizeof(publication_t));
-    
-    strncpy(pub->msg, msg, BABBLE_SIZE);
-    pub->next=NULL;
+    uint64_t ndate;
+    int pos;
+
+    __atomic_store_n(&set->inserting, 1, __ATOMIC_SEQ_CST);
 
     clock_gettime(CLOCK_REALTIME, &tt);
-    
-    pub->date= tt.tv_sec - server_start;
-    pub->ndate = (uint64_t)1000000000 * tt.tv_sec + tt.tv_nsec;
-    
-    /* inserting the new publication in list */
-    if(set->first == NULL){
-        set->first = pub;
-        set->last = pub;
+
+    /* the column stays sorted, even if the clock goes back */
+    ndate = (uint64_t)1000000000 * tt.tv_sec + tt.tv_nsec;
+    if(ndate < set->last_ndate){
+        ndate = set->last_ndate;
     }
-    else{
-        set->last->next = pub;
-        set->last = pub;
+    set->last_ndate = ndate;
+
+    if(chunk == NULL || chunk->count == BABBLE_PUBLICATION_CHUNK){
+        chunk = malloc(sizeof(publication_chunk_t));
+        if(chunk == NULL){
+            __atomic_store_n(&set->inserting, 0, __ATOMIC_RELEASE);
+            return NULL;
+        }
+        chunk->next = NULL;
+        chunk->count = 0;
+        __atomic_add_fetch(&nb_chunks, 1, __ATOMIC_RELAXED);
+    }
+
+    pos = chunk->count;
+    pub = &chunk->pubs[pos];
+    strncpy(pub->msg, msg, BABBLE_SIZE);
+    pub->date = tt.tv_sec - server_start;
+    chunk->ndates[pos] = ndate;
+
+    /* readers only see the publication once it is complete */
+    __atomic_store_n(&chunk->count, pos + 1, __ATOMIC_RELEASE);
+
+    /* a new chunk is linked once it holds its first publication */
+    if(pos == 0){
+        pthread_mutex_lock(&set->lock);
+        /* the chunk is not visible yet */
+        if(index_append(set, chunk) == -1){
+            pthread_mutex_unlock(&set->lock);
+            free(chunk);
+            __atomic_sub_fetch(&nb_chunks, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&set->inserting, 0, __ATOMIC_RELEASE);
+            return NULL;
+        }
+        if(set->last == NULL){
+            __atomic_store_n(&set->first, chunk, __ATOMIC_RELEASE);
+        }
+        else{
+            __atomic_store_n(&set->last->next, chunk, __ATOMIC_RELEASE);
+        }
+        set->last = chunk;
+        set_evict(set, age_cutoff(ndate));
+        pthread_mutex_unlock(&set->lock);
     }
-    
+
+    __atomic_store_n(&set->inserting, 0, __ATOMIC_RELEASE);
+
     return pub;
 }
 
 
-publication_t* publication_set_getnext(publication_set_t *set, publication_t* last_pub, uint64_t min_date)
-{   
-    if(last_pub != NULL){
-        if(last_pub->next == NULL || last_pub->next->ndate >= min_date){
-            return last_pub->next;
+void publication_set_seek(publication_set_t *set, uint64_t min_date, publication_cursor_t *cursor)
+{
+    publication_index_t *index = __atomic_load_n(&set->index, __ATOMIC_ACQUIRE);
+    int nb = __atomic_load_n(&index->nb_chunks, __ATOMIC_ACQUIRE);
+    publication_chunk_t *chunk;
+    int lo, hi, mid, count;
+
+    if(nb == 0){
+        cursor->chunk = NULL;
+        cursor->pos = 0;
+        return;
+    }
+
+    /* last chunk starting before min_date: the first chunk whose first
+     * date is min_date or later is lo */
+    lo = 0;
+    hi = nb;
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(index->chunks[mid]->ndates[0] < min_date){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    chunk = index->chunks[lo > 0 ? lo - 1 : 0];
+
+    /* first date of the chunk that is min_date or later */
+    count = __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE);
+    lo = 0;
+    hi = count;
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(chunk->ndates[mid] < min_date){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+
+    cursor->chunk = chunk;
+    cursor->pos = lo;
+}
+
+publication_t* publication_set_next(publication_cursor_t *cursor, uint64_t max_date)
+{
+    publication_chunk_t *chunk = cursor->chunk;
+
+    if(chunk == NULL){
+        return NULL;
+    }
+
+    if(cursor->pos == __atomic_load_n(&chunk->count, __ATOMIC_ACQUIRE)){
+        publication_chunk_t *next = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE);
+
+        if(next == NULL){
+            return NULL;
+        }
+        chunk = cursor->chunk = next;
+        cursor->pos = 0;
+    }
+
+    if(chunk->ndates[cursor->pos] > max_date){
+        return NULL;
+    }
+
+    return &chunk->pubs[cursor->pos++];
+}
+
+void publication_set_wait_insert(publication_set_t *set)
+{
+    while(__atomic_load_n(&set->inserting, __ATOMIC_SEQ_CST)){
+        sched_yield();
+    }
+}
+
+
+static int cmp_ndate(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+/* the sets, held until sets_release(): the eviction thread works on
+ * them without holding sets_lock, which LOGIN and the unregistrations
+ * take */
+/* returns NULL if the snapshot cannot be allocated */
+static publication_set_t** sets_snapshot(int *nb)
+{
+    int max = __atomic_load_n(&nb_sets, __ATOMIC_RELAXED), n=0;
+    publication_set_t **snapshot = malloc((max + 1) * sizeof(publication_set_t*));
+    publication_set_t *set;
+
+    if(snapshot == NULL){
+        fprintf(stderr, "Warning -- no memory for the eviction\n");
+        return NULL;
+    }
+
+    /* the sets created meanwhile wait for the next round */
+    pthread_mutex_lock(&sets_lock);
+    for(set = sets; set != NULL && n < max; set = set->next_set){
+        set->refs++;
+        snapshot[n++] = set;
+    }
+    pthread_mutex_unlock(&sets_lock);
+
+    *nb = n;
+    return snapshot;
+}
+
+static void sets_release(publication_set_t **snapshot, int nb)
+{
+    int i;
+
+    /* only the sets destroyed meanwhile are kept in the snapshot */
+    pthread_mutex_lock(&sets_lock);
+    for(i=0; i<nb; i++){
+        if(--snapshot[i]->refs > 0 || !snapshot[i]->destroyed){
+            snapshot[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sets_lock);
+
+    for(i=0; i<nb; i++){
+        if(snapshot[i] != NULL){
+            set_free(snapshot[i]);
+        }
+    }
+    free(snapshot);
+}
+
+/* date up to which the chunks are evicted so that the chunks left fit
+ * in the budget: the newest date of the chunks to evict, oldest first
+ * among all the sets */
+static uint64_t budget_cutoff(publication_set_t **snapshot, int nb)
+{
+    long excess = (long) __atomic_load_n(&nb_chunks, __ATOMIC_RELAXED) - (long) budget_chunks;
+    publication_set_t *set;
+    uint64_t *dates, cutoff = 0;
+    long nb_dates = 0, max_dates;
+    int i, s;
+
+    if(budget_chunks == 0 || excess <= 0){
+        return 0;
+    }
+
+    max_dates = __atomic_load_n(&nb_chunks, __ATOMIC_RELAXED);
+    dates = malloc(max_dates * sizeof(uint64_t));
+    if(dates == NULL){
+        fprintf(stderr, "Warning -- no memory for the eviction\n");
+        return 0;
+    }
+
+    for(s=0; s<nb; s++){
+        set = snapshot[s];
+        pthread_mutex_lock(&set->lock);
+        for(i=0; i < set->index->nb_chunks - 1 && nb_dates < max_dates; i++){
+            dates[nb_dates++] = set->index->chunks[i]->ndates[BABBLE_PUBLICATION_CHUNK-1];
+        }
+        pthread_mutex_unlock(&set->lock);
+    }
+
+    /* the last chunk of each set is kept: the budget may not be
+     * reached */
+    if(nb_dates > 0){
+        qsort(dates, nb_dates, sizeof(uint64_t), cmp_ndate);
+        cutoff = dates[(excess < nb_dates ? excess : nb_dates) - 1];
+    }
+    free(dates);
+
+    return cutoff;
+}
+
+static void evict_all(void)
+{
+    publication_set_t **snapshot;
+    uint64_t cutoff, budget;
+    int nb, i;
+
+    if((snapshot = sets_snapshot(&nb)) == NULL){
+        return;
+    }
+
+    cutoff = age_cutoff(now_ndate());
+    budget = budget_cutoff(snapshot, nb);
+    if(budget > cutoff){
+        cutoff = budget;
+    }
+
+    for(i=0; i<nb; i++){
+        pthread_mutex_lock(&snapshot[i]->lock);
+        set_evict(snapshot[i], cutoff);
+        pthread_mutex_unlock(&snapshot[i]->lock);
+    }
+    sets_release(snapshot, nb);
+
+    /* collects the chunks retired, even if no command runs */
+    epoch_enter();
+    epoch_exit();
+}
+
+static void* eviction_run(void *arg)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&eviction_lock);
+    while(!eviction_stopping){
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += BABBLE_EVICTION_PERIOD / 1000;
+        deadline.tv_nsec += (BABBLE_EVICTION_PERIOD % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        if(pthread_cond_timedwait(&eviction_cond, &eviction_lock, &deadline) == ETIMEDOUT){
+            pthread_mutex_unlock(&eviction_lock);
+            evict_all();
+            pthread_mutex_lock(&eviction_lock);
         }
     }
-    
-    publication_t *item = set->first;
-    
-    while(item != NULL && item->ndate < min_date){
-        item = item -> next;
+    pthread_mutex_unlock(&eviction_lock);
+
+    return NULL;
+}
+
+int publication_set_start_eviction(void)
+{
+    if(pthread_create(&eviction_thread, NULL, eviction_run, NULL)){
+        fprintf(stderr, "Error -- failed to create the eviction thread\n");
+        return -1;
     }
-    
 
-    return item;
+    return 0;
 }
 
+void publication_set_stop_eviction(void)
+{
+    pthread_mutex_lock(&eviction_lock);
+    eviction_stopping = 1;
+    pthread_cond_signal(&eviction_cond);
+    pthread_mutex_unlock(&eviction_lock);
+
+    pthread_join(eviction_thread, NULL);
+}
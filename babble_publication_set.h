@@ -3,6 +3,7 @@
 
 #include <time.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "babble_config.h"
 
@@ -10,28 +11,92 @@
 typedef struct publication{
     char msg[BABBLE_SIZE];
     time_t date;
-    uint64_t ndate;
-    struct publication *next; /* used to create a list */
 } publication_t;
 
-/* set implemented as a linked list */
+/* the publications are stored in append-only chunks of contiguous
+ * records; the dates in ns are kept apart, in a sorted column that is
+ * binary searched */
+typedef struct publication_chunk{
+    struct publication_chunk *next;   /* newer chunk */
+    int count;                        /* publications visible to the
+                                       * readers */
+    uint64_t ndates[BABBLE_PUBLICATION_CHUNK];
+    publication_t pubs[BABBLE_PUBLICATION_CHUNK];
+} publication_chunk_t;
+
+/* chunks of a set, the oldest first: it is replaced by a larger copy
+ * when full, and by a shorter one when chunks are evicted */
+typedef struct publication_index{
+    int nb_chunks;
+    int size;
+    publication_chunk_t *chunks[];
+} publication_index_t;
+
+/* a single thread inserts at a time (the caller serializes them), but
+ * any number of threads can read the set concurrently, in an epoch
+ * critical section (see babble_epoch.h): the evicted chunks are freed
+ * once no reader can be in them */
 typedef struct publication_set{
-    publication_t *first; 
-    publication_t *last; /* shortcut for faster insert */
+    publication_chunk_t *first;
+    publication_chunk_t *last;  /* chunk being filled */
+    publication_index_t *index;
+    uint64_t last_ndate;
+    int inserting;       /* a publication is being dated and stored */
+
+    /* protects the index and first: taken by the writer when it
+     * starts a chunk, and by the eviction */
+    pthread_mutex_t lock;
+    /* all the sets, for the eviction thread (sets_lock) */
+    struct publication_set *prev_set;
+    struct publication_set *next_set;
+    int refs;            /* held by the eviction thread */
+    int destroyed;       /* freed once the eviction thread is done */
 } publication_set_t;
 
+/* position of a reader in a set */
+typedef struct publication_cursor{
+    publication_chunk_t *chunk;  /* NULL if the set was empty */
+    int pos;
+} publication_cursor_t;
+
 /* instanciate a new set */
+/* returns NULL if there is not enough memory */
 publication_set_t* publication_set_create(void);
 
+/* free the set and its publications */
+void publication_set_destroy(publication_set_t *set);
+
+/* retention of the publications (see babble_config.h), to be set
+ * before the first insertion */
+void publication_set_retention(int max_count, int max_age, unsigned long budget);
+
+/* the eviction thread applies the limits to all the sets every
+ * BABBLE_EVICTION_PERIOD ms; the writers also apply the count and age
+ * limits to their set when they start a chunk */
+int publication_set_start_eviction(void);
+void publication_set_stop_eviction(void);
+
+/* chunks in use by all the sets, and evicted so far */
+unsigned long publication_set_nb_chunks(void);
+unsigned long publication_set_nb_evicted(void);
+
 /* insert a new publication into the set */
+/* returns NULL if there is not enough memory */
 publication_t* publication_set_insert(publication_set_t *set, char* msg);
 
-/* get the next publication from the set */
-/* The next is the first publication published after date min_date*/
-/* last_pub can be used to speed up the search: it should be a
- * reference to the known publication older than min_date but the
- * closest to min_date */
-publication_t* publication_set_getnext(publication_set_t *set, publication_t* last_pub, uint64_t min_date);
+/* move the cursor to the first publication published at min_date or
+ * after (in O(log(nb of publications))), or to the oldest publication
+ * still retained */
+void publication_set_seek(publication_set_t *set, uint64_t min_date, publication_cursor_t *cursor);
+
+/* publication at the cursor, and move to the next one */
+/* returns NULL at the end of the set, or if the publication is dated
+ * after max_date */
+publication_t* publication_set_next(publication_cursor_t *cursor, uint64_t max_date);
+
+/* wait for the insertion in progress, if any: the publications
+ * inserted afterwards are dated after the call */
+void publication_set_wait_insert(publication_set_t *set);
 
 
 #endif
@@ -1,81 +1,310 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <pthread.h>
 
 #include "babble_registration.h"
+#include "babble_epoch.h"
 
-client_data_t *registration_table[MAX_CLIENT];
-int nb_registered_clients;
-pthread_mutex_t registration_lock;
+/* open addressing with linear probing: the keys are stored in the
+ * slots, so that probing does not dereference the clients (4 slots per
+ * cache line) */
+typedef struct reg_slot{
+    unsigned long key;
+    client_data_t *client;     /* NULL: never used, REG_REMOVED: the
+                                * client was removed */
+} reg_slot_t;
 
-int lock_client_data()
+#define REG_REMOVED ((client_data_t*) 1)
+
+typedef struct reg_table{
+    unsigned long mask;        /* nb of slots - 1 */
+    reg_slot_t slots[];
+} reg_table_t;
+
+/* the clients are split in shards by key: each one has its own table,
+ * lock and arena, so that the registrations of clients in different
+ * shards do not contend */
+/* readers load the table of a shard without any lock; the writers are
+ * serialized by the lock of the shard */
+typedef struct reg_shard{
+    reg_table_t *table;
+    pthread_mutex_t lock;
+    int nb_registered_clients;
+    int nb_removed_slots;
+    /* freed client_data_t, reused by the next registrations in the
+     * shard (linked through their first bytes) */
+    void *free_clients;
+    int nb_free_clients;
+} __attribute__((aligned(64))) reg_shard_t;
+
+static reg_shard_t shards[BABBLE_REGISTRATION_SHARDS];
+
+
+/* the keys are djb2 hashes of the names: similar names differ in the
+ * low bits only, hence a multiplicative mix */
+static unsigned long mix(unsigned long key)
 {
-    return pthread_mutex_lock(&registration_lock);
-};
+    return key * 0x9E3779B97F4A7C15UL;
+}
 
-void unlock_client_data()
+static unsigned long slot_of(reg_table_t *t, unsigned long key)
 {
-    pthread_mutex_unlock(&registration_lock);
-};
+    return (mix(key) >> 32) & t->mask;
+}
+
+/* the top bits select the shard, the next ones the slot */
+static reg_shard_t* shard_of(unsigned long key)
+{
+    return &shards[(mix(key) >> 56) % BABBLE_REGISTRATION_SHARDS];
+}
+
+static reg_table_t* table_alloc(unsigned long nb_slots)
+{
+    reg_table_t *t;
+
+    if(posix_memalign((void**)&t, 64, sizeof(reg_table_t) + nb_slots * sizeof(reg_slot_t))){
+        return NULL;
+    }
+    bzero(t, sizeof(reg_table_t) + nb_slots * sizeof(reg_slot_t));
+    t->mask = nb_slots - 1;
+
+    return t;
+}
 
 void registration_init(void)
 {
-    nb_registered_clients=0;
-    pthread_mutex_init(&registration_lock, NULL);
-    bzero(registration_table, MAX_CLIENT * sizeof(client_data_t*));
- 
+    int i;
+
+    for(i=0; i<BABBLE_REGISTRATION_SHARDS; i++){
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].nb_registered_clients=0;
+        shards[i].nb_removed_slots=0;
+        shards[i].free_clients=NULL;
+        shards[i].nb_free_clients=0;
+        shards[i].table = table_alloc(BABBLE_REGISTRATION_SLOTS);
+    }
+}
+
+client_data_t* registration_client_alloc(unsigned long key)
+{
+    reg_shard_t *shard = shard_of(key);
+    void *cl;
+
+    pthread_mutex_lock(&shard->lock);
+    cl = shard->free_clients;
+    if(cl != NULL){
+        shard->free_clients = *(void**)cl;
+        shard->nb_free_clients--;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if(cl == NULL && posix_memalign(&cl, 64, sizeof(client_data_t))){
+        return NULL;
+    }
+
+    return cl;
+}
+
+void registration_client_free(client_data_t *cl)
+{
+    reg_shard_t *shard = shard_of(cl->key);
+
+    pthread_mutex_lock(&shard->lock);
+    if(shard->nb_free_clients < BABBLE_REGISTRATION_ARENA_SIZE){
+        *(void**)cl = shard->free_clients;
+        shard->free_clients = cl;
+        shard->nb_free_clients++;
+        cl = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    free(cl);
+}
+
+/* store cl in the slot (called with the lock of the shard held) */
+static void slot_fill(reg_slot_t *slot, client_data_t *cl)
+{
+    /* the key is visible before the client is */
+    __atomic_store_n(&slot->key, cl->key, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->client, cl, __ATOMIC_RELEASE);
+}
+
+/* too many slots in use make the probe sequences long */
+static int table_crowded(reg_shard_t *shard)
+{
+    return shard->nb_registered_clients + shard->nb_removed_slots > (shard->table->mask + 1) / 4 * 3;
+}
+
+/* copy the clients of the shard in a new table, without the removed
+ * slots, twice as large if the clients fill half of the current one
+ * (called with the lock of the shard held) */
+static int table_rebuild(reg_shard_t *shard)
+{
+    reg_table_t *old = shard->table;
+    unsigned long nb_slots = old->mask + 1;
+    reg_table_t *t;
+    unsigned long i, j;
+
+    if(shard->nb_registered_clients >= nb_slots / 2){
+        nb_slots *= 2;
+    }
+    t = table_alloc(nb_slots);
+
+    if(t == NULL){
+        return -1;
+    }
+
+    for(i=0; i<=old->mask; i++){
+        client_data_t *cl = old->slots[i].client;
+
+        if(cl == NULL || cl == REG_REMOVED){
+            continue;
+        }
+        for(j = slot_of(t, cl->key); t->slots[j].client != NULL; j = (j+1) & t->mask);
+        t->slots[j].key = cl->key;
+        t->slots[j].client = cl;
+    }
+    shard->nb_removed_slots = 0;
+
+    __atomic_store_n(&shard->table, t, __ATOMIC_RELEASE);
+    /* lookups in progress may still probe the old one */
+    epoch_retire(old, free);
+
+    return 0;
 }
 
 client_data_t* registration_lookup(unsigned long key)
 {
-    int i=0;
-    client_data_t* result = NULL;
-    for(i=0; i< nb_registered_clients; i++){
-        if(registration_table[i]->key == key){
-            result = registration_table[i];
+    reg_table_t *t = __atomic_load_n(&shard_of(key)->table, __ATOMIC_ACQUIRE);
+    unsigned long i = slot_of(t, key), n;
+    client_data_t *cl;
+
+    for(n=0; n<=t->mask; n++){
+        reg_slot_t *slot = &t->slots[i];
+
+        cl = __atomic_load_n(&slot->client, __ATOMIC_ACQUIRE);
+        if(cl == NULL){
             break;
         }
+        /* the slot may be reused for another key meanwhile: the key of
+         * the client itself is checked */
+        if(cl != REG_REMOVED && __atomic_load_n(&slot->key, __ATOMIC_RELAXED) == key
+           && cl->key == key){
+            return cl;
+        }
+        i = (i+1) & t->mask;
     }
-    return result; 
+
+    return NULL;
 }
 
 int registration_insert(client_data_t* cl)
-{    
-    if(nb_registered_clients == MAX_CLIENT){
-        return -1;
-    }
-    /* lookup to find if key already exists*/
-    client_data_t* lp= registration_lookup(cl->key);
-    if(lp != NULL){
-        fprintf(stderr, "Error -- id % ld already in use\n", cl->key);
-        return -1;
+{
+    reg_shard_t *shard = shard_of(cl->key);
+    reg_table_t *t;
+    reg_slot_t *free_slot = NULL;
+    unsigned long i, n;
+
+    pthread_mutex_lock(&shard->lock);
+
+    while(1){
+        /* lookup to find if key already exists, and the first slot
+         * available */
+        t = shard->table;
+        i = slot_of(t, cl->key);
+        for(n=0; n<=t->mask; n++){
+            reg_slot_t *slot = &t->slots[i];
+
+            if(slot->client == NULL){
+                if(free_slot == NULL){
+                    free_slot = slot;
+                }
+                break;
+            }
+            if(slot->client == REG_REMOVED){
+                if(free_slot == NULL){
+                    free_slot = slot;
+                }
+            }
+            else if(slot->key == cl->key){
+                pthread_mutex_unlock(&shard->lock);
+                fprintf(stderr, "Error -- id % ld already in use\n", cl->key);
+                return -1;
+            }
+            i = (i+1) & t->mask;
+        }
+
+        if(free_slot != NULL){
+            break;
+        }
+
+        /* the table is full: the previous rebuilds failed */
+        if(table_rebuild(shard) == -1){
+            pthread_mutex_unlock(&shard->lock);
+            fprintf(stderr, "Error -- no memory to register id %ld\n", cl->key);
+            return -1;
+        }
     }
 
     /* insert cl */
-    registration_table[nb_registered_clients]=cl;
-    nb_registered_clients++;
-    
+    if(free_slot->client == REG_REMOVED){
+        shard->nb_removed_slots--;
+    }
+    slot_fill(free_slot, cl);
+    shard->nb_registered_clients++;
+
+    /* on failure, the next insertion or removal tries again */
+    if(table_crowded(shard) && table_rebuild(shard) == -1){
+        fprintf(stderr, "Warning -- no memory to rebuild the registration table\n");
+    }
+    pthread_mutex_unlock(&shard->lock);
+
     return 0;
 }
 
 
 client_data_t* registration_remove(unsigned long key)
 {
-    int i=0;
-    for(i=0; i<nb_registered_clients; i++){
-        if(registration_table[i]->key == key){
+    reg_shard_t *shard = shard_of(key);
+    reg_table_t *t;
+    reg_slot_t *slot = NULL;
+    client_data_t *cl = NULL;
+    unsigned long i, n;
+
+    pthread_mutex_lock(&shard->lock);
+    t = shard->table;
+    i = slot_of(t, key);
+    for(n=0; n<=t->mask; n++){
+        slot = &t->slots[i];
+        if(slot->client == NULL){
+            break;
+        }
+        if(slot->client != REG_REMOVED && slot->key == key){
+            cl = slot->client;
             break;
         }
+        i = (i+1) & t->mask;
     }
-    
-    if(i == nb_registered_clients){
+
+    if(cl == NULL){
+        pthread_mutex_unlock(&shard->lock);
         fprintf(stderr, "Error -- no client found\n");
         return NULL;
     }
-    
-    client_data_t* cl= registration_table[i];
 
-    nb_registered_clients--;
-    registration_table[i] = registration_table[nb_registered_clients];
+    /* the slot cannot be emptied: it may be in the probe sequence of
+     * other keys */
+    __atomic_store_n(&slot->client, REG_REMOVED, __ATOMIC_RELEASE);
+    shard->nb_registered_clients--;
+    shard->nb_removed_slots++;
+
+    /* on failure, the next insertion or removal tries again */
+    if(table_crowded(shard) && table_rebuild(shard) == -1){
+        fprintf(stderr, "Warning -- no memory to rebuild the registration table\n");
+    }
+    pthread_mutex_unlock(&shard->lock);
+
     return cl;
 }
@@ -3,13 +3,14 @@
 
 #include "babble_types.h"
 
-/* array storing a pointer to each register client */
-extern client_data_t *registration_table[MAX_CLIENT];
-
-/* number of registered clients */
-extern int nb_registered_clients;
-
 /* initialize the table*/
+/* the registered clients are indexed by key in open addressing hash
+ * tables, one per shard of keys. The functions below can be called
+ * concurrently: lookups take no lock, insertions and removals are
+ * serialized within a shard. They must be
+ * called in an epoch critical section (see babble_epoch.h): a
+ * client_data_t found in the table remains valid after its removal
+ * until the end of the critical section of the caller */
 void registration_init(void);
 
 /* search for client corresponding to key */
@@ -21,7 +22,9 @@ int registration_insert(client_data_t* cl);
 /* remove client from the registration table */
 client_data_t* registration_remove(unsigned long key);
 
-int lock_client_data();
-void unlock_client_data();
+/* client_data_t for the client key, taken from the arena of its
+ * shard, and given back once unused (its key is still set) */
+client_data_t* registration_client_alloc(unsigned long key);
+void registration_client_free(client_data_t *cl);
 
 #endif
@@ -9,35 +9,270 @@
 #include <sys/types.h>
 #include <time.h>
 #include <assert.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "babble_server.h"
 #include "babble_types.h"
 #include "babble_utils.h"
 #include "babble_communication.h"
 #include "thread_pool.h"
+#include "babble_session.h"
+#include "babble_event_loop.h"
+#include "babble_uring.h"
+#include "babble_affinity.h"
 
-thread_pool_t* conn_workers_pool;
 thread_pool_t* cmd_workers_pool;
 
+/* each acceptor owns a listening socket bound to the same port
+ * (SO_REUSEPORT), the kernel spreads the connections among them */
+/* an extra acceptor listens on the AF_UNIX socket, if any */
+typedef struct acceptor{
+    int id;
+    int sockfd;
+    int local;      /* AF_UNIX listener */
+    int cpu;        /* the one of its event loop, -1 if not pinned */
+    pthread_t thread;
+} acceptor_t;
+
+static int with_uring=0;
+
+/* graceful shutdown, once SIGTERM (or SIGINT) is received:
+   + the acceptors stop, and the commands received are dropped
+   + the commands in flight run to completion (pool drained)
+   + the answers queued are sent, for up to BABBLE_DRAIN_TIMEOUT
+   + the executors and the I/O threads are joined
+*/
+static void server_shutdown(acceptor_t *acceptors, int nb_listeners, char *unix_path)
+{
+    thread_pool_stats_t stats;
+    slab_pool_t *slab_pools[] = {&command_pool, &answer_pool, &timeline_item_pool};
+    slab_stats_t slab_stats;
+    time_t deadline;
+    int i;
+
+    /* wakes up the acceptors blocked in accept() */
+    for(i=0; i<nb_listeners; i++){
+        shutdown(acceptors[i].sockfd, SHUT_RDWR);
+    }
+    for(i=0; i<nb_listeners; i++){
+        pthread_join(acceptors[i].thread, NULL);
+    }
+    if(unix_path != NULL){
+        unlink(unix_path);
+    }
+
+    server_stop_commands();
+    thread_pool_drain(cmd_workers_pool);
+    publication_set_stop_eviction();
+
+    deadline = time(NULL) + BABBLE_DRAIN_TIMEOUT;
+    while(session_outbound_pending() > 0 || (with_uring && uring_loop_writes_inflight() > 0)){
+        if(time(NULL) >= deadline){
+            fprintf(stderr, "Warning -- %lu bytes not sent\n", session_outbound_pending());
+            break;
+        }
+        usleep(1000);
+    }
+
+    /* the I/O loops submit the commands they decode: they are stopped
+     * before the pool is freed */
+    if(with_uring){
+        uring_loop_shutdown();
+    }
+    event_loop_shutdown();
+
+    for(i=0; i<THREAD_POOL_NB_CLASSES; i++){
+        thread_pool_get_stats(cmd_workers_pool, i, &stats);
+        printf("%s tasks: %lu run, max queue depth %ld\n", (i == THREAD_POOL_CHEAP)? "cheap" : "heavy",
+               stats.completed, stats.max_depth);
+    }
+    thread_pool_shutdown(cmd_workers_pool);
+
+    for(i=0; i<sizeof(slab_pools)/sizeof(slab_pools[0]); i++){
+        slab_get_stats(slab_pools[i], &slab_stats);
+        printf("%s objects: %lu allocated, %lu freed, %lu slabs\n", slab_pools[i]->name,
+               slab_stats.allocated, slab_stats.freed, slab_stats.nb_slabs);
+    }
+    printf("publication chunks: %lu in use, %lu evicted\n", publication_set_nb_chunks(), publication_set_nb_evicted());
+    printf("pushed msgs dropped: %lu\n", session_pushes_dropped());
+}
+
+static void* acceptor_run(void *arg)
+{
+    acceptor_t *acceptor = (acceptor_t*) arg;
+    /* the handshake of the shared memory transport passes fds, and its
+     * doorbell is waited on with epoll: the local clients always go
+     * to the epoll loops */
+    int use_uring = with_uring && !acceptor->local;
+    int newsockfd, backing_off=0;
+
+    while(1){
+        /* the epoll loops need non-blocking sockets; io_uring handles
+         * blocking ones itself */
+        newsockfd = server_connection_accept(acceptor->sockfd, use_uring ? 0 : SOCK_NONBLOCK);
+
+        if(newsockfd == -1){
+            /* the listening socket was shut down (see server_shutdown()) */
+            if(errno == EBADF || errno == EINVAL){
+                break;
+            }
+            /* out of fds or of kernel memory, the connection stays
+             * pending: retrying right away would spin until some is
+             * released */
+            if(errno == EMFILE || errno == ENFILE || errno == ENOMEM || errno == ENOBUFS){
+                if(!backing_off){
+                    fprintf(stderr, "Warning -- accept paused: %s\n", strerror(errno));
+                    backing_off = 1;
+                }
+                usleep(BABBLE_ACCEPT_BACKOFF * 1000);
+            }
+            /* any other error (already logged) only concerns the
+             * connection being accepted, eg the network errors Linux
+             * passes up: the listening socket is kept */
+            continue;
+        }
+        backing_off = 0;
+
+        session_t* newsession = session_create(newsockfd);
+        if(newsession == NULL){
+            fprintf(stderr, "Error -- failed to allocate session\n");
+            close(newsockfd);
+            continue;
+        }
+        newsession->local = acceptor->local;
+
+        /* each acceptor feeds its own I/O loop */
+        if(use_uring){
+            uring_loop_add_session(newsession, acceptor->id);
+        }
+        else{
+            event_loop_add_session(newsession, acceptor->id);
+        }
+    }
+
+    close(acceptor->sockfd);
+    return NULL;
+}
+
 static void display_help(char *exec)
 {
-    printf("Usage: %s -p port_number\n", exec);
+    printf("Usage: %s -p port_number -n nb_acceptors -U unix_socket_path -u [use io_uring] -w high_watermark -l low_watermark -b drop|disconnect|pause -q locked|shared|steal -i nb_io_threads -e nb_executors -a [pin threads] -r retention_count -R retention_age -m memory_budget\n", exec);
+    printf("\t local clients can connect to unix_socket_path, and use shared memory (served by the epoll loops, even with -u)\n");
+    printf("\t watermarks (in bytes) and backpressure policy apply to the outbound queue of each client\n");
+    printf("\t the command workers use a locked queue, a shared lock-free ring, or work stealing (default)\n");
+    printf("\t threads are sized from the nb of CPUs by default; with -a, I/O threads and executors are pinned to disjoint CPUs\n");
+    printf("\t the oldest publications are evicted beyond retention_count per author, retention_age seconds, or memory_budget MB in total (default 0: no limit)\n");
 }
 
 int main(int argc, char *argv[])
 {
-    int sockfd, newsockfd;
     int portno=BABBLE_PORT;
+    int nb_acceptors=0;
+    int nb_io=0;
+    int nb_executors=0;
+    int pinned=0;
+    int *io_cpus=NULL;
+    int *exec_cpus=NULL;
+    int nb_listeners;
+    char *unix_path=NULL;
+    acceptor_t *acceptors;
+    int i;
 
     int opt;
     int nb_args=1;
+    unsigned long high_watermark=BABBLE_OUTBOUND_HIGH_WATERMARK;
+    unsigned long low_watermark=BABBLE_OUTBOUND_LOW_WATERMARK;
+    outbound_policy_t policy=OUTBOUND_PAUSE_READS;
+    thread_pool_kind_t pool_kind=THREAD_POOL_STEALING;
+    int retention_count=BABBLE_RETENTION_COUNT;
+    int retention_age=BABBLE_RETENTION_AGE;
+    unsigned long memory_budget=BABBLE_MEMORY_BUDGET;
+    sigset_t stop_signals;
+    int sig;
 
-    while ((opt = getopt (argc, argv, "+p:")) != -1){
+    while ((opt = getopt (argc, argv, "+p:n:U:uw:l:b:q:i:e:ar:R:m:")) != -1){
         switch (opt){
         case 'p':
             portno = atoi(optarg);
             nb_args+=2;
             break;
+        case 'n':
+            nb_acceptors = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'i':
+            nb_io = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'e':
+            nb_executors = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'a':
+            pinned=1;
+            nb_args+=1;
+            break;
+        case 'r':
+            retention_count = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'R':
+            retention_age = atoi(optarg);
+            nb_args+=2;
+            break;
+        case 'm':
+            memory_budget = strtoul(optarg, NULL, 10) * 1024 * 1024;
+            nb_args+=2;
+            break;
+        case 'U':
+            unix_path = optarg;
+            nb_args+=2;
+            break;
+        case 'u':
+            with_uring=1;
+            nb_args+=1;
+            break;
+        case 'w':
+            high_watermark = strtoul(optarg, NULL, 10);
+            nb_args+=2;
+            break;
+        case 'l':
+            low_watermark = strtoul(optarg, NULL, 10);
+            nb_args+=2;
+            break;
+        case 'b':
+            if(!strcmp(optarg, "drop")){
+                policy = OUTBOUND_DROP;
+            }
+            else if(!strcmp(optarg, "disconnect")){
+                policy = OUTBOUND_DISCONNECT;
+            }
+            else if(!strcmp(optarg, "pause")){
+                policy = OUTBOUND_PAUSE_READS;
+            }
+            else{
+                display_help(argv[0]);
+                return -1;
+            }
+            nb_args+=2;
+            break;
+        case 'q':
+            if(!strcmp(optarg, "locked")){
+                pool_kind = THREAD_POOL_LOCKED;
+            }
+            else if(!strcmp(optarg, "shared")){
+                pool_kind = THREAD_POOL_SHARED;
+            }
+            else if(!strcmp(optarg, "steal")){
+                pool_kind = THREAD_POOL_STEALING;
+            }
+            else{
+                display_help(argv[0]);
+                return -1;
+            }
+            nb_args+=2;
+            break;
         case 'h':
         case '?':
         default:
@@ -51,26 +286,109 @@ int main(int argc, char *argv[])
         return -1;
     }
    
+    /* writing to a client that left must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* the stop signals are only received by the main thread, in
+     * sigwait() (the threads created inherit the mask) */
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    session_set_outbound_limits(high_watermark, low_watermark, policy);
+
+    if(nb_io < 1){
+        nb_io = affinity_nb_cpus() / BABBLE_CPUS_PER_IO_THREAD;
+        if(nb_io < 1){
+            nb_io = 1;
+        }
+    }
+    if(nb_executors < 1){
+        nb_executors = affinity_nb_cpus() - nb_io;
+        if(nb_executors < BABBLE_MIN_EXECUTORS){
+            nb_executors = BABBLE_MIN_EXECUTORS;
+        }
+    }
+    if(nb_acceptors < 1){
+        nb_acceptors = nb_io;
+    }
+
+    if(pinned){
+        io_cpus = malloc(nb_io * sizeof(int));
+        exec_cpus = malloc(nb_executors * sizeof(int));
+        if(affinity_plan(nb_io, io_cpus, nb_executors, exec_cpus) == -1){
+            fprintf(stderr, "Warning -- not enough CPUs to pin the threads\n");
+            free(io_cpus);
+            free(exec_cpus);
+            io_cpus = NULL;
+            exec_cpus = NULL;
+        }
+    }
+    printf("Babble server: %d I/O threads, %d executors%s\n", nb_io, nb_executors, (io_cpus != NULL)? ", pinned" : "");
+
     server_data_init();    
-    conn_workers_pool = thread_pool_create(BABBLE_COMMUNICATION_THREADS);
-    cmd_workers_pool = thread_pool_create(BABBLE_EXECUTOR_THREADS);
+    publication_set_retention(retention_count, retention_age, memory_budget);
+    if(publication_set_start_eviction() == -1){
+        return -1;
+    }
+    cmd_workers_pool = thread_pool_create_pinned(nb_executors, pool_kind, exec_cpus);
+    if(cmd_workers_pool == NULL){
+        fprintf(stderr, "Error -- failed to create the executors\n");
+        return -1;
+    }
 
-    if((sockfd = server_connection_init(portno)) == -1){
+    if(with_uring && uring_loop_init(nb_io, io_cpus) == -1){
+        fprintf(stderr, "Warning -- io_uring not available, using epoll\n");
+        with_uring = 0;
+    }
+
+    /* with io_uring, the epoll loops only serve the local clients */
+    if((!with_uring || unix_path != NULL) && event_loop_init(nb_io, io_cpus) == -1){
         return -1;
     }
 
-    printf("Babble server bound to port %d\n", portno);    
-    
-    /* main server loop */
-    while(1){
+    nb_listeners = nb_acceptors + (unix_path != NULL);
+    acceptors = malloc(nb_listeners * sizeof(acceptor_t));
+
+    /* all the listening sockets are bound before accepting, so that a
+     * wrong port is reported right away */
+    for(i=0; i<nb_listeners; i++){
+        acceptors[i].cpu = (io_cpus != NULL)? io_cpus[i % nb_io] : -1;
+    }
+    for(i=0; i<nb_acceptors; i++){
+        acceptors[i].id = i;
+        acceptors[i].local = 0;
+        if((acceptors[i].sockfd = server_connection_init(portno)) == -1){
+            return -1;
+        }
+    }
 
-        if((newsockfd= server_connection_accept(sockfd))==-1){
+    if(unix_path != NULL){
+        acceptors[i].id = i;
+        acceptors[i].local = 1;
+        if((acceptors[i].sockfd = server_connection_init_unix(unix_path)) == -1){
             return -1;
         }
-        session_t* newsession = (session_t *)malloc(sizeof(session_t));
-        newsession->handle = newsockfd;
-        thread_pool_submit(conn_workers_pool, (void*)connection_listener, newsession);        
+        printf("Babble server bound to %s\n", unix_path);
     }
-    close(sockfd);
+
+    for(i=0; i<nb_listeners; i++){
+        /* the sessions it creates are read by the loop of this CPU */
+        if(affinity_thread_create(&acceptors[i].thread, acceptors[i].cpu, acceptor_run, &acceptors[i])){
+            fprintf(stderr, "Error -- failed to create acceptor thread\n");
+            return -1;
+        }
+    }
+
+    printf("Babble server bound to port %d (%d acceptors)\n", portno, nb_acceptors);    
+
+    sigwait(&stop_signals, &sig);
+    printf("Babble server stopping (signal %d)\n", sig);
+    server_shutdown(acceptors, nb_listeners, unix_path);
+
+    free(acceptors);
+    free(io_cpus);
+    free(exec_cpus);
     return 0;
 }
@@ -2,9 +2,11 @@
 #define __BABBLE_SERVER_H__
 
 #include <stdio.h>
+#include <sys/uio.h>
 
 #include "babble_types.h"
 #include "thread_pool.h"
+#include "babble_slab.h"
 
 /* used to create a timeline of publications*/
 typedef struct timeline_item{
@@ -16,16 +18,22 @@ typedef struct timeline_item{
 /* server starting date */
 extern time_t server_start;
 
-/* io threads pools */
-extern thread_pool_t* conn_workers_pool;
+/* command executors pool */
 extern thread_pool_t* cmd_workers_pool;
 
+/* objects allocated for each command */
+extern slab_pool_t command_pool;
+extern slab_pool_t answer_pool;
+extern slab_pool_t timeline_item_pool;
+
 /* Init functions*/
 void server_data_init(void);
 int server_connection_init(int port);
-int server_connection_accept(int sock);
+int server_connection_init_unix(char *path);
+int server_connection_accept(int sock, int flags);
 
 /* new object */
+/* returns NULL if there is not enough memory */
 command_t* new_command(unsigned long key);
 
 /* Display functions */
@@ -35,9 +43,23 @@ void display_command(command_t *cmd, FILE* stream);
 int notify_parse_error(command_t *cmd, char *input);
 
 /* High level comm function */
-int write_to_client(unsigned long key, int size, void* buf);
+int write_to_client(session_t* session, int size, void* buf);
+int write_set_to_client(session_t* session, int count, struct iovec *msgs);
+
+/* called by the event loops */
+int session_handle_frame(session_t* sess, char* recv_buff, unsigned long size);
+void session_disconnect(session_t* sess);
+
+/* the commands received from now on are dropped (shutdown) */
+void server_stop_commands(void);
+
+/* push a publication of author to a subscribed session; pushes are
+ * batched and sent by the executors */
+void session_push_publication(session_t *sess, const char *author, publication_t *pub);
 
-void connection_listener(session_t* sess);
-void cmd_executor();
+/* runs the commands queued in the mailbox of the session, in order;
+ * it hands the mailbox over to a task of another class of the pool
+ * when the next command belongs to it */
+void cmd_executor(session_t *sess);
 
 #endif
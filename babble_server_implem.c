@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <strings.h>
@@ -5,20 +6,31 @@
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 
 #include "babble_server.h"
 #include "babble_utils.h"
 #include "babble_types.h"
 #include "babble_communication.h"
 #include "babble_registration.h"
+#include "babble_epoch.h"
 #include "thread_pool.h"
 #include "babble_commands.h"
+#include "babble_session.h"
+#include "babble_protocol.h"
+#include "babble_slab.h"
 
 time_t server_start;
 
+slab_pool_t command_pool;
+slab_pool_t answer_pool;
+slab_pool_t timeline_item_pool;
+
 //threadpool cmd_executors_pool;
 
 
@@ -44,6 +56,12 @@ void display_command(command_t *cmd, FILE* stream)
     case RDV:
         fprintf(stream,"RDV\n");
         break;
+    case SUBSCRIBE:
+        fprintf(stream,"SUBSCRIBE\n");
+        break;
+    case UNFOLLOW:
+        fprintf(stream,"UNFOLLOW: %s\n", cmd->msg);
+        break;
     default:
         fprintf(stream,"Error -- Unknown command id\n");
         return;
@@ -55,6 +73,9 @@ void server_data_init(void)
 {
     server_start = time(NULL);
     registration_init();
+    slab_pool_init(&command_pool, "command", sizeof(command_t));
+    slab_pool_init(&answer_pool, "answer", sizeof(answer_t));
+    slab_pool_init(&timeline_item_pool, "timeline item", sizeof(timeline_item_t));
     //cmd_executors_pool = thpool_init(4);    
 }
 
@@ -71,7 +92,9 @@ int server_connection_init(int port)
         return -1;
     }
 
-    if(setsockopt(sockfd, SOL_SOCKET, (SO_REUSEPORT | SO_REUSEADDR), (void*)&reuse_opt, sizeof(reuse_opt)) < 0){
+    /* several acceptors listen on the same port */
+    if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (void*)&reuse_opt, sizeof(reuse_opt)) < 0
+       || setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (void*)&reuse_opt, sizeof(reuse_opt)) < 0){
         perror("setsockopt failed\n");
         close(sockfd);
         return -1;
@@ -97,19 +120,60 @@ int server_connection_init(int port)
     return sockfd;
 }
 
+/* open an AF_UNIX socket to receive local client connections */
+int server_connection_init_unix(char *path)
+{
+    int sockfd;
+    struct sockaddr_un serv_addr;
+
+    if(strlen(path) >= sizeof(serv_addr.sun_path)){
+        fprintf(stderr,"Error -- socket path too long: %s\n", path);
+        return -1;
+    }
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0){
+        perror("ERROR opening socket");
+        return -1;
+    }
+
+    bzero((char *) &serv_addr, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    strcpy(serv_addr.sun_path, path);
+
+    /* left by a previous run */
+    unlink(path);
+
+    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0){
+        perror("ERROR on binding");
+        close(sockfd);
+        return -1;
+    }
+    
+    if(listen(sockfd, BABBLE_BACKLOG)){
+        perror("ERROR on listen");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
 /* accept connections of the server socket and return corresponding
- * new file descriptor */
-int server_connection_accept(int sock)
+ * new file descriptor (flags are the accept4() ones) */
+int server_connection_accept(int sock, int flags)
 {
     int new_sock;
-    struct sockaddr_in cli_addr;
-    socklen_t clilen = sizeof(cli_addr);
 
-    new_sock = accept(sock, (struct sockaddr *) &cli_addr, &clilen);
+    new_sock = accept4(sock, NULL, NULL, flags);
     
     if (new_sock < 0){
-        perror("ERROR on accept");
-        close(sock);
+        /* EINVAL: the socket was shut down to stop the server; the
+         * caller reports the shortages it waits for (see
+         * acceptor_run()) */
+        if(errno != EINVAL && errno != EMFILE && errno != ENFILE && errno != ENOMEM && errno != ENOBUFS){
+            perror("ERROR on accept");
+        }
         return -1;
     }
     
@@ -120,16 +184,28 @@ int server_connection_accept(int sock)
 /* create a new command for client corresponding to key */
 command_t* new_command(unsigned long key)
 {
-    command_t *cmd = malloc(sizeof(command_t));
+    command_t *cmd = slab_alloc(&command_pool);
+
+    if(cmd == NULL){
+        fprintf(stderr, "Error -- no memory for the command\n");
+        return NULL;
+    }
     cmd->key = key;
+    cmd->session = NULL;
+    cmd->msg[BABBLE_SIZE]='\0';
     cmd->answer.size=-2;
     cmd->answer.aset=NULL;
     cmd->answer_exp=0;
+    cmd->with_req_id=0;
+    cmd->req_id=0;
+    cmd->parse_error=0;
+    cmd->next=NULL;
 
     return cmd;
 }
 
 /* send error msg to client in case the input msg could not be parsed */
+/* (run by the executor of the session, in order with the answers) */
 int notify_parse_error(command_t *cmd, char *input)
 {
     /* lookup client */
@@ -141,12 +217,32 @@ int notify_parse_error(command_t *cmd, char *input)
     }
 
 
-    if(cmd->answer_exp){
+    if(cmd->answer_exp && cmd->session->protocol == PROTOCOL_V2){
+        char buffer[BABBLE_V2_FRAME_MAX];
+        answer_t answer;
+
+        /* the input is binary: it is not sent back */
+        bzero(&answer, sizeof(answer_t));
+        answer.error = 1;
+        strncpy(answer.name, client->client_name, BABBLE_ID_SIZE);
+        answer.date = time(NULL)-server_start;
+        cmd->answer.size = -1;
+        cmd->answer.aset = &answer;
+
+        int size = proto_encode_answer(buffer, cmd);
+        cmd->answer.aset = NULL;
+
+        if(write_to_client(cmd->session, size, buffer)){
+            fprintf(stderr,"Error -- could not send error msg\n");
+            return -1;
+        }
+    }
+    else if(cmd->answer_exp){
         char buffer[BABBLE_BUFFER_SIZE];
         
         snprintf(buffer, BABBLE_BUFFER_SIZE,"%s[%ld]: ERROR -> %s\n", client->client_name, time(NULL)-server_start, input);
     
-        if(write_to_client(cmd->key, strlen(buffer)+1, buffer)){
+        if(write_to_client(cmd->session, strlen(buffer)+1, buffer)){
             fprintf(stderr,"Error -- could not send error msg: %s\n", buffer);
             return -1;
         }
@@ -156,17 +252,21 @@ int notify_parse_error(command_t *cmd, char *input)
 }
 
 
-/* send buf to client identified by key */
-int write_to_client(unsigned long key, int size, void* buf)
+/* send count msgs at once to the client connected through session */
+int write_set_to_client(session_t* session, int count, struct iovec *msgs)
 {
-    client_data_t *client = registration_lookup(key);
-
-    if(client == NULL){
-        fprintf(stderr, "Error -- writing to non existing client %lu\n", key);
+    if(session_sendv(session, count, msgs) < 0){
+        perror("writing to socket");
         return -1;
     }
-    
-    int write_size = network_send(client->sock, size, buf);
+
+    return 0;
+}
+
+/* send buf to the client connected through session */
+int write_to_client(session_t* session, int size, void* buf)
+{
+    int write_size = session_send(session, size, buf);
             
     if (write_size < 0){
         perror("writing to socket");
@@ -217,6 +317,15 @@ static int parse_command(char* str, command_t *cmd)
     case RDV:
         cmd->msg[0]='\0';
         break;    
+    case SUBSCRIBE:
+        cmd->msg[0]='\0';
+        break;
+    case UNFOLLOW:
+        if(str_to_payload(str, cmd->msg, BABBLE_ID_SIZE)){
+            fprintf(stderr,"Warning -- invalid UNFOLLOW -> %s\n", str);
+            return -1;
+        }
+        break;
     default:
         fprintf(stderr,"Error -- invalid client command -> %s\n", str);
         return -1;
@@ -225,6 +334,66 @@ static int parse_command(char* str, command_t *cmd)
     return 0;
 }
 
+/* render an answer for a text client, in buf (BABBLE_BUFFER_SIZE
+ * bytes) */
+/* returns the size of the msg, '\0' included */
+static int render_text_answer(command_t *cmd, answer_t *answer, char *buf)
+{
+    if(answer->error){
+        if(cmd->cid == LOGIN || cmd->cid == PUBLISH || cmd->cid == FOLLOW || cmd->cid == UNFOLLOW){
+            snprintf(buf, BABBLE_BUFFER_SIZE,"%s[%ld]: ERROR -> %d { %s } \n", answer->name, answer->date, cmd->cid, answer->msg);
+        }
+        else{
+            snprintf(buf, BABBLE_BUFFER_SIZE,"%s[%ld]: ERROR -> %d \n", answer->name, answer->date, cmd->cid);
+        }
+        return strlen(buf)+1;
+    }
+
+    switch(cmd->cid){
+    case LOGIN:
+        snprintf(buf, BABBLE_BUFFER_SIZE,"%s[%ld]: registered with key %lu\n", answer->name, answer->date, answer->value);
+        break;
+    case PUBLISH:
+        snprintf(buf, BABBLE_BUFFER_SIZE,"%s[%ld]: { %s }\n", answer->name, answer->date, answer->msg);
+        break;
+    case FOLLOW:
+        snprintf(buf, BABBLE_BUFFER_SIZE,"%s[%ld]: follow %s\n", answer->name, answer->date, answer->msg);
+        break;
+    case TIMELINE:
+        snprintf(buf, BABBLE_BUFFER_SIZE,"    %s[%ld]: %s\n", answer->name, answer->date, answer->msg);
+        break;
+    case FOLLOW_COUNT:
+        snprintf(buf, BABBLE_BUFFER_SIZE,"%s[%ld]: has %lu followers\n", answer->name, answer->date, answer->value);
+        break;
+    case RDV:
+        snprintf(buf, BABBLE_BUFFER_SIZE,"%s[%ld]: rdv_ack\n", answer->name, answer->date);
+        break;
+    case SUBSCRIBE:
+        snprintf(buf, BABBLE_BUFFER_SIZE,"%s[%ld]: subscribed\n", answer->name, answer->date);
+        break;
+    case UNFOLLOW:
+        snprintf(buf, BABBLE_BUFFER_SIZE,"%s[%ld]: unfollow %s\n", answer->name, answer->date, answer->msg);
+        break;
+    default:
+        buf[0]='\0';
+        break;
+    }
+
+    /* strlen()+1 because we want to send '\0' in the message */
+    return strlen(buf)+1;
+}
+
+static void free_answers(answer_t *item)
+{
+    answer_t *prev;
+
+    while(item != NULL){
+        prev=item;
+        item = item->next;
+        slab_free(&answer_pool, prev);
+    }
+}
+
 /* sends an answer for the command to the client if needed */
 /* answer to a command is stored in cmd->answer after the command has
  * been processed. They are different cases
@@ -232,14 +401,13 @@ static int parse_command(char* str, command_t *cmd)
  + The client expect an answer -- 2 cases
   -- The answer is a single msg
   -- The answer is potentially composed of multiple msgs (case of a timeline)
+ Binary clients always get a single msg (see babble_protocol.h)
 */
 static int answer_command(command_t *cmd)
 {    
     /* case of no answer requested by the client */
     if(!cmd->answer_exp){
-        if(cmd->answer.aset != NULL){
-            free(cmd->answer.aset);
-        }
+        free_answers(cmd->answer.aset);
         return 0;
     }
     
@@ -248,148 +416,376 @@ static int answer_command(command_t *cmd)
         return 0;
     }
 
+    if(cmd->session->protocol == PROTOCOL_V2){
+        char buffer[BABBLE_V2_FRAME_MAX];
+        int size = proto_encode_answer(buffer, cmd);
+
+        free_answers(cmd->answer.aset);
+
+        if(write_to_client(cmd->session, size, buffer)){
+            fprintf(stderr,"Error -- could not send answer for %d\n", cmd->cid);
+            return -1;
+        }
+        return 0;
+    }
+
     /* a single msg to be sent */
     if(cmd->answer.size == -1){
-        /* strlen()+1 because we want to send '\0' in the message */
-        if(write_to_client(cmd->key, strlen(cmd->answer.aset->msg)+1, cmd->answer.aset->msg)){
+        char buffer[BABBLE_BUFFER_SIZE];
+        int size = render_text_answer(cmd, cmd->answer.aset, buffer);
+
+        free_answers(cmd->answer.aset);
+
+        if(write_to_client(cmd->session, size, buffer)){
             fprintf(stderr,"Error -- could not send ack for %d\n", cmd->cid);
-            free(cmd->answer.aset);
             return -1;
         }
-        free(cmd->answer.aset);
         return 0;
     }
     
 
     /* a set of msgs to be sent */
-    /* number of msgs sent first */
-    if(write_to_client(cmd->key, sizeof(int), &cmd->answer.size)){
-        fprintf(stderr,"Error -- send set size: %d\n", cmd->cid);
-        return -1;
-    }
+    /* number of msgs goes first, then all the msgs in a single write */
+    struct iovec msgs[BABBLE_TIMELINE_MAX+1];
+    char buffers[BABBLE_TIMELINE_MAX][BABBLE_BUFFER_SIZE];
+    int nb_msgs=1;
+
+    msgs[0].iov_base = &cmd->answer.size;
+    msgs[0].iov_len = sizeof(int);
 
-    answer_t *item = cmd->answer.aset, *prev;
+    answer_t *item = cmd->answer.aset;
     int count=0;
 
     /* send only the last BABBLE_TIMELINE_MAX */
     int to_skip= (cmd->answer.size > BABBLE_TIMELINE_MAX)? cmd->answer.size - BABBLE_TIMELINE_MAX : 0;
 
     for(count=0; count < to_skip; count++){
-        prev=item;
         item = item->next;
-        free(prev);
     }
-    
+
     while(item != NULL ){
-        if(write_to_client(cmd->key, strlen(item->msg)+1, item->msg)){
-            fprintf(stderr,"Error -- could not send set: %d\n", cmd->cid);
-            return -1;
-        }
-        prev=item;
+        msgs[nb_msgs].iov_base = buffers[nb_msgs-1];
+        msgs[nb_msgs].iov_len = render_text_answer(cmd, item, buffers[nb_msgs-1]);
+        nb_msgs++;
         item = item->next;
-        free(prev);
         count++;
     }
 
+    int res = write_set_to_client(cmd->session, nb_msgs, msgs);
+
+    free_answers(cmd->answer.aset);
+
+    if(res){
+        fprintf(stderr,"Error -- could not send set: %d\n", cmd->cid);
+        return -1;
+    }
+
     assert(count == cmd->answer.size);
     return 0;
 }
 
 
-void connection_listener(session_t* sess)
+/* sends the publications pushed to the session since the last flush */
+/* all of them go in a single sendv: a single frame per
+ * BABBLE_TIMELINE_MAX publications for binary clients, a msg per
+ * publication for text clients */
+static void push_flush(session_t *sess)
 {
-    char* recv_buff=NULL;
-    int recv_size=0;
-            
-    fprintf(stderr, "Got request\n");
-            
-    command_t *cmd;
-    unsigned long client_key=0;
-    char client_name[BABBLE_ID_SIZE+1];
-    
-    bzero(client_name, BABBLE_ID_SIZE+1);
-    if((recv_size = network_recv(sess->handle, (void**)&recv_buff)) < 0){
-        fprintf(stderr, "Error -- recv from client\n");
-        close(sess->handle);
-        free(sess);
+    struct iovec msgs[BABBLE_TIMELINE_MAX];
+    answer_t *items, *item;
+    int nb_msgs=0;
+
+    pthread_mutex_lock(&sess->send_lock);
+    items = sess->push_first;
+    sess->push_first = NULL;
+    sess->push_last = NULL;
+    sess->push_scheduled = 0;
+    pthread_mutex_unlock(&sess->send_lock);
+
+    if(sess->protocol == PROTOCOL_V2){
+        static __thread char frames[BABBLE_TIMELINE_MAX][BABBLE_V2_FRAME_MAX];
+        int i;
+
+        item = items;
+        while(item != NULL){
+            msgs[nb_msgs].iov_base = frames[nb_msgs];
+            msgs[nb_msgs].iov_len = proto_encode_push(frames[nb_msgs], item, BABBLE_TIMELINE_MAX);
+            for(i=0; i<BABBLE_TIMELINE_MAX && item != NULL; i++){
+                item = item->next;
+            }
+            if(++nb_msgs == BABBLE_TIMELINE_MAX || item == NULL){
+                session_sendv_push(sess, nb_msgs, msgs);
+                nb_msgs=0;
+            }
+        }
+    }
+    else{
+        char buffers[BABBLE_TIMELINE_MAX][BABBLE_BUFFER_SIZE];
+
+        for(item = items; item != NULL; item = item->next){
+            snprintf(buffers[nb_msgs], BABBLE_BUFFER_SIZE,"  > %s[%ld]: %s\n", item->name, item->date, item->msg);
+            msgs[nb_msgs].iov_base = buffers[nb_msgs];
+            msgs[nb_msgs].iov_len = strlen(buffers[nb_msgs])+1;
+            if(++nb_msgs == BABBLE_TIMELINE_MAX || item->next == NULL){
+                session_sendv_push(sess, nb_msgs, msgs);
+                nb_msgs=0;
+            }
+        }
+    }
+
+    free_answers(items);
+    session_put(sess);
+}
+
+void session_push_publication(session_t *sess, const char *author, publication_t *pub)
+{
+    answer_t *item = slab_alloc(&answer_pool);
+
+    if(item == NULL){
         return;
     }
-    cmd = new_command(0);
-    
-    if(parse_command(recv_buff, cmd) == -1 || cmd->cid != LOGIN){
-        fprintf(stderr, "Error -- in LOGIN message\n");
-        close(sess->handle);
-        free(cmd);
-        free(sess);
+    strncpy(item->name, author, BABBLE_ID_SIZE);
+    item->name[BABBLE_ID_SIZE]='\0';
+    item->date = pub->date;
+    strncpy(item->msg, pub->msg, BABBLE_SIZE);
+    item->msg[BABBLE_SIZE]='\0';
+    item->error = 0;
+    item->next = NULL;
+
+    pthread_mutex_lock(&sess->send_lock);
+    if(sess->closed){
+        pthread_mutex_unlock(&sess->send_lock);
+        slab_free(&answer_pool, item);
         return;
     }
 
-    /* before processing the command, we should register the
-     * socket associated with the new client; this is to be done only
-     * for the LOGIN command */
-    cmd->sock = sess->handle;
+    if(sess->push_last == NULL){
+        sess->push_first = item;
+    }
+    else{
+        sess->push_last->next = item;
+    }
+    sess->push_last = item;
 
-    if(process_command(cmd) == -1){
-        fprintf(stderr, "Error -- in LOGIN\n");
-        close(sess->handle);
-        free(cmd);
-        free(sess);
-        return;    
+    /* publications pushed until the flush runs are coalesced */
+    if(sess->push_scheduled){
+        pthread_mutex_unlock(&sess->send_lock);
+        return;
     }
+    sess->push_scheduled = 1;
+    pthread_mutex_unlock(&sess->send_lock);
 
-    /* notify client of registration */
-    if(answer_command(cmd) == -1){
-        fprintf(stderr, "Error -- in LOGIN ack\n");
-        close(sess->handle);
-        free(cmd);
-        free(sess);
+    /* the flush releases the reference */
+    session_get(sess);
+    if(thread_pool_submit(cmd_workers_pool, (void*)push_flush, sess) == -1){
+        session_put(sess);
+    }
+}
+
+
+/* set when the server shuts down: the frames received are dropped */
+static int commands_stopped = 0;
+
+void server_stop_commands(void)
+{
+    __atomic_store_n(&commands_stopped, 1, __ATOMIC_RELEASE);
+}
+
+/* class of pool task a command runs in: a TIMELINE scans all the
+ * followed clients, the other commands are cheap */
+static thread_pool_class_t command_class(command_t *cmd)
+{
+    return (cmd->cid == TIMELINE)? THREAD_POOL_HEAVY : THREAD_POOL_CHEAP;
+}
+
+/* queue a command in the mailbox of its session */
+/* the commands of a client run in the order they were received, on
+ * one executor at a time; different clients run in parallel */
+static void mailbox_post(session_t *sess, command_t *cmd)
+{
+    pthread_mutex_lock(&sess->mailbox_lock);
+    if(sess->mbox_last == NULL){
+        sess->mbox_first = cmd;
+    }
+    else{
+        sess->mbox_last->next = cmd;
+    }
+    sess->mbox_last = cmd;
+
+    /* the executor draining the mailbox will run it */
+    if(sess->mbox_scheduled){
+        pthread_mutex_unlock(&sess->mailbox_lock);
         return;
     }
-    
-    /* let's store the key locally */
-    client_key = cmd->key;
-
-    strncpy(client_name, cmd->msg, BABBLE_ID_SIZE);
-    free(recv_buff);
-    free(cmd);
-
-    /* looping on client commands */
-    while((recv_size=network_recv(sess->handle, (void**) &recv_buff)) > 0){
-        cmd = new_command(client_key);
-        if(parse_command(recv_buff, cmd) == -1){
-            fprintf(stderr, "Warning: unable to parse message from client %s\n", client_name);
-            notify_parse_error(cmd, recv_buff);
-            free(cmd);
+    sess->mbox_scheduled = 1;
+    sess->mbox_class = command_class(cmd);
+    pthread_mutex_unlock(&sess->mailbox_lock);
+
+    /* the executor releases the reference */
+    session_get(sess);
+    if(thread_pool_submit_class(cmd_workers_pool, sess->mbox_class, (void*)cmd_executor, sess) == -1){
+        session_put(sess);
+    }
+}
+
+
+/* process a frame received on the session */
+/* the first frame of a session has to be a LOGIN; the following ones
+ * are commands handed to the executors */
+/* returns -1 if the session has to be closed */
+int session_handle_frame(session_t* sess, char* recv_buff, unsigned long size)
+{
+    command_t *cmd;
+    int parsed, res;
+
+    if(sess->client_name[0] == 0){
+        fprintf(stderr, "Got request\n");
+
+        if((cmd = new_command(0)) == NULL){
+            return -1;
+        }
+        cmd->session = sess;
+
+        if(sess->protocol == PROTOCOL_V2){
+            parsed = proto_decode_command(recv_buff, size, cmd);
         }
         else{
-            thread_pool_submit(cmd_workers_pool, (void*)cmd_executor, cmd); 
+            parsed = parse_command(recv_buff, cmd);
+        }
+
+        if(parsed == -1 || cmd->cid != LOGIN){
+            fprintf(stderr, "Error -- in LOGIN message\n");
+            slab_free(&command_pool, cmd);
+            return -1;
         }
-        free(recv_buff);
+
+        /* before processing the command, we should register the
+         * socket associated with the new client; this is to be done only
+         * for the LOGIN command */
+        cmd->sock = sess->handle;
+
+        if(process_command(cmd) == -1){
+            fprintf(stderr, "Error -- in LOGIN\n");
+            if(cmd->answer.aset == NULL){
+                slab_free(&command_pool, cmd);
+                return -1;
+            }
+            /* the client is told, and may log in again */
+            res = answer_command(cmd);
+            slab_free(&command_pool, cmd);
+            return res;
+        }
+
+        /* notify client of registration */
+        if(answer_command(cmd) == -1){
+            fprintf(stderr, "Error -- in LOGIN ack\n");
+            slab_free(&command_pool, cmd);
+            return -1;
+        }
+
+        /* let's store the key locally */
+        sess->key = cmd->key;
+        strncpy(sess->client_name, cmd->msg, BABBLE_ID_SIZE);
+        slab_free(&command_pool, cmd);
+
+        return 0;
     }
 
-    if(client_name[0] != 0){
-        cmd = new_command(client_key);
-        cmd->cid= UNREGISTER;
-        
-        if(unregisted_client(cmd)){
-            fprintf(stderr,"Warning -- failed to unregister client %s\n",client_name);
+    if((cmd = new_command(sess->key)) == NULL){
+        return -1;
+    }
+    cmd->session = sess;
+
+    if(sess->protocol == PROTOCOL_V2){
+        parsed = proto_decode_command(recv_buff, size, cmd);
+    }
+    else{
+        parsed = parse_command(recv_buff, cmd);
+    }
+
+    if(parsed == -1){
+        fprintf(stderr, "Warning: unable to parse message from client %s\n", sess->client_name);
+        /* answered in order with the commands before it */
+        cmd->parse_error = 1;
+        if(sess->protocol != PROTOCOL_V2){
+            strncpy(cmd->msg, recv_buff, BABBLE_SIZE);
         }
-        free(cmd);
-    } 
-        
-    free(sess);    
+    }
+
+    if(__atomic_load_n(&commands_stopped, __ATOMIC_ACQUIRE)){
+        /* the server is shutting down */
+        slab_free(&command_pool, cmd);
+    }
+    else{
+        mailbox_post(sess, cmd);
+    }
+
+    return 0;
+}
+
+/* the session socket has been closed: unregister the client */
+void session_disconnect(session_t* sess)
+{
+    /* on the stack: the client is unregistered even if there is no
+     * memory left */
+    command_t cmd = { .cid = UNREGISTER, .key = sess->key };
+
+    if(sess->client_name[0] != 0){
+        epoch_enter();
+        if(unregisted_client(&cmd)){
+            fprintf(stderr,"Warning -- failed to unregister client %s\n", sess->client_name);
+        }
+        epoch_exit();
+    }
 }
 
-void cmd_executor(command_t* cmd)
+void cmd_executor(session_t *sess)
 {
-    unsigned long client_key = cmd->key;
-    if(process_command(cmd) == -1){
-        fprintf(stderr, "Warning: unable to process command from client %lu\n", client_key);
-    }
-    if(answer_command(cmd) == -1){
-        fprintf(stderr, "Warning: unable to answer command from client %lu\n", client_key);
-    }  
-    free(cmd);
+    command_t *cmd;
+
+    while(1){
+        pthread_mutex_lock(&sess->mailbox_lock);
+        cmd = sess->mbox_first;
+        if(cmd == NULL){
+            /* the next command posted schedules a new executor */
+            sess->mbox_scheduled = 0;
+            pthread_mutex_unlock(&sess->mailbox_lock);
+            break;
+        }
+        if(command_class(cmd) != sess->mbox_class){
+            /* the rest of the mailbox goes on in the queue of its
+             * class (with the reference) */
+            sess->mbox_class = command_class(cmd);
+            pthread_mutex_unlock(&sess->mailbox_lock);
+            if(thread_pool_submit_class(cmd_workers_pool, sess->mbox_class, (void*)cmd_executor, sess) == -1){
+                session_put(sess);
+            }
+            return;
+        }
+        sess->mbox_first = cmd->next;
+        if(sess->mbox_first == NULL){
+            sess->mbox_last = NULL;
+        }
+        pthread_mutex_unlock(&sess->mailbox_lock);
+
+        unsigned long client_key = cmd->key;
+        if(cmd->parse_error){
+            epoch_enter();
+            notify_parse_error(cmd, cmd->msg);
+            epoch_exit();
+            slab_free(&command_pool, cmd);
+            continue;
+        }
+        if(process_command(cmd) == -1){
+            fprintf(stderr, "Warning: unable to process command from client %lu\n", client_key);
+        }
+        if(answer_command(cmd) == -1){
+            fprintf(stderr, "Warning: unable to answer command from client %lu\n", client_key);
+        }
+        slab_free(&command_pool, cmd);
+    }
+
+    session_put(sess);
 }
 
 
@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "babble_session.h"
+#include "babble_server.h"
+#include "babble_slab.h"
+#include "babble_communication.h"
+#include "babble_event_loop.h"
+#include "babble_uring.h"
+#include "babble_protocol.h"
+
+static unsigned long outbound_high = BABBLE_OUTBOUND_HIGH_WATERMARK;
+static unsigned long outbound_low = BABBLE_OUTBOUND_LOW_WATERMARK;
+static outbound_policy_t outbound_policy = OUTBOUND_PAUSE_READS;
+/* bytes queued in all the sessions */
+static unsigned long outbound_total = 0;
+static unsigned long outbound_pushes_dropped = 0;
+
+session_t* session_create(int fd)
+{
+    session_t *sess = malloc(sizeof(session_t));
+
+    if(sess == NULL){
+        return NULL;
+    }
+    bzero(sess, sizeof(session_t));
+
+    sess->recv.data = malloc(BABBLE_RECV_BUFFER_SIZE);
+    sess->recv_scratch = malloc(BABBLE_RECV_BUFFER_SIZE + 1);
+    if(sess->recv.data == NULL || sess->recv_scratch == NULL
+       || network_buffer_init(&sess->recv, sess->recv.data, BABBLE_RECV_BUFFER_SIZE) == -1){
+        free(sess->recv.data);
+        free(sess->recv_scratch);
+        free(sess);
+        return NULL;
+    }
+
+    sess->handle = fd;
+    sess->refcount = 1;
+    sess->slot = -1;
+    pthread_mutex_init(&sess->send_lock, NULL);
+    pthread_mutex_init(&sess->mailbox_lock, NULL);
+
+    return sess;
+}
+
+void session_get(session_t *sess)
+{
+    __sync_fetch_and_add(&sess->refcount, 1);
+}
+
+void session_put(session_t *sess)
+{
+    if(__sync_sub_and_fetch(&sess->refcount, 1) != 0){
+        return;
+    }
+
+    /* nobody can send on the socket anymore */
+    close(sess->handle);
+    session_shutdown(sess);
+    if(sess->shm != NULL){
+        shm_channel_destroy(sess->shm);
+    }
+    while(sess->nb_passed_fds > 0){
+        close(sess->passed_fds[--sess->nb_passed_fds]);
+    }
+    free(sess->recv.data);
+    free(sess->recv_scratch);
+    pthread_mutex_destroy(&sess->send_lock);
+    pthread_mutex_destroy(&sess->mailbox_lock);
+    free(sess);
+}
+
+void session_shutdown(session_t *sess)
+{
+    outbound_chunk_t *chunk, *next;
+
+    pthread_mutex_lock(&sess->send_lock);
+    sess->closed = 1;
+
+    for(chunk = sess->out_first; chunk != NULL; chunk = next){
+        next = chunk->next;
+        free(chunk);
+    }
+    sess->out_first = NULL;
+    sess->out_last = NULL;
+    __atomic_sub_fetch(&outbound_total, sess->out_bytes, __ATOMIC_RELAXED);
+    sess->out_bytes = 0;
+
+    answer_t *push, *next_push;
+    for(push = sess->push_first; push != NULL; push = next_push){
+        next_push = push->next;
+        slab_free(&answer_pool, push);
+    }
+    sess->push_first = NULL;
+    sess->push_last = NULL;
+    pthread_mutex_unlock(&sess->send_lock);
+}
+
+void session_set_outbound_limits(unsigned long high, unsigned long low, outbound_policy_t policy)
+{
+    outbound_high = high;
+    outbound_low = (low < high) ? low : high;
+    outbound_policy = policy;
+}
+
+unsigned long session_outbound_pending(void)
+{
+    return __atomic_load_n(&outbound_total, __ATOMIC_RELAXED);
+}
+
+unsigned long session_pushes_dropped(void)
+{
+    return __atomic_load_n(&outbound_pushes_dropped, __ATOMIC_RELAXED);
+}
+
+/* append len bytes at the end of the outbound queue */
+static int outbound_append(session_t *sess, char *buf, unsigned long len)
+{
+    while(len > 0){
+        outbound_chunk_t *last = sess->out_last;
+
+        if(last == NULL || last->end == BABBLE_OUTBOUND_CHUNK_SIZE){
+            outbound_chunk_t *chunk = malloc(sizeof(outbound_chunk_t));
+            if(chunk == NULL){
+                return -1;
+            }
+            chunk->next = NULL;
+            chunk->start = 0;
+            chunk->end = 0;
+
+            if(last == NULL){
+                sess->out_first = chunk;
+            }
+            else{
+                last->next = chunk;
+            }
+            sess->out_last = chunk;
+            last = chunk;
+        }
+
+        unsigned long n = BABBLE_OUTBOUND_CHUNK_SIZE - last->end;
+        if(n > len){
+            n = len;
+        }
+        memcpy(last->data + last->end, buf, n);
+        last->end += n;
+        sess->out_bytes += n;
+        __atomic_add_fetch(&outbound_total, n, __ATOMIC_RELAXED);
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* wake up the I/O layer so that it resumes reading the client */
+static void session_resume_reads(session_t *sess)
+{
+    if(sess->uring != NULL){
+        uring_session_kick(sess);
+    }
+    else{
+        event_loop_resume_reads(sess);
+    }
+}
+
+/* remove len sent bytes from the head of the queue */
+static void outbound_consume(session_t *sess, unsigned long len)
+{
+    sess->out_bytes -= len;
+    __atomic_sub_fetch(&outbound_total, len, __ATOMIC_RELAXED);
+
+    while(len > 0){
+        outbound_chunk_t *first = sess->out_first;
+        unsigned long n = first->end - first->start;
+
+        if(n > len){
+            first->start += len;
+            break;
+        }
+
+        len -= n;
+        sess->out_first = first->next;
+        if(sess->out_first == NULL){
+            sess->out_last = NULL;
+        }
+        free(first);
+    }
+
+    if(sess->reads_paused && sess->out_bytes <= outbound_low){
+        sess->reads_paused = 0;
+        session_resume_reads(sess);
+    }
+}
+
+unsigned long session_outbound_take(session_t *sess, char *dst, unsigned long max)
+{
+    unsigned long taken=0;
+    outbound_chunk_t *chunk;
+
+    for(chunk = sess->out_first; chunk != NULL && taken < max; chunk = chunk->next){
+        unsigned long n = chunk->end - chunk->start;
+        if(n > max - taken){
+            n = max - taken;
+        }
+        memcpy(dst + taken, chunk->data + chunk->start, n);
+        taken += n;
+    }
+
+    outbound_consume(sess, taken);
+
+    return taken;
+}
+
+/* shared memory transport: copy as much of the queue as the ring
+ * accepts; the client rings the doorbell once it made room */
+static int session_flush_shm_locked(session_t *sess)
+{
+    struct iovec iov[BABBLE_SENDV_BATCH];
+    outbound_chunk_t *chunk;
+    unsigned long w;
+    int n;
+
+    while(sess->out_first != NULL){
+        n=0;
+        for(chunk = sess->out_first; chunk != NULL && n < BABBLE_SENDV_BATCH; chunk = chunk->next){
+            iov[n].iov_base = chunk->data + chunk->start;
+            iov[n].iov_len = chunk->end - chunk->start;
+            n++;
+        }
+
+        w = shm_channel_writev(sess->shm, iov, n);
+        if(w > 0){
+            outbound_consume(sess, w);
+            shm_channel_notify(sess->shm);
+        }
+        else if(!shm_channel_prepare_wait_write(sess->shm)){
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+/* write as much of the queue as the socket accepts, without blocking */
+/* called with send_lock held */
+static int session_flush_locked(session_t *sess)
+{
+    struct iovec iov[BABBLE_SENDV_BATCH];
+    outbound_chunk_t *chunk;
+    ssize_t w;
+    int n;
+
+    if(sess->shm != NULL){
+        return session_flush_shm_locked(sess);
+    }
+
+    while(sess->out_first != NULL){
+        n=0;
+        for(chunk = sess->out_first; chunk != NULL && n < BABBLE_SENDV_BATCH; chunk = chunk->next){
+            iov[n].iov_base = chunk->data + chunk->start;
+            iov[n].iov_len = chunk->end - chunk->start;
+            n++;
+        }
+
+        w = writev(sess->handle, iov, n);
+        if(w == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                /* the event loop goes on when the socket is writable */
+                return 0;
+            }
+            return -1;
+        }
+
+        outbound_consume(sess, w);
+    }
+
+    return 0;
+}
+
+int session_flush(session_t *sess)
+{
+    int res;
+
+    pthread_mutex_lock(&sess->send_lock);
+    res = sess->closed ? 0 : session_flush_locked(sess);
+    pthread_mutex_unlock(&sess->send_lock);
+
+    return res;
+}
+
+int session_send(session_t *sess, unsigned long size, void* buf)
+{
+    struct iovec msg = { .iov_base = buf, .iov_len = size };
+
+    return (session_sendv(sess, 1, &msg) == -1) ? -1 : size;
+}
+
+/* pushed tells if the client did not ask for the frames */
+static long session_queue(session_t *sess, int count, struct iovec *msgs, int pushed)
+{
+    unsigned long frames_size=0;
+    long total_payload=0;
+    int i, was_empty;
+
+    for(i=0; i<count; i++){
+        frames_size += sizeof(unsigned long) + msgs[i].iov_len;
+        total_payload += msgs[i].iov_len;
+    }
+
+    pthread_mutex_lock(&sess->send_lock);
+
+    if(sess->closed){
+        pthread_mutex_unlock(&sess->send_lock);
+        return -1;
+    }
+
+    /* the client does not read fast enough */
+    if(sess->out_bytes + frames_size > outbound_high){
+        switch(outbound_policy){
+        case OUTBOUND_DROP:
+            pthread_mutex_unlock(&sess->send_lock);
+            fprintf(stderr, "Warning -- client %s too slow, msgs dropped\n", sess->client_name);
+            return -1;
+        case OUTBOUND_DISCONNECT:
+            sess->closed = 1;
+            pthread_mutex_unlock(&sess->send_lock);
+            fprintf(stderr, "Warning -- client %s too slow, disconnected\n", sess->client_name);
+            /* the I/O layer then closes the session */
+            shutdown(sess->handle, SHUT_RDWR);
+            return -1;
+        case OUTBOUND_PAUSE_READS:
+            if(pushed && sess->out_bytes + frames_size > outbound_high * BABBLE_OUTBOUND_PUSH_CAP){
+                if(sess->pushes_dropped == 0){
+                    fprintf(stderr, "Warning -- client %s too slow, pushed msgs dropped\n", sess->client_name);
+                }
+                sess->pushes_dropped += count;
+                pthread_mutex_unlock(&sess->send_lock);
+                __atomic_add_fetch(&outbound_pushes_dropped, count, __ATOMIC_RELAXED);
+                return -1;
+            }
+            sess->reads_paused = 1;
+            break;
+        }
+    }
+
+    was_empty = (sess->out_bytes == 0);
+
+    /* all the frames are queued at once, so they go out together */
+    for(i=0; i<count; i++){
+        unsigned long size = msgs[i].iov_len;
+        char header[BABBLE_VARINT_MAX];
+        int header_size;
+
+        /* the frame header depends on the protocol of the client */
+        if(sess->protocol == PROTOCOL_V2){
+            header_size = proto_put_varint(header, size);
+        }
+        else{
+            memcpy(header, &size, sizeof(unsigned long));
+            header_size = sizeof(unsigned long);
+        }
+
+        if(outbound_append(sess, header, header_size) == -1
+           || outbound_append(sess, msgs[i].iov_base, size) == -1){
+            pthread_mutex_unlock(&sess->send_lock);
+            fprintf(stderr, "Error -- failed to queue msg\n");
+            return -1;
+        }
+    }
+
+    if(sess->uring != NULL){
+        uring_session_kick(sess);
+    }
+    else if(was_empty && session_flush_locked(sess) == -1){
+        /* nothing was pending: we can try to send right away, it does
+         * not block */
+        sess->closed = 1;
+        pthread_mutex_unlock(&sess->send_lock);
+        perror("writing to socket");
+        shutdown(sess->handle, SHUT_RDWR);
+        return -1;
+    }
+
+    pthread_mutex_unlock(&sess->send_lock);
+
+    return total_payload;
+}
+
+long session_sendv(session_t *sess, int count, struct iovec *msgs)
+{
+    return session_queue(sess, count, msgs, 0);
+}
+
+long session_sendv_push(session_t *sess, int count, struct iovec *msgs)
+{
+    return session_queue(sess, count, msgs, 1);
+}
+
+/* the local client switches to the shared memory transport */
+static int session_attach_shm(session_t *sess)
+{
+    if(sess->nb_passed_fds != BABBLE_SHM_NB_FDS){
+        fprintf(stderr, "Error -- shared memory transport not available\n");
+        return -1;
+    }
+
+    sess->shm = shm_channel_attach(sess->handle, sess->passed_fds);
+    /* the fds belong to the channel now (closed on failure) */
+    sess->nb_passed_fds = 0;
+
+    if(sess->shm == NULL || event_loop_attach_shm(sess) == -1){
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the first bytes of a connection tell which protocol the client
+ * speaks */
+/* returns 1 once it is known, -1 if the session has to be closed */
+static int session_detect_protocol(session_t *sess)
+{
+    char magic[BABBLE_V2_MAGIC_SIZE];
+
+    if(network_buffer_peek(&sess->recv, magic, BABBLE_V2_MAGIC_SIZE) == -1){
+        return 0;
+    }
+
+    /* the frames then come from the rings, starting with the protocol
+     * selection */
+    if(sess->shm == NULL && memcmp(magic, BABBLE_SHM_MAGIC, BABBLE_SHM_MAGIC_SIZE) == 0){
+        network_buffer_consume(&sess->recv, BABBLE_SHM_MAGIC_SIZE);
+        return (session_attach_shm(sess) == -1) ? -1 : 0;
+    }
+
+    if(memcmp(magic, BABBLE_V2_MAGIC, BABBLE_V2_MAGIC_SIZE) == 0){
+        network_buffer_consume(&sess->recv, BABBLE_V2_MAGIC_SIZE);
+        sess->protocol = PROTOCOL_V2;
+    }
+    else{
+        sess->protocol = PROTOCOL_TEXT;
+    }
+
+    return 1;
+}
+
+int session_decode(session_t *sess)
+{
+    char *payload;
+    unsigned long size;
+    int r;
+
+    if(sess->protocol == PROTOCOL_UNKNOWN && (r = session_detect_protocol(sess)) != 1){
+        return r;
+    }
+
+    /* fds are only expected with the handshake */
+    while(sess->nb_passed_fds > 0){
+        close(sess->passed_fds[--sess->nb_passed_fds]);
+    }
+
+    if(sess->protocol == PROTOCOL_V2){
+        while((r = network_buffer_next_frame_v2(&sess->recv, sess->recv_scratch, &payload, &size)) == 1){
+            if(session_handle_frame(sess, payload, size) == -1){
+                return -1;
+            }
+        }
+        return r;
+    }
+
+    while((r = network_buffer_next_frame(&sess->recv, sess->recv_scratch, &payload, &size)) == 1){
+        if(session_handle_frame(sess, payload, size) == -1){
+            return -1;
+        }
+    }
+
+    return r;
+}
@@ -0,0 +1,54 @@
+#ifndef __BABBLE_SESSION_H__
+#define __BABBLE_SESSION_H__
+
+#include <sys/uio.h>
+
+#include "babble_types.h"
+
+/* create a session for the (already connected) socket fd */
+/* the returned session holds one reference, owned by the caller */
+session_t* session_create(int fd);
+
+/* take/release a reference on the session */
+/* the socket is closed and the session freed when the last reference
+ * is released */
+void session_get(session_t *sess);
+void session_put(session_t *sess);
+
+/* queue a frame for the client in the outbound queue of the session,
+ * whatever the transport backend; it never blocks */
+int session_send(session_t *sess, unsigned long size, void* buf);
+
+/* queue count frames for the client at once */
+long session_sendv(session_t *sess, int count, struct iovec *msgs);
+
+/* same for frames the client did not ask for (pushed publications):
+ * with the pause policy, they are dropped beyond the push cap */
+long session_sendv_push(session_t *sess, int count, struct iovec *msgs);
+
+/* configure the outbound queues watermarks and backpressure policy */
+void session_set_outbound_limits(unsigned long high, unsigned long low, outbound_policy_t policy);
+
+/* bytes waiting in the outbound queues of all the sessions */
+unsigned long session_outbound_pending(void);
+
+/* pushed frames dropped so far, all the sessions included */
+unsigned long session_pushes_dropped(void);
+
+/* epoll backend: write as much of the outbound queue as possible */
+/* returns -1 if the session has to be closed */
+int session_flush(session_t *sess);
+
+/* io_uring backend: move up to max queued bytes to dst (called with
+ * send_lock held) */
+unsigned long session_outbound_take(session_t *sess, char *dst, unsigned long max);
+
+/* the session is closed: drop the outbound queue and refuse new msgs */
+void session_shutdown(session_t *sess);
+
+/* decode and process all the complete frames stored in the receive
+ * buffer of the session */
+/* returns -1 if the session has to be closed */
+int session_decode(session_t *sess);
+
+#endif
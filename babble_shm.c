@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "babble_shm.h"
+
+#define SHM_RING_BYTES (sizeof(shm_ring_t) + BABBLE_SHM_RING_SIZE)
+
+static shm_channel_t *channels[BABBLE_SHM_MAX_FDS];
+
+static unsigned long ring_write(shm_ring_t *r, unsigned long size, const char *buf, unsigned long len)
+{
+    unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = r->tail;
+    unsigned long free_bytes = size - (tail - head);
+
+    if(free_bytes > size){
+        return 0;
+    }
+    if(len > free_bytes){
+        len = free_bytes;
+    }
+
+    unsigned long offset = tail & (size-1);
+    unsigned long first = (offset + len > size) ? size - offset : len;
+
+    memcpy(r->data + offset, buf, first);
+    memcpy(r->data, buf + first, len - first);
+
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+
+    return len;
+}
+
+static unsigned long ring_read(shm_ring_t *r, unsigned long size, char *buf, unsigned long len)
+{
+    unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    unsigned long head = r->head;
+    unsigned long available = tail - head;
+
+    if(available > size){
+        return 0;
+    }
+    if(len > available){
+        len = available;
+    }
+
+    unsigned long offset = head & (size-1);
+    unsigned long first = (offset + len > size) ? size - offset : len;
+
+    memcpy(buf, r->data + offset, first);
+    memcpy(buf + first, r->data, len - first);
+
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+
+    return len;
+}
+
+shm_channel_t* shm_channel_create(int sock)
+{
+    shm_channel_t *ch = malloc(sizeof(shm_channel_t));
+    int efd_c2s=-1, efd_s2c=-1;
+
+    if(ch == NULL){
+        return NULL;
+    }
+    bzero(ch, sizeof(shm_channel_t));
+    ch->region = MAP_FAILED;
+    ch->region_size = 2 * SHM_RING_BYTES;
+    ch->sock = sock;
+    ch->wait_fd = -1;
+    ch->notify_fd = -1;
+
+    /* the size is sealed: the server maps the region and must not
+     * fault (SIGBUS) if it shrinks */
+    ch->memfd = memfd_create("babble_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(ch->memfd == -1 || ftruncate(ch->memfd, ch->region_size) == -1
+       || fcntl(ch->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1){
+        perror("memfd");
+        goto error;
+    }
+
+    ch->region = mmap(NULL, ch->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, ch->memfd, 0);
+    if(ch->region == MAP_FAILED){
+        perror("mmap");
+        goto error;
+    }
+
+    /* the server is not listening on its doorbell yet: it is told to
+     * look at the ring as soon as it is attached */
+    ch->tx = (shm_ring_t*) ch->region;
+    ch->rx = (shm_ring_t*) (ch->region + SHM_RING_BYTES);
+    ch->tx->size = BABBLE_SHM_RING_SIZE;
+    ch->rx->size = BABBLE_SHM_RING_SIZE;
+    ch->tx->reader_waiting = 1;
+
+    /* the server side never blocks on its doorbell */
+    efd_c2s = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    efd_s2c = eventfd(0, EFD_CLOEXEC);
+    if(efd_c2s == -1 || efd_s2c == -1){
+        perror("eventfd");
+        goto error;
+    }
+    ch->notify_fd = efd_c2s;
+    ch->wait_fd = efd_s2c;
+
+    /* handshake */
+    int fds[BABBLE_SHM_NB_FDS] = { ch->memfd, efd_c2s, efd_s2c };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = BABBLE_SHM_MAGIC, .iov_len = BABBLE_SHM_MAGIC_SIZE };
+    struct msghdr msg;
+
+    bzero(&msg, sizeof(msg));
+    bzero(control, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if(sendmsg(sock, &msg, 0) != BABBLE_SHM_MAGIC_SIZE){
+        perror("sending shm handshake");
+        goto error;
+    }
+
+    /* the mapping is enough from now on */
+    close(ch->memfd);
+    ch->memfd = -1;
+
+    return ch;
+
+error:
+    if(efd_c2s != -1){
+        close(efd_c2s);
+    }
+    if(efd_s2c != -1){
+        close(efd_s2c);
+    }
+    ch->notify_fd = -1;
+    ch->wait_fd = -1;
+    shm_channel_destroy(ch);
+    return NULL;
+}
+
+shm_channel_t* shm_channel_attach(int sock, int *fds)
+{
+    shm_channel_t *ch = malloc(sizeof(shm_channel_t));
+    struct stat st;
+    int seals;
+
+    if(ch == NULL){
+        return NULL;
+    }
+    bzero(ch, sizeof(shm_channel_t));
+    ch->sock = sock;
+    ch->memfd = fds[0];
+    ch->notify_fd = fds[2];
+    ch->wait_fd = fds[1];
+    ch->region = MAP_FAILED;
+
+    /* the client keeps the memfd: unless it cannot shrink the region
+     * anymore, accessing the rings could kill the server */
+    seals = fcntl(ch->memfd, F_GET_SEALS);
+    if(seals == -1 || !(seals & F_SEAL_SHRINK)){
+        fprintf(stderr,"Error -- unsealed shared memory region\n");
+        shm_channel_destroy(ch);
+        return NULL;
+    }
+
+    if(fstat(ch->memfd, &st) == -1 || st.st_size != 2 * SHM_RING_BYTES){
+        fprintf(stderr,"Error -- invalid shared memory region\n");
+        shm_channel_destroy(ch);
+        return NULL;
+    }
+    ch->region_size = st.st_size;
+
+    ch->region = mmap(NULL, ch->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, ch->memfd, 0);
+    if(ch->region == MAP_FAILED){
+        perror("mmap");
+        shm_channel_destroy(ch);
+        return NULL;
+    }
+
+    close(ch->memfd);
+    ch->memfd = -1;
+
+    /* the size stored in the rings is only checked: the client can
+     * change it at any time, so the local constant is used */
+    ch->rx = (shm_ring_t*) ch->region;
+    ch->tx = (shm_ring_t*) (ch->region + SHM_RING_BYTES);
+
+    if(ch->rx->size != BABBLE_SHM_RING_SIZE || ch->tx->size != BABBLE_SHM_RING_SIZE){
+        fprintf(stderr,"Error -- invalid shared memory rings\n");
+        shm_channel_destroy(ch);
+        return NULL;
+    }
+
+    return ch;
+}
+
+void shm_channel_destroy(shm_channel_t *ch)
+{
+    if(ch->region != MAP_FAILED){
+        munmap(ch->region, ch->region_size);
+    }
+    if(ch->memfd != -1){
+        close(ch->memfd);
+    }
+    if(ch->wait_fd != -1){
+        close(ch->wait_fd);
+    }
+    if(ch->notify_fd != -1){
+        close(ch->notify_fd);
+    }
+    free(ch);
+}
+
+unsigned long shm_channel_writev(shm_channel_t *ch, struct iovec *iov, int iovcnt)
+{
+    unsigned long total=0, w;
+    int i;
+
+    for(i=0; i<iovcnt; i++){
+        w = ring_write(ch->tx, BABBLE_SHM_RING_SIZE, iov[i].iov_base, iov[i].iov_len);
+        total += w;
+        if(w < iov[i].iov_len){
+            break;
+        }
+    }
+
+    return total;
+}
+
+unsigned long shm_channel_read(shm_channel_t *ch, char *buf, unsigned long len)
+{
+    return ring_read(ch->rx, BABBLE_SHM_RING_SIZE, buf, len);
+}
+
+int shm_channel_prepare_wait_read(shm_channel_t *ch)
+{
+    __atomic_store_n(&ch->rx->reader_waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    /* the producer may have written before seeing the flag */
+    return __atomic_load_n(&ch->rx->tail, __ATOMIC_ACQUIRE) != ch->rx->head;
+}
+
+int shm_channel_prepare_wait_write(shm_channel_t *ch)
+{
+    __atomic_store_n(&ch->tx->writer_waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return ch->tx->tail - __atomic_load_n(&ch->tx->head, __ATOMIC_ACQUIRE) < BABBLE_SHM_RING_SIZE;
+}
+
+void shm_channel_notify(shm_channel_t *ch)
+{
+    uint64_t one=1;
+    int waiting=0;
+
+    /* pairs with the fences of prepare_wait */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&ch->tx->reader_waiting, __ATOMIC_RELAXED)){
+        waiting |= __atomic_exchange_n(&ch->tx->reader_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    if(__atomic_load_n(&ch->rx->writer_waiting, __ATOMIC_RELAXED)){
+        waiting |= __atomic_exchange_n(&ch->rx->writer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    if(waiting && write(ch->notify_fd, &one, sizeof(one)) == -1){
+        perror("shm doorbell");
+    }
+}
+
+void shm_channel_ack(shm_channel_t *ch)
+{
+    uint64_t count;
+
+    if(read(ch->wait_fd, &count, sizeof(count)) == -1 && errno != EAGAIN){
+        perror("shm doorbell");
+    }
+}
+
+int shm_channel_wait(shm_channel_t *ch)
+{
+    struct pollfd pfd[2];
+    uint64_t count;
+
+    pfd[0].fd = ch->wait_fd;
+    pfd[0].events = POLLIN;
+    /* nothing is sent on the socket anymore: any event means the
+     * other side is gone */
+    pfd[1].fd = ch->sock;
+    pfd[1].events = POLLIN | POLLRDHUP;
+
+    while(poll(pfd, 2, -1) == -1){
+        if(errno != EINTR){
+            return -1;
+        }
+    }
+
+    if(pfd[1].revents){
+        return -1;
+    }
+
+    if(read(ch->wait_fd, &count, sizeof(count)) == -1 && errno != EAGAIN && errno != EINTR){
+        return -1;
+    }
+
+    return 0;
+}
+
+void shm_channel_register(shm_channel_t *ch)
+{
+    if(ch->sock >= 0 && ch->sock < BABBLE_SHM_MAX_FDS){
+        __atomic_store_n(&channels[ch->sock], ch, __ATOMIC_RELEASE);
+    }
+}
+
+shm_channel_t* shm_channel_lookup(int sock)
+{
+    if(sock < 0 || sock >= BABBLE_SHM_MAX_FDS){
+        return NULL;
+    }
+
+    return __atomic_load_n(&channels[sock], __ATOMIC_ACQUIRE);
+}
+
+void shm_channel_unregister(int sock)
+{
+    if(sock >= 0 && sock < BABBLE_SHM_MAX_FDS){
+        __atomic_store_n(&channels[sock], NULL, __ATOMIC_RELEASE);
+    }
+}
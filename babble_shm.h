@@ -0,0 +1,86 @@
+#ifndef __BABBLE_SHM_H__
+#define __BABBLE_SHM_H__
+
+#include <sys/uio.h>
+
+#include "babble_config.h"
+
+/**** Shared memory transport for local clients ****/
+
+/* the client connects to the AF_UNIX listener of the server and
+ * sends BABBLE_SHM_MAGIC as its first bytes, along with (SCM_RIGHTS)
+ * a memfd holding two rings (its size sealed) and two eventfds:
+   + the client writes its frames in the c2s ring, the server its
+     answers in the s2c ring (same framing as on a socket)
+   + the server waits on the c2s eventfd, the client on the s2c one
+   + a side only rings the doorbell of the other when it announced it
+     was about to sleep (reader_waiting / writer_waiting), so that a
+   busy connection does not make any syscall
+   + the socket is kept open: it tells each side when the other is
+   gone
+*/
+
+#define BABBLE_SHM_MAGIC "BBLM"
+#define BABBLE_SHM_MAGIC_SIZE 4
+#define BABBLE_SHM_NB_FDS 3
+
+/* single producer single consumer ring, in shared memory */
+typedef struct shm_ring{
+    unsigned long head __attribute__((aligned(64)));  /* consumer */
+    int writer_waiting;     /* the producer waits for free space */
+    unsigned long tail __attribute__((aligned(64)));  /* producer */
+    int reader_waiting;     /* the consumer waits for data */
+    unsigned long size __attribute__((aligned(64)));  /* power of 2 */
+    char data[] __attribute__((aligned(64)));
+} shm_ring_t;
+
+/* one side of a connection */
+typedef struct shm_channel{
+    char *region;
+    unsigned long region_size;
+    int memfd;          /* closed once mapped */
+    shm_ring_t *tx;
+    shm_ring_t *rx;
+    int wait_fd;        /* doorbell of this side */
+    int notify_fd;      /* doorbell of the other side */
+    int sock;           /* AF_UNIX socket of the handshake */
+} shm_channel_t;
+
+/* client side: create the rings and doorbells and send them to the
+ * server through the connected socket sock */
+shm_channel_t* shm_channel_create(int sock);
+
+/* server side: map the rings received with the handshake (fds are
+ * the memfd, c2s and s2c eventfds); the memfd must be sealed against
+ * shrinking */
+shm_channel_t* shm_channel_attach(int sock, int *fds);
+
+/* unmap the rings and close the doorbells (not the socket) */
+void shm_channel_destroy(shm_channel_t *ch);
+
+/* non-blocking transfers: return the number of bytes moved */
+unsigned long shm_channel_writev(shm_channel_t *ch, struct iovec *iov, int iovcnt);
+unsigned long shm_channel_read(shm_channel_t *ch, char *buf, unsigned long len);
+
+/* nothing could be moved: announce that we are going to wait for
+ * the other side; returns 1 if it is worth retrying right away */
+int shm_channel_prepare_wait_read(shm_channel_t *ch);
+int shm_channel_prepare_wait_write(shm_channel_t *ch);
+
+/* ring the doorbell of the other side if it is waiting */
+void shm_channel_notify(shm_channel_t *ch);
+
+/* drain our doorbell (non-blocking) */
+void shm_channel_ack(shm_channel_t *ch);
+
+/* block until the other side rings our doorbell; returns -1 if the
+ * other side is gone */
+int shm_channel_wait(shm_channel_t *ch);
+
+/* client side: channels are looked up by the socket they were
+ * created with, so that the network_*() functions use them */
+void shm_channel_register(shm_channel_t *ch);
+shm_channel_t* shm_channel_lookup(int sock);
+void shm_channel_unregister(int sock);
+
+#endif
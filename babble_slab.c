@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "babble_slab.h"
+
+/* a free object */
+typedef struct slab_obj{
+    struct slab_obj *next;
+    struct slab_obj *next_batch;    /* first object of a batch in the
+                                     * depot */
+} slab_obj_t;
+
+/* free list of a thread for one pool */
+typedef struct slab_cache{
+    slab_obj_t *free;
+    int nb_free;
+    unsigned long allocated;    /* not added to the pool counters yet */
+    unsigned long freed;
+} slab_cache_t;
+
+static __thread slab_cache_t caches[SLAB_MAX_POOLS];
+static int nb_pools = 0;
+
+
+int slab_pool_init(slab_pool_t *pool, const char *name, unsigned long obj_size)
+{
+    if(nb_pools == SLAB_MAX_POOLS){
+        fprintf(stderr, "Error -- too many slab pools\n");
+        return -1;
+    }
+
+    pool->name = name;
+    /* room for the links of a free object, 16 bytes aligned */
+    if(obj_size < sizeof(slab_obj_t)){
+        obj_size = sizeof(slab_obj_t);
+    }
+    pool->obj_size = (obj_size + 15) & ~15UL;
+    pool->id = nb_pools++;
+
+    pthread_mutex_init(&pool->depot_lock, NULL);
+    pool->depot = NULL;
+    pool->depot_len = 0;
+
+    pool->allocated = 0;
+    pool->freed = 0;
+    pool->nb_slabs = 0;
+
+    return 0;
+}
+
+static void flush_counters(slab_pool_t *pool, slab_cache_t *cache)
+{
+    __atomic_add_fetch(&pool->allocated, cache->allocated, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->freed, cache->freed, __ATOMIC_RELAXED);
+    cache->allocated = 0;
+    cache->freed = 0;
+}
+
+/* fill the empty list of the thread with a batch of the depot, or a
+ * new slab */
+static void slab_refill(slab_pool_t *pool, slab_cache_t *cache)
+{
+    slab_obj_t *batch;
+    char *slab;
+    unsigned long i, n;
+
+    flush_counters(pool, cache);
+
+    pthread_mutex_lock(&pool->depot_lock);
+    batch = pool->depot;
+    if(batch != NULL){
+        pool->depot = batch->next_batch;
+        pool->depot_len--;
+    }
+    pthread_mutex_unlock(&pool->depot_lock);
+
+    if(batch != NULL){
+        cache->free = batch;
+        cache->nb_free = SLAB_BATCH;
+        return;
+    }
+
+    if((slab = malloc(SLAB_SIZE)) == NULL){
+        return;
+    }
+    __atomic_add_fetch(&pool->nb_slabs, 1, __ATOMIC_RELAXED);
+
+    n = SLAB_SIZE / pool->obj_size;
+    for(i=0; i<n; i++){
+        slab_obj_t *obj = (slab_obj_t*)(slab + i * pool->obj_size);
+        obj->next = (i+1 < n)? (slab_obj_t*)(slab + (i+1) * pool->obj_size) : NULL;
+    }
+    cache->free = (slab_obj_t*) slab;
+    cache->nb_free = n;
+}
+
+/* move a batch of the list of the thread to the depot */
+static void slab_spill(slab_pool_t *pool, slab_cache_t *cache)
+{
+    slab_obj_t *batch = cache->free, *last = batch;
+    int i;
+
+    for(i=1; i<SLAB_BATCH; i++){
+        last = last->next;
+    }
+    cache->free = last->next;
+    cache->nb_free -= SLAB_BATCH;
+    last->next = NULL;
+
+    flush_counters(pool, cache);
+
+    pthread_mutex_lock(&pool->depot_lock);
+    batch->next_batch = pool->depot;
+    pool->depot = batch;
+    pool->depot_len++;
+    pthread_mutex_unlock(&pool->depot_lock);
+}
+
+void* slab_alloc(slab_pool_t *pool)
+{
+    slab_cache_t *cache = &caches[pool->id];
+    slab_obj_t *obj;
+
+    if(cache->free == NULL){
+        slab_refill(pool, cache);
+        if(cache->free == NULL){
+            return NULL;
+        }
+    }
+
+    obj = cache->free;
+    cache->free = obj->next;
+    cache->nb_free--;
+    cache->allocated++;
+
+    return obj;
+}
+
+void slab_free(slab_pool_t *pool, void *ptr)
+{
+    slab_cache_t *cache = &caches[pool->id];
+    slab_obj_t *obj = ptr;
+
+    if(obj == NULL){
+        return;
+    }
+
+    obj->next = cache->free;
+    cache->free = obj;
+    cache->nb_free++;
+    cache->freed++;
+
+    /* keep a batch for the next allocations */
+    if(cache->nb_free >= 2 * SLAB_BATCH){
+        slab_spill(pool, cache);
+    }
+}
+
+void slab_get_stats(slab_pool_t *pool, slab_stats_t *stats)
+{
+    stats->allocated = __atomic_load_n(&pool->allocated, __ATOMIC_RELAXED);
+    stats->freed = __atomic_load_n(&pool->freed, __ATOMIC_RELAXED);
+    stats->nb_slabs = __atomic_load_n(&pool->nb_slabs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,56 @@
+#ifndef __BABBLE_SLAB_H__
+#define __BABBLE_SLAB_H__
+
+#include <pthread.h>
+
+/**** Thread-local slab pools ****/
+
+/* a pool hands out objects of a single size, carved from slabs of
+ * SLAB_SIZE bytes that are never given back to malloc
+   + each thread keeps a local free list per pool: allocating and
+     freeing take no lock
+   + a thread freeing more objects than it allocates (eg the objects
+     allocated by the I/O threads and freed by the executors) moves
+     them to the depot of the pool by batches of SLAB_BATCH, where
+     the other threads refill their lists
+   + a new slab is only allocated when the local list and the depot
+     are both empty
+*/
+
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_BATCH 64
+#define SLAB_MAX_POOLS 8
+
+/* the counters are updated by batches: the objects allocated and freed
+ * since a thread last moved a batch are not counted yet */
+typedef struct slab_stats{
+    unsigned long allocated;
+    unsigned long freed;
+    unsigned long nb_slabs;
+} slab_stats_t;
+
+typedef struct slab_pool{
+    const char *name;
+    unsigned long obj_size;
+    int id;                   /* index of the thread-local lists */
+
+    pthread_mutex_t depot_lock;
+    void *depot;              /* batches, linked through their first
+                               * object */
+    int depot_len;
+
+    unsigned long allocated __attribute__((aligned(64)));
+    unsigned long freed;
+    unsigned long nb_slabs;
+} slab_pool_t;
+
+/* called before any thread uses the pool (at most SLAB_MAX_POOLS) */
+/* returns -1 if there are too many pools */
+int slab_pool_init(slab_pool_t *pool, const char *name, unsigned long obj_size);
+
+void* slab_alloc(slab_pool_t *pool);
+void slab_free(slab_pool_t *pool, void *obj);
+
+void slab_get_stats(slab_pool_t *pool, slab_stats_t *stats);
+
+#endif
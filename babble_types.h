@@ -2,9 +2,13 @@
 #define __BABBLE_TYPES_H__
 
 #include <time.h>
+#include <pthread.h>
 
 #include "babble_config.h"
 #include "babble_publication_set.h"
+#include "babble_communication.h"
+#include "babble_shm.h"
+#include "babble_client_set.h"
 
 typedef enum{
     LOGIN =0,
@@ -13,17 +17,108 @@ typedef enum{
     TIMELINE,
     FOLLOW_COUNT,
     RDV,
+    SUBSCRIBE,
+    UNFOLLOW,
     UNREGISTER
 } command_id;
 
 
+/* answers are kept structured; they are rendered when sent, with
+ * the protocol of the client */
 typedef struct answer{
-    char msg[BABBLE_BUFFER_SIZE];
+    int error;                      /* the command failed */
+    char name[BABBLE_ID_SIZE+1];    /* client the answer is about
+                                     * (author for timeline items) */
+    long date;                      /* in seconds */
+    char msg[BABBLE_SIZE+1];        /* publication, followed client or
+                                     * payload of the failed command */
+    unsigned long value;            /* key for LOGIN, nb of followers
+                                     * for FOLLOW_COUNT */
     struct answer *next;
 } answer_t;
 
+/* piece of the outbound byte stream of a session */
+typedef struct outbound_chunk{
+    struct outbound_chunk *next;
+    int start;      /* first byte not sent yet */
+    int end;        /* first free byte */
+    char data[BABBLE_OUTBOUND_CHUNK_SIZE];
+} outbound_chunk_t;
+
+/* what to do when a client does not read its answers fast enough */
+typedef enum{
+    OUTBOUND_DROP =0,      /* drop the new msgs */
+    OUTBOUND_DISCONNECT,   /* close the connection */
+    OUTBOUND_PAUSE_READS   /* stop reading commands from the client */
+} outbound_policy_t;
+
+/* protocol spoken on a connection, known from its first bytes */
+typedef enum{
+    PROTOCOL_UNKNOWN =0,
+    PROTOCOL_TEXT,
+    PROTOCOL_V2            /* binary, see babble_protocol.h */
+} protocol_t;
+
 typedef struct session{
-    int handle;
+    int handle;
+    int refcount;          /* one ref for the event loop + one while
+                            * the mailbox is scheduled + one per push
+                            * flush */
+    unsigned long key;     /* client key, set once LOGIN succeeded */
+    char client_name[BABBLE_ID_SIZE+1];
+    struct event_loop *loop;   /* event loop the socket is registered in */
+    int loop_closed;       /* epoll backend: closed by its event loop */
+    protocol_t protocol;
+
+    /* AF_UNIX clients (always on an epoll loop, even with io_uring)
+     * can switch to the shared memory transport, see babble_shm.h */
+    int local;
+    int passed_fds[BABBLE_SHM_NB_FDS];  /* received with the handshake */
+    int nb_passed_fds;
+    shm_channel_t *shm;    /* frames go through its rings once set */
+
+    network_buffer_t recv;     /* bytes received but not decoded yet */
+    char *recv_scratch;        /* rebuilt frames (wrapping or not
+                                * terminated) */
+
+    /* outbound queue, flushed by the I/O layer (send_lock) */
+    struct outbound_chunk *out_first;
+    struct outbound_chunk *out_last;
+    unsigned long out_bytes;   /* bytes queued */
+    int reads_paused;      /* above the high watermark with the
+                            * pause policy */
+    unsigned long pushes_dropped;  /* above the push cap */
+    int closed;            /* no more sends accepted */
+    pthread_mutex_t send_lock;
+
+    /* io_uring backend only */
+    struct uring_loop *uring;  /* ring the session is attached to */
+    int slot;              /* index in the fixed files and registered
+                            * buffers of the ring */
+    int read_inflight;
+    int read_stopped;      /* no read submitted because of paused reads */
+    int disconnected;      /* client unregistered, waiting for the
+                            * operations in flight */
+    int write_inflight;
+    char *send_buf;        /* registered memory being written */
+    int send_off;
+    int send_len;
+    int send_queued;       /* already in the pending list of the ring */
+    struct session *next_pending;
+
+    /* publications pushed to a subscribed client, waiting to be sent
+     * in a single batch (send_lock) */
+    struct answer *push_first;
+    struct answer *push_last;
+    int push_scheduled;    /* a flush is already submitted */
+
+    /* commands of the client, run in order by a single executor at a
+     * time (mailbox_lock) */
+    struct command *mbox_first;
+    struct command *mbox_last;
+    int mbox_scheduled;    /* an executor is draining the mailbox */
+    int mbox_class;        /* class of pool task it runs in */
+    pthread_mutex_t mailbox_lock;
 } session_t;
 
 typedef struct answer_set{
@@ -39,10 +134,19 @@ typedef struct command{
     int sock;    /* only needed by the LOGIN command, other commands
                   * will use the key */
     unsigned long key;
-    char msg[BABBLE_SIZE];
+    session_t *session;  /* session the answer is sent to (holds a
+                          * ref on it) */
+    char msg[BABBLE_SIZE+1];
     answer_set_t answer; /* once the cmd has been processed, answer
                            * to client is stored there */
     int answer_exp;   /* answer sent only if set */
+    int with_req_id;  /* binary protocol: the client gave an id to
+                       * the request, echoed in the answer */
+    uint64_t req_id;
+    int parse_error;  /* the input could not be parsed: the executor
+                       * answers with an error (text protocol: msg
+                       * holds the input) */
+    struct command *next;  /* in the mailbox of the session */
 } command_t;
 
 typedef struct client_data{
@@ -55,12 +159,27 @@ typedef struct client_data{
     publication_set_t *pub_set; /* set of messages published by the
                                 * client */
     
-    struct client_data *followed[MAX_CLIENT];  /* key of the followed
-                                                * clients */
-    int nb_followed;
+    /* both directions of the follow graph: an edge is in the
+     * followed set of the follower and in the followers set of the
+     * followed client (a client follows itself) */
+    client_set_t followed;
+    client_set_t followers;
     uint64_t last_timeline;   /* stored to display only *new* messages
                                * */
-    int nb_follower;
+
+    pthread_mutex_t lock;  /* protects the follow sets, the timeline
+                            * date and the insertion of
+                            * publications */
+    int unregistered;      /* the client left: it cannot be followed
+                            * anymore */
+
+    session_t *session;    /* connection of the client */
+    int subscribed;        /* new publications of the followed
+                            * clients are pushed */
+    pthread_mutex_t subscribers_lock;
+    struct client_data **subscribers;   /* subscribed followers */
+    int nb_subscribers;
+    int max_subscribers;
 } client_data_t;
 
 
@@ -0,0 +1,656 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "babble_uring.h"
+#include "babble_server.h"
+#include "babble_session.h"
+#include "babble_affinity.h"
+
+/* tags stored in the low bits of the sqe user_data (sessions are at
+ * least 8 bytes aligned) */
+#define URING_OP_READ    0
+#define URING_OP_WRITE   1
+#define URING_OP_WAKEUP  2
+#define URING_OP_MASK    3
+
+/* registered buffers indexes */
+#define URING_RECV_BUFFERS 0
+#define URING_SEND_BUFFERS 1
+
+typedef struct uring_loop{
+    int ring_fd;
+
+    /* submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;    /* sqes filled but not published yet */
+    struct io_uring_sqe *sqes;
+
+    /* completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* registered memory, one slot per session */
+    char *recv_area;
+    char *send_area;
+
+    /* free slots stack */
+    int free_slots[BABBLE_URING_SESSIONS];
+    int nb_free_slots;
+
+    /* sessions to attach or with data to send, pushed by the other
+     * threads; the loop is woken up through the eventfd */
+    pthread_mutex_t pending_lock;
+    session_t *pending;
+    int event_fd;
+    uint64_t event_val;
+    int stopping;         /* leave at the next wake up */
+
+    int nb_writes;        /* writes in flight */
+
+    pthread_t thread;
+} uring_loop_t;
+
+static uring_loop_t *uring_loops;
+static int nb_uring_loops;
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/* map the rings shared with the kernel */
+static int uring_setup(uring_loop_t *loop)
+{
+    struct io_uring_params p;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned i;
+
+    bzero(&p, sizeof(p));
+    /* at most one read and one write in flight per session */
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 2 * BABBLE_URING_SESSIONS + 1;
+
+    loop->ring_fd = sys_io_uring_setup(BABBLE_URING_ENTRIES, &p);
+    if(loop->ring_fd < 0){
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(cq_size > sq_size){
+            sq_size = cq_size;
+        }
+        cq_size = sq_size;
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQ_RING);
+    if(sq_ptr == MAP_FAILED){
+        perror("mmap sq ring");
+        return -1;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        cq_ptr = sq_ptr;
+    }
+    else{
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_CQ_RING);
+        if(cq_ptr == MAP_FAILED){
+            perror("mmap cq ring");
+            return -1;
+        }
+    }
+
+    loop->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQES);
+    if(loop->sqes == MAP_FAILED){
+        perror("mmap sqes");
+        return -1;
+    }
+
+    loop->sq_head = (unsigned*) ((char*) sq_ptr + p.sq_off.head);
+    loop->sq_tail = (unsigned*) ((char*) sq_ptr + p.sq_off.tail);
+    loop->sq_mask = *(unsigned*) ((char*) sq_ptr + p.sq_off.ring_mask);
+    loop->sq_entries = p.sq_entries;
+    loop->sqe_tail = *loop->sq_tail;
+
+    /* sqes are always used in ring order */
+    unsigned *sq_array = (unsigned*) ((char*) sq_ptr + p.sq_off.array);
+    for(i=0; i<p.sq_entries; i++){
+        sq_array[i] = i;
+    }
+
+    loop->cq_head = (unsigned*) ((char*) cq_ptr + p.cq_off.head);
+    loop->cq_tail = (unsigned*) ((char*) cq_ptr + p.cq_off.tail);
+    loop->cq_mask = *(unsigned*) ((char*) cq_ptr + p.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe*) ((char*) cq_ptr + p.cq_off.cqes);
+
+    return 0;
+}
+
+/* register the (sparse) fixed files table and the buffers */
+static int uring_register(uring_loop_t *loop)
+{
+    int fds[BABBLE_URING_SESSIONS];
+    struct iovec iov[2];
+    int i;
+
+    for(i=0; i<BABBLE_URING_SESSIONS; i++){
+        fds[i] = -1;
+    }
+
+    if(sys_io_uring_register(loop->ring_fd, IORING_REGISTER_FILES, fds, BABBLE_URING_SESSIONS) < 0){
+        perror("io_uring_register files");
+        return -1;
+    }
+
+    loop->recv_area = mmap(NULL, (size_t) BABBLE_URING_SESSIONS * BABBLE_RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    loop->send_area = mmap(NULL, (size_t) BABBLE_URING_SESSIONS * BABBLE_SEND_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(loop->recv_area == MAP_FAILED || loop->send_area == MAP_FAILED){
+        perror("mmap uring buffers");
+        return -1;
+    }
+
+    iov[URING_RECV_BUFFERS].iov_base = loop->recv_area;
+    iov[URING_RECV_BUFFERS].iov_len = (size_t) BABBLE_URING_SESSIONS * BABBLE_RECV_BUFFER_SIZE;
+    iov[URING_SEND_BUFFERS].iov_base = loop->send_area;
+    iov[URING_SEND_BUFFERS].iov_len = (size_t) BABBLE_URING_SESSIONS * BABBLE_SEND_BUFFER_SIZE;
+
+    if(sys_io_uring_register(loop->ring_fd, IORING_REGISTER_BUFFERS, iov, 2) < 0){
+        perror("io_uring_register buffers");
+        return -1;
+    }
+
+    for(i=0; i<BABBLE_URING_SESSIONS; i++){
+        loop->free_slots[i] = BABBLE_URING_SESSIONS - 1 - i;
+    }
+    loop->nb_free_slots = BABBLE_URING_SESSIONS;
+
+    return 0;
+}
+
+/* publish the filled sqes to the kernel and wait for min_complete
+ * completions */
+static int uring_submit(uring_loop_t *loop, unsigned min_complete)
+{
+    unsigned to_submit;
+    int r;
+
+    __atomic_store_n(loop->sq_tail, loop->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = loop->sqe_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+
+    do {
+        r = sys_io_uring_enter(loop->ring_fd, to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+    } while(r == -1 && errno == EINTR);
+
+    if(r == -1 && errno != EBUSY && errno != EAGAIN){
+        perror("io_uring_enter");
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct io_uring_sqe* uring_get_sqe(uring_loop_t *loop)
+{
+    struct io_uring_sqe *sqe;
+
+    /* submission queue full: hand what we have to the kernel */
+    while(loop->sqe_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) >= loop->sq_entries){
+        if(uring_submit(loop, 0) == -1){
+            return NULL;
+        }
+    }
+
+    sqe = &loop->sqes[loop->sqe_tail & loop->sq_mask];
+    loop->sqe_tail++;
+    bzero(sqe, sizeof(*sqe));
+
+    return sqe;
+}
+
+static void uring_prep_read(uring_loop_t *loop, session_t *sess)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+    char *start;
+
+    if(sqe == NULL){
+        return;
+    }
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = sess->slot;
+    sqe->len = network_buffer_free_segment(&sess->recv, &start);
+    sqe->addr = (uint64_t) (uintptr_t) start;
+    sqe->buf_index = URING_RECV_BUFFERS;
+    sqe->user_data = (uint64_t) (uintptr_t) sess | URING_OP_READ;
+
+    sess->read_inflight = 1;
+}
+
+/* write what remains in the registered send slot, refilled from the
+ * outbound queue once empty (called with send_lock held) */
+static void uring_prep_write(uring_loop_t *loop, session_t *sess)
+{
+    struct io_uring_sqe *sqe;
+
+    if(sess->send_off == sess->send_len){
+        sess->send_off = 0;
+        sess->send_len = session_outbound_take(sess, sess->send_buf, BABBLE_SEND_BUFFER_SIZE);
+        if(sess->send_len == 0){
+            return;
+        }
+    }
+
+    sqe = uring_get_sqe(loop);
+    if(sqe == NULL){
+        return;
+    }
+
+    sess->write_inflight = 1;
+    __atomic_add_fetch(&loop->nb_writes, 1, __ATOMIC_RELAXED);
+
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = sess->slot;
+    sqe->addr = (uint64_t) (uintptr_t) (sess->send_buf + sess->send_off);
+    sqe->len = sess->send_len - sess->send_off;
+    sqe->buf_index = URING_SEND_BUFFERS;
+    sqe->user_data = (uint64_t) (uintptr_t) sess | URING_OP_WRITE;
+}
+
+static void uring_prep_wakeup(uring_loop_t *loop)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(loop);
+
+    if(sqe == NULL){
+        return;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->event_fd;
+    sqe->addr = (uint64_t) (uintptr_t) &loop->event_val;
+    sqe->len = sizeof(loop->event_val);
+    sqe->user_data = URING_OP_WAKEUP;
+}
+
+/* add the session in the pending list of its ring and wake it up */
+static void uring_push_pending(uring_loop_t *loop, session_t *sess)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->pending_lock);
+    sess->next_pending = loop->pending;
+    loop->pending = sess;
+    pthread_mutex_unlock(&loop->pending_lock);
+
+    if(write(loop->event_fd, &one, sizeof(one)) != sizeof(one)){
+        perror("writing eventfd");
+    }
+}
+
+static int uring_set_file(uring_loop_t *loop, int slot, int fd)
+{
+    struct io_uring_files_update up;
+
+    bzero(&up, sizeof(up));
+    up.offset = slot;
+    up.fds = (uint64_t) (uintptr_t) &fd;
+
+    if(sys_io_uring_register(loop->ring_fd, IORING_REGISTER_FILES_UPDATE, &up, 1) < 0){
+        perror("io_uring_register files update");
+        return -1;
+    }
+    return 0;
+}
+
+/* give a slot to a new session and start receiving */
+static void uring_attach(uring_loop_t *loop, session_t *sess)
+{
+    if(loop->nb_free_slots == 0){
+        fprintf(stderr, "Error -- no uring slot left for new session\n");
+        sess->uring = NULL;
+        session_put(sess);
+        return;
+    }
+
+    sess->slot = loop->free_slots[--loop->nb_free_slots];
+
+    if(uring_set_file(loop, sess->slot, sess->handle) == -1){
+        loop->free_slots[loop->nb_free_slots++] = sess->slot;
+        sess->uring = NULL;
+        session_put(sess);
+        return;
+    }
+
+    /* receive directly in the registered memory */
+    free(sess->recv.data);
+    network_buffer_init(&sess->recv, loop->recv_area + (size_t) sess->slot * BABBLE_RECV_BUFFER_SIZE, BABBLE_RECV_BUFFER_SIZE);
+    sess->send_buf = loop->send_area + (size_t) sess->slot * BABBLE_SEND_BUFFER_SIZE;
+    sess->send_off = 0;
+    sess->send_len = 0;
+
+    uring_prep_read(loop, sess);
+
+    /* answers may have been queued before the session got its slot */
+    pthread_mutex_lock(&sess->send_lock);
+    uring_prep_write(loop, sess);
+    pthread_mutex_unlock(&sess->send_lock);
+}
+
+/* release the slot once nothing is in flight anymore */
+static void uring_detach(uring_loop_t *loop, session_t *sess)
+{
+    uring_set_file(loop, sess->slot, -1);
+    loop->free_slots[loop->nb_free_slots++] = sess->slot;
+
+    sess->slot = -1;
+    sess->recv.data = NULL;
+    sess->send_buf = NULL;
+
+    session_put(sess);
+}
+
+/* the socket has been closed by the client, failed, or the session
+ * is being dropped: unregister the client, then release the slot
+ * once the read and the write in flight (if any) have completed */
+static void uring_close_session(uring_loop_t *loop, session_t *sess)
+{
+    int write_inflight;
+
+    if(!sess->disconnected){
+        sess->disconnected = 1;
+        session_shutdown(sess);
+        session_disconnect(sess);
+
+        /* makes the operations in flight complete */
+        shutdown(sess->handle, SHUT_RDWR);
+    }
+
+    pthread_mutex_lock(&sess->send_lock);
+    write_inflight = sess->write_inflight;
+    pthread_mutex_unlock(&sess->send_lock);
+
+    if(!write_inflight && !sess->read_inflight && sess->slot != -1){
+        uring_detach(loop, sess);
+    }
+}
+
+static void uring_handle_read(uring_loop_t *loop, session_t *sess, int res)
+{
+    sess->read_inflight = 0;
+
+    if(res <= 0 || sess->disconnected){
+        uring_close_session(loop, sess);
+        return;
+    }
+
+    network_buffer_commit(&sess->recv, res);
+
+    if(session_decode(sess) == -1){
+        uring_close_session(loop, sess);
+        return;
+    }
+
+    /* too much is waiting to be sent to the client: the read is
+     * submitted again once the outbound queue is drained */
+    pthread_mutex_lock(&sess->send_lock);
+    if(sess->reads_paused){
+        sess->read_stopped = 1;
+    }
+    else{
+        uring_prep_read(loop, sess);
+    }
+    pthread_mutex_unlock(&sess->send_lock);
+}
+
+static void uring_handle_write(uring_loop_t *loop, session_t *sess, int res)
+{
+    int failed = 0;
+
+    pthread_mutex_lock(&sess->send_lock);
+    sess->write_inflight = 0;
+    __atomic_sub_fetch(&loop->nb_writes, 1, __ATOMIC_RELAXED);
+
+    if(res < 0){
+        fprintf(stderr, "Error -- uring write: %s\n", strerror(-res));
+        sess->send_off = sess->send_len;
+        failed = 1;
+    }
+    else{
+        sess->send_off += res;
+        if(!sess->closed){
+            uring_prep_write(loop, sess);
+        }
+    }
+    pthread_mutex_unlock(&sess->send_lock);
+
+    if(failed || sess->disconnected){
+        uring_close_session(loop, sess);
+    }
+}
+
+/* attach new sessions, start the writes requested by executors and
+ * resume paused reads */
+static void uring_handle_pending(uring_loop_t *loop)
+{
+    session_t *sess, *next;
+
+    pthread_mutex_lock(&loop->pending_lock);
+    sess = loop->pending;
+    loop->pending = NULL;
+    pthread_mutex_unlock(&loop->pending_lock);
+
+    while(sess != NULL){
+        next = sess->next_pending;
+
+        if(sess->slot == -1 && !sess->closed){
+            uring_attach(loop, sess);
+            sess = next;
+            continue;
+        }
+
+        pthread_mutex_lock(&sess->send_lock);
+        sess->send_queued = 0;
+        if(!sess->closed){
+            if(!sess->write_inflight){
+                uring_prep_write(loop, sess);
+            }
+            if(sess->read_stopped && !sess->reads_paused){
+                sess->read_stopped = 0;
+                uring_prep_read(loop, sess);
+            }
+        }
+        pthread_mutex_unlock(&sess->send_lock);
+
+        /* closed by an executor (disconnect policy) */
+        if(sess->closed && sess->slot != -1){
+            uring_close_session(loop, sess);
+        }
+
+        /* reference taken by uring_session_kick() */
+        session_put(sess);
+        sess = next;
+    }
+}
+
+static void* uring_loop_run(void *arg)
+{
+    uring_loop_t *loop = (uring_loop_t*) arg;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+
+    uring_prep_wakeup(loop);
+
+    while(1){
+        /* one syscall submits every read/write prepared during the
+         * previous iteration and waits for the next completions */
+        if(uring_submit(loop, 1) == -1){
+            break;
+        }
+
+        head = *loop->cq_head;
+        tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+
+        while(head != tail){
+            cqe = &loop->cqes[head & loop->cq_mask];
+            uint64_t tag = cqe->user_data & URING_OP_MASK;
+            session_t *sess = (session_t*) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+            int res = cqe->res;
+
+            head++;
+            __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+
+            switch(tag){
+            case URING_OP_READ:
+                uring_handle_read(loop, sess, res);
+                break;
+            case URING_OP_WRITE:
+                uring_handle_write(loop, sess, res);
+                break;
+            case URING_OP_WAKEUP:
+                if(__atomic_load_n(&loop->stopping, __ATOMIC_ACQUIRE)){
+                    return NULL;
+                }
+                uring_handle_pending(loop);
+                uring_prep_wakeup(loop);
+                break;
+            }
+
+            tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    return NULL;
+}
+
+int uring_loop_init(int nb_loops, const int *cpus)
+{
+    int i;
+
+    if(nb_loops < 1){
+        nb_loops = 1;
+    }
+
+    uring_loops = malloc(nb_loops * sizeof(uring_loop_t));
+    bzero(uring_loops, nb_loops * sizeof(uring_loop_t));
+
+    for(i=0; i<nb_loops; i++){
+        uring_loop_t *loop = &uring_loops[i];
+
+        /* the rings and the registered buffers are touched first from
+         * the CPU of the loop (NUMA placement) */
+        if(cpus != NULL){
+            affinity_pin_self(cpus[i]);
+        }
+        if(uring_setup(loop) == -1 || uring_register(loop) == -1){
+            if(cpus != NULL){
+                affinity_pin_self(-1);
+            }
+            return -1;
+        }
+        if(cpus != NULL){
+            affinity_pin_self(-1);
+        }
+
+        loop->event_fd = eventfd(0, 0);
+        if(loop->event_fd == -1){
+            perror("eventfd");
+            return -1;
+        }
+        pthread_mutex_init(&loop->pending_lock, NULL);
+    }
+
+    /* only start the threads once every ring is usable so that the
+     * caller can still fall back to epoll */
+    for(i=0; i<nb_loops; i++){
+        if(affinity_thread_create(&uring_loops[i].thread, cpus? cpus[i] : -1, uring_loop_run, &uring_loops[i])){
+            fprintf(stderr,"Error -- failed to create uring loop thread\n");
+            return -1;
+        }
+    }
+
+    nb_uring_loops = nb_loops;
+
+    return 0;
+}
+
+int uring_loop_add_session(session_t *sess, int loop_id)
+{
+    uring_loop_t *loop = &uring_loops[loop_id % nb_uring_loops];
+
+    sess->uring = loop;
+    uring_push_pending(loop, sess);
+
+    return 0;
+}
+
+void uring_session_kick(session_t *sess)
+{
+    if(!sess->send_queued){
+        sess->send_queued = 1;
+        session_get(sess);
+        uring_push_pending(sess->uring, sess);
+    }
+}
+
+int uring_loop_writes_inflight(void)
+{
+    int i, n=0;
+
+    for(i=0; i<nb_uring_loops; i++){
+        n += __atomic_load_n(&uring_loops[i].nb_writes, __ATOMIC_RELAXED);
+    }
+
+    return n;
+}
+
+void uring_loop_shutdown(void)
+{
+    uint64_t one = 1;
+    int i;
+
+    for(i=0; i<nb_uring_loops; i++){
+        __atomic_store_n(&uring_loops[i].stopping, 1, __ATOMIC_RELEASE);
+        if(write(uring_loops[i].event_fd, &one, sizeof(one)) != sizeof(one)){
+            perror("writing eventfd");
+        }
+    }
+
+    for(i=0; i<nb_uring_loops; i++){
+        pthread_join(uring_loops[i].thread, NULL);
+    }
+}
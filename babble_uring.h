@@ -0,0 +1,35 @@
+#ifndef __BABBLE_URING_H__
+#define __BABBLE_URING_H__
+
+#include "babble_types.h"
+
+/* io_uring transport backend, alternative to the epoll event loops */
+/* each ring thread owns up to BABBLE_URING_SESSIONS sessions: their
+ * sockets are registered as fixed files, and their receive/send
+ * buffers are carved out of registered buffers. Receives and sends
+ * of all the sessions are submitted in batch with a single
+ * io_uring_enter() per loop iteration. Sends are fed from the
+ * outbound queue of the session */
+
+/* start nb_loops ring threads, ring i pinned to cpus[i] (cpus can be
+ * NULL) */
+/* returns -1 if io_uring is not available on this system */
+int uring_loop_init(int nb_loops, const int *cpus);
+
+/* attach a new session to the ring loop_id (modulo the number of
+ * rings) */
+/* the ring takes over the reference of the caller */
+int uring_loop_add_session(session_t *sess, int loop_id);
+
+/* ask the ring to send the outbound queue of the session, and to
+ * resume reading it if needed (called with send_lock held) */
+void uring_session_kick(session_t *sess);
+
+/* nb of writes submitted to the kernel and not completed yet */
+int uring_loop_writes_inflight(void);
+
+/* stop the ring threads and join them (the sessions are left as they
+ * are) */
+void uring_loop_shutdown(void);
+
+#endif
@@ -94,7 +94,7 @@ int str_to_command(char* str, int* ack_req)
     if(strlen(items[cid_index]) == 1){
         int res = atoi(items[cid_index]);
         
-        if( res < LOGIN || res > RDV){
+        if( res < LOGIN || res > UNFOLLOW){
             fprintf(stderr,"Error -- invalid request -> %s\n", str);
             free_split_array(items, nb_items);
             return -1;
@@ -154,6 +154,16 @@ int str_to_command(char* str, int* ack_req)
         return RDV;
     }
 
+    if(!strcmp(items[cid_index], "SUBSCRIBE")){
+        free_split_array(items, nb_items);
+        return SUBSCRIBE;
+    }
+
+    if(!strcmp(items[cid_index], "UNFOLLOW")){
+        free_split_array(items, nb_items);
+        return UNFOLLOW;
+    }
+
     free_split_array(items, nb_items);
     
     return -1;
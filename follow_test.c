@@ -18,15 +18,31 @@ char hostname[BABBLE_BUFFER_SIZE]="127.0.0.1";
 int portno = BABBLE_PORT;
 
 int with_streaming = 0;
+
+/* publications are pushed to TIM instead of polling timelines */
+int with_subscribe = 0;
+
+/* local transports */
+char *local_path = NULL;
+int with_shm = 0;
 int publish_count = 0;
 
 int keep_on_going = 1;
 pthread_barrier_t global_barrier;
 
 
+static int connect_client(void)
+{
+    if(local_path != NULL){
+        return with_shm ? connect_to_shm_server(local_path) : connect_to_unix_server(local_path);
+    }
+
+    return connect_to_server(hostname, portno);
+}
+
 static void display_help(char *exec)
 {
-    printf("Usage: %s -m hostname -p port_number -t nb_timeline_requests -s [activate_streaming]\n", exec);
+    printf("Usage: %s -m hostname -p port_number -t nb_timeline_requests -s [activate_streaming] -b [binary protocol] -U unix_socket_path -M unix_socket_path [shared memory] -S [subscribe]\n", exec);
     printf("\t hostname can be an ip address\n" );
 }
 
@@ -36,7 +52,7 @@ static void *publish_thread (void *arg)
     bzero(client_name, BABBLE_ID_SIZE);
     snprintf(client_name, BABBLE_ID_SIZE, "PUB");
     
-    int sockfd = connect_to_server(hostname, portno);
+    int sockfd = connect_client();
 
     if(sockfd == -1){
         fprintf(stderr,"*** Test Failed ***\n");
@@ -49,7 +65,7 @@ static void *publish_thread (void *arg)
     if(client_key == 0){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"PUB failed to login\n");
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
     int ret;
@@ -79,7 +95,7 @@ static void *publish_thread (void *arg)
         if(client_publish(sockfd, my_msg, with_streaming)){
             fprintf(stderr,"*** Test Failed ***\n");
             fprintf(stderr,"failed to publish %s\n", my_msg);
-            close(sockfd);
+            disconnect_from_server(sockfd);
             exit(-1);
         }
         publish_count++;
@@ -93,10 +109,18 @@ static void *publish_thread (void *arg)
     if(client_rdv(sockfd)){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"PUB failed to rdv with server\n");
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
 
+
+    /* TIM and PUB itself */
+    if(client_follow_count(sockfd) != 2){
+        fprintf(stderr,"*** Test Failed ***\n");
+        fprintf(stderr,"PUB should have 2 followers\n");
+        disconnect_from_server(sockfd);
+        exit(-1);
+    }
     
     /* barrier before the last timeline */
     ret = pthread_barrier_wait(&global_barrier);
@@ -105,8 +129,97 @@ static void *publish_thread (void *arg)
         fprintf(stderr, "Barrier synchronization failed!\n");
         return (void*)EXIT_FAILURE;
     }
+
+    /* the publications of PUB leave with it: it must not disconnect
+     * before TIM got them all */
+    ret = pthread_barrier_wait(&global_barrier);
+    if (ret != 0 && ret != PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+        fprintf(stderr, "Barrier synchronization failed!\n");
+        return (void*)EXIT_FAILURE;
+    }
+
+    /* TIM unfollowed it */
+    if(client_follow_count(sockfd) != 1){
+        fprintf(stderr,"*** Test Failed ***\n");
+        fprintf(stderr,"PUB should have 1 follower\n");
+        disconnect_from_server(sockfd);
+        exit(-1);
+    }
     
-    close(sockfd);
+    disconnect_from_server(sockfd);
+    return (void*)EXIT_SUCCESS;
+}
+
+/* TIM stops following PUB, once it got all its publications */
+static void unfollow_pub(int sockfd)
+{
+    if(client_unfollow(sockfd, "PUB")){
+        fprintf(stderr,"*** Test Failed ***\n");
+        fprintf(stderr,"failed to unfollow PUB\n");
+        disconnect_from_server(sockfd);
+        exit(-1);
+    }
+}
+
+/* TIM receives the publications of PUB as they are pushed */
+static void *subscribed_follow(int sockfd)
+{
+    int i, nb_pushed, received=0, ret;
+
+    for(i=0; i< nb_timeline; i++){
+        if((nb_pushed = client_recv_push(sockfd)) == -1){
+            fprintf(stderr,"*** Test Failed ***\n");
+            fprintf(stderr,"pb in push\n");
+            disconnect_from_server(sockfd);
+            exit(-1);
+        }
+        printf("%d: TIM got %d pushed msgs\n", i, nb_pushed);
+        received += nb_pushed;
+    }
+
+    /* stop the publisher thread */
+    __sync_bool_compare_and_swap(&keep_on_going, 1, 0);
+
+    /* barrier before the last pushes */
+    ret = pthread_barrier_wait(&global_barrier);
+    if (ret != 0 && ret != PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+        fprintf(stderr, "Barrier synchronization failed!\n");
+        return (void*)EXIT_FAILURE;
+    }
+
+    /* all the publications are processed: the pending ones are on
+     * their way */
+    while(received < publish_count){
+        if((nb_pushed = client_recv_push(sockfd)) == -1){
+            fprintf(stderr,"*** Test Failed ***\n");
+            fprintf(stderr,"pb in push\n");
+            disconnect_from_server(sockfd);
+            exit(-1);
+        }
+        received += nb_pushed;
+    }
+    printf("TIM got %d pushed msgs in total\n", received);
+
+    unfollow_pub(sockfd);
+
+    /* PUB can leave */
+    ret = pthread_barrier_wait(&global_barrier);
+    if (ret != 0 && ret != PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+        fprintf(stderr, "Barrier synchronization failed!\n");
+        return (void*)EXIT_FAILURE;
+    }
+
+    if(received != publish_count){
+        fprintf(stderr,"*** Test Failed ***\n");
+        fprintf(stderr,"got %d pushed msgs for %d publications\n", received, publish_count);
+        disconnect_from_server(sockfd);
+        exit(-1);
+    }
+
+    disconnect_from_server(sockfd);
     return (void*)EXIT_SUCCESS;
 }
 
@@ -116,7 +229,7 @@ static void *follow_thread (void *arg)
     bzero(client_name, BABBLE_ID_SIZE);
     snprintf(client_name, BABBLE_ID_SIZE, "TIM");
     
-    int sockfd = connect_to_server(hostname, portno);
+    int sockfd = connect_client();
 
     int timeline_full_size = 0;
 
@@ -131,7 +244,7 @@ static void *follow_thread (void *arg)
     if(client_key == 0){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"TIM failed to login\n");
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
     int ret;
@@ -148,13 +261,24 @@ static void *follow_thread (void *arg)
     char client_to_follow[BABBLE_ID_SIZE];
     bzero(client_to_follow, BABBLE_ID_SIZE);
     snprintf(client_to_follow, BABBLE_ID_SIZE, "PUB");
-    if(client_follow(sockfd, client_to_follow, with_streaming)){
+    /* the publications are only pushed once the follow is processed:
+     * it is acknowledged before subscribing */
+    if(client_follow(sockfd, client_to_follow, with_streaming && !with_subscribe)){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"failed to follow %s\n", client_to_follow);
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
 
+    if(with_subscribe){
+        if(client_subscribe(sockfd) != 0){
+            fprintf(stderr,"*** Test Failed ***\n");
+            fprintf(stderr,"failed to subscribe\n");
+            disconnect_from_server(sockfd);
+            exit(-1);
+        }
+    }
+
     /* global barrier before starting to follow others */
     ret = pthread_barrier_wait(&global_barrier);
     if (ret != 0 && ret != PTHREAD_BARRIER_SERIAL_THREAD)
@@ -163,6 +287,10 @@ static void *follow_thread (void *arg)
         return (void*)EXIT_FAILURE;
     }
 
+    if(with_subscribe){
+        return subscribed_follow(sockfd);
+    }
+
     /* timeline requests */
     int i=0;
     int timeline_size=0;
@@ -171,7 +299,7 @@ static void *follow_thread (void *arg)
         if(timeline_size == -1){
             fprintf(stderr,"*** Test Failed ***\n");
             fprintf(stderr,"pb in timeline\n");
-            close(sockfd);
+            disconnect_from_server(sockfd);
             exit(-1);
         }
         else{
@@ -196,7 +324,7 @@ static void *follow_thread (void *arg)
     if(timeline_size == -1){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"pb in timeline\n");
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
     else{
@@ -207,11 +335,21 @@ static void *follow_thread (void *arg)
     if(timeline_full_size != publish_count){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"timeline includes only %d / %d msgs\n", timeline_full_size, publish_count);
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
+
+    unfollow_pub(sockfd);
+
+    /* PUB can leave */
+    ret = pthread_barrier_wait(&global_barrier);
+    if (ret != 0 && ret != PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+        fprintf(stderr, "Barrier synchronization failed!\n");
+        return (void*)EXIT_FAILURE;
+    }
     
-    close(sockfd);
+    disconnect_from_server(sockfd);
     return (void*)EXIT_SUCCESS;
 }
 
@@ -227,7 +365,7 @@ int main(int argc, char *argv[])
     pthread_t tid;
     
     /* parsing command options */
-    while ((opt = getopt (argc, argv, "+hm:p:t:s")) != -1){
+    while ((opt = getopt (argc, argv, "+hm:p:t:sbU:M:S")) != -1){
         switch (opt){
         case 'm':
             strncpy(hostname,optarg,BABBLE_BUFFER_SIZE);
@@ -245,6 +383,23 @@ int main(int argc, char *argv[])
             with_streaming=1;
             nb_args+=1;
             break;
+        case 'b':
+            client_set_protocol(PROTOCOL_V2);
+            nb_args+=1;
+            break;
+        case 'U':
+            local_path = optarg;
+            nb_args+=2;
+            break;
+        case 'M':
+            local_path = optarg;
+            with_shm = 1;
+            nb_args+=2;
+            break;
+        case 'S':
+            with_subscribe=1;
+            nb_args+=1;
+            break;
         case 'h':
         case '?':
         default:
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+/* compares the kinds of thread pool (mutex-based queue, shared
+ * lock-free ring, work stealing): producers submit empty tasks, as fast
+ * as they can, to a pool of workers */
+/* with -x, one task out of heavy_every is heavy (busy for
+ * HEAVY_TASK_NS): the latency of the cheap tasks is measured with all
+ * the tasks in the same class, then with the heavy ones in their own
+ * class */
+
+int nb_workers = 0;    /* nb of online CPUs */
+int nb_producers = 2;
+long nb_tasks = 1000000;
+/* children submitted by each task, from the worker running it */
+int fanout = 0;
+int heavy_every = 0;
+
+#define HEAVY_TASK_NS 20000
+
+thread_pool_t *pool;
+long done;
+
+static void display_help(char *exec)
+{
+    printf("Usage: %s -w nb_workers -p nb_producers -n nb_tasks [-f fanout] [-x heavy_every]\n", exec);
+}
+
+static void child(void *arg)
+{
+    __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+}
+
+static void task(void *arg)
+{
+    int i;
+
+    for(i=0; i<fanout; i++){
+        thread_pool_submit(pool, child, NULL);
+    }
+    __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+}
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* submission date of the tasks, then latency of the cheap ones */
+long *dates;
+
+static void heavy_task(void *arg)
+{
+    long end = now_ns() + HEAVY_TASK_NS;
+
+    while(now_ns() < end);
+    dates[(long) arg] = -1;
+    __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+}
+
+static void cheap_task(void *arg)
+{
+    dates[(long) arg] = now_ns() - dates[(long) arg];
+    __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+    long x = *(long*)a, y = *(long*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void run_mixed(thread_pool_kind_t kind, int with_classes)
+{
+    thread_pool_stats_t stats[THREAD_POOL_NB_CLASSES];
+    long i, nb_cheap=0;
+    int cls;
+
+    pool = thread_pool_create_kind(nb_workers, kind);
+    dates = malloc(nb_tasks * sizeof(long));
+    done = 0;
+
+    for(i=0; i<nb_tasks; i++){
+        dates[i] = now_ns();
+        if(i % heavy_every == 0){
+            thread_pool_submit_class(pool, with_classes? THREAD_POOL_HEAVY : THREAD_POOL_CHEAP, heavy_task, (void*) i);
+        }
+        else{
+            thread_pool_submit(pool, cheap_task, (void*) i);
+        }
+    }
+    while(__atomic_load_n(&done, __ATOMIC_RELAXED) < nb_tasks){
+        sched_yield();
+    }
+
+    /* keep the latencies of the cheap tasks */
+    for(i=0; i<nb_tasks; i++){
+        if(dates[i] >= 0){
+            dates[nb_cheap++] = dates[i];
+        }
+    }
+    qsort(dates, nb_cheap, sizeof(long), cmp_long);
+
+    for(cls=0; cls<THREAD_POOL_NB_CLASSES; cls++){
+        thread_pool_get_stats(pool, cls, &stats[cls]);
+    }
+    printf("%s: cheap p50 %8.1f us, p99 %8.1f us, max depth cheap %ld heavy %ld\n",
+           with_classes? "two classes" : "one class  ",
+           dates[nb_cheap/2] / 1e3, dates[nb_cheap*99/100] / 1e3,
+           stats[THREAD_POOL_CHEAP].max_depth, stats[THREAD_POOL_HEAVY].max_depth);
+    free(dates);
+    thread_pool_shutdown(pool);
+}
+
+static void *producer(void *arg)
+{
+    long i, n = (long) arg;
+
+    for(i=0; i<n; i++){
+        thread_pool_submit(pool, task, NULL);
+    }
+
+    return NULL;
+}
+
+static double run(thread_pool_kind_t kind)
+{
+    struct timespec start, end;
+    pthread_t *tids = malloc(nb_producers * sizeof(pthread_t));
+    long total = (nb_tasks / nb_producers) * nb_producers * (1 + fanout);
+    int i;
+
+    pool = thread_pool_create_kind(nb_workers, kind);
+    done = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i=0; i<nb_producers; i++){
+        pthread_create(&tids[i], NULL, producer, (void*)(nb_tasks / nb_producers));
+    }
+    for(i=0; i<nb_producers; i++){
+        pthread_join(tids[i], NULL);
+    }
+    while(__atomic_load_n(&done, __ATOMIC_RELAXED) < total){
+        sched_yield();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(tids);
+    thread_pool_shutdown(pool);
+
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt (argc, argv, "hw:p:n:f:x:")) != -1){
+        switch (opt){
+        case 'w':
+            nb_workers = atoi(optarg);
+            break;
+        case 'p':
+            nb_producers = atoi(optarg);
+            break;
+        case 'n':
+            nb_tasks = atol(optarg);
+            break;
+        case 'f':
+            fanout = atoi(optarg);
+            break;
+        case 'x':
+            heavy_every = atoi(optarg);
+            break;
+        case 'h':
+        case '?':
+        default:
+            display_help(argv[0]);
+            return -1;
+        }
+    }
+
+    if(nb_workers == 0){
+        nb_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if(nb_workers < 1 || nb_producers < 1 || nb_tasks < nb_producers || fanout < 0 || heavy_every < 0){
+        display_help(argv[0]);
+        return -1;
+    }
+
+    if(heavy_every){
+        printf("%ld tasks (1 heavy every %d), %d workers, work stealing\n", nb_tasks, heavy_every, nb_workers);
+        run_mixed(THREAD_POOL_STEALING, 0);
+        run_mixed(THREAD_POOL_STEALING, 1);
+        return 0;
+    }
+
+    printf("%ld tasks (fanout %d), %d producers, %d workers\n", nb_tasks, fanout, nb_producers, nb_workers);
+
+    double locked = run(THREAD_POOL_LOCKED);
+    printf("locked queue:   %8.1f ns/task\n", locked / (nb_tasks * (1 + fanout)));
+
+    double lockfree = run(THREAD_POOL_SHARED);
+    printf("lock-free ring: %8.1f ns/task\n", lockfree / (nb_tasks * (1 + fanout)));
+
+    double stealing = run(THREAD_POOL_STEALING);
+    printf("work stealing:  %8.1f ns/task\n", stealing / (nb_tasks * (1 + fanout)));
+
+    return 0;
+}
@@ -24,10 +24,60 @@ int portno = BABBLE_PORT;
 
 int with_streaming = 0;
 
+/* local transports */
+char *local_path = NULL;
+int with_shm = 0;
+int pipeline_depth = 0;
+
+static int connect_client(void)
+{
+    if(local_path != NULL){
+        return with_shm ? connect_to_shm_server(local_path) : connect_to_unix_server(local_path);
+    }
+
+    return connect_to_server(hostname, portno);
+}
+
 static void display_help(char *exec)
 {
-    printf("Usage: %s -m hostname -p port_number -n nb_clients -k nb_msgs -s [activate_streaming]\n", exec);
+    printf("Usage: %s -m hostname -p port_number -n nb_clients -k nb_msgs -s [activate_streaming] -b [binary protocol] -U unix_socket_path -M unix_socket_path [shared memory] -d pipeline_depth\n", exec);
     printf("\t hostname can be an ip address\n" );
+    printf("\t with -d, up to pipeline_depth publications are in flight (implies -b)\n" );
+}
+
+/* publish the k msgs with up to pipeline_depth requests in flight; the
+ * id of a request is the index of the msg */
+static int publish_pipelined(int sockfd, client_thread_data_t *data)
+{
+    char my_msg[BABBLE_SIZE];
+    char *acked = calloc(data->nb_msgs, 1);
+    int sent=0, received=0;
+    unsigned long req_id;
+
+    while(received < data->nb_msgs){
+        while(sent < data->nb_msgs && sent - received < pipeline_depth){
+            bzero(my_msg, BABBLE_SIZE);
+            snprintf(my_msg, BABBLE_SIZE, "ping_%d:%d", data->client_id, sent);
+            if(client_publish_pipelined(sockfd, my_msg, sent)){
+                free(acked);
+                return -1;
+            }
+            sent++;
+        }
+
+        /* answers come in any order */
+        if(client_pipeline_recv(sockfd, &req_id) == -1
+           || req_id >= data->nb_msgs || acked[req_id]){
+            fprintf(stderr,"unexpected answer to request %lu\n", req_id);
+            free(acked);
+            return -1;
+        }
+        acked[req_id] = 1;
+        received++;
+    }
+
+    free(acked);
+    return 0;
 }
 
 
@@ -42,7 +92,7 @@ static void *client_thread (void *arg)
     snprintf(client_name, BABBLE_ID_SIZE, "client_%d", data->client_id);
 
 
-    int sockfd = connect_to_server(hostname, portno);
+    int sockfd = connect_client();
 
     if(sockfd == -1){
         fprintf(stderr,"*** Test Failed ***\n");
@@ -55,7 +105,7 @@ static void *client_thread (void *arg)
     if(client_key == 0){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"client %s failed to login\n", client_name);
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
 
@@ -75,7 +125,7 @@ static void *client_thread (void *arg)
         if(client_follow(sockfd, client_to_follow, with_streaming)){
             fprintf(stderr,"*** Test Failed ***\n");
             fprintf(stderr,"%s failed to follow %s\n", client_name, client_to_follow);
-            close(sockfd);
+            disconnect_from_server(sockfd);
             exit(-1);
         }
     }
@@ -85,7 +135,7 @@ static void *client_thread (void *arg)
     if(client_rdv(sockfd)){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"%s failed to rdv with server\n", client_name);
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
 
@@ -101,7 +151,7 @@ static void *client_thread (void *arg)
     if(nb_followers != data->nb_clients){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"%s has  %d followers\n", client_name, nb_followers);
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
 
@@ -115,13 +165,19 @@ static void *client_thread (void *arg)
 
     /* publishing my k msgs */
     char my_msg[BABBLE_SIZE];
-    for(i=0; i< data->nb_msgs; i++){
+    if(pipeline_depth > 0 && publish_pipelined(sockfd, data)){
+        fprintf(stderr,"*** Test Failed ***\n");
+        fprintf(stderr,"%s failed to publish\n", client_name);
+        disconnect_from_server(sockfd);
+        exit(-1);
+    }
+    for(i=0; pipeline_depth == 0 && i< data->nb_msgs; i++){
         bzero(my_msg, BABBLE_SIZE);
         snprintf(my_msg, BABBLE_SIZE, "ping_%d:%d", data->client_id, i);
         if(client_publish(sockfd, my_msg, with_streaming)){
             fprintf(stderr,"*** Test Failed ***\n");
             fprintf(stderr,"%s failed to publish %s\n", client_name, my_msg);
-            close(sockfd);
+            disconnect_from_server(sockfd);
             exit(-1);
         }
     }
@@ -131,7 +187,7 @@ static void *client_thread (void *arg)
     if(client_rdv(sockfd)){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"%s failed to rdv with server\n", client_name);
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
     
@@ -143,15 +199,35 @@ static void *client_thread (void *arg)
         return (void*)EXIT_FAILURE;
     }
 
-    int timeline_size = client_timeline(sockfd, 1);
+    int timeline_size;
+    if(pipeline_depth > 0){
+        unsigned long req_id = data->nb_msgs;
+        if(client_timeline_pipelined(sockfd, req_id)
+           || (timeline_size = client_pipeline_recv(sockfd, &req_id)) == -1
+           || req_id != data->nb_msgs){
+            timeline_size = -1;
+        }
+    }
+    else{
+        timeline_size = client_timeline(sockfd, 1);
+    }
     if(timeline_size != data->nb_clients * data->nb_msgs){
         fprintf(stderr,"*** Test Failed ***\n");
         fprintf(stderr,"%s has %d msgs in timeline (%d expected)\n", client_name, timeline_size, data->nb_clients * data->nb_msgs);
-        close(sockfd);
+        disconnect_from_server(sockfd);
         exit(-1);
     }
+
+    /* the publications of a client leave with it: wait for all the
+     * timelines before disconnecting */
+    ret = pthread_barrier_wait(data->gbarrier);
+    if (ret != 0 && ret != PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+        fprintf(stderr, "Barrier synchronization failed!\n");
+        return (void*)EXIT_FAILURE;
+    }
     
-    close(sockfd);
+    disconnect_from_server(sockfd);
     return (void*)EXIT_SUCCESS;
 }
 
@@ -172,7 +248,7 @@ int main(int argc, char *argv[])
     pthread_barrier_t global_barrier;
     
     /* parsing command options */
-    while ((opt = getopt (argc, argv, "+hm:p:n:k:s")) != -1){
+    while ((opt = getopt (argc, argv, "+hm:p:n:k:sbd:U:M:")) != -1){
         switch (opt){
         case 'm':
             strncpy(hostname,optarg,BABBLE_BUFFER_SIZE);
@@ -194,6 +270,24 @@ int main(int argc, char *argv[])
             with_streaming=1;
             nb_args+=1;
             break;
+        case 'b':
+            client_set_protocol(PROTOCOL_V2);
+            nb_args+=1;
+            break;
+        case 'U':
+            local_path = optarg;
+            nb_args+=2;
+            break;
+        case 'M':
+            local_path = optarg;
+            with_shm = 1;
+            nb_args+=2;
+            break;
+        case 'd':
+            pipeline_depth = atoi(optarg);
+            client_set_protocol(PROTOCOL_V2);
+            nb_args+=2;
+            break;
         case 'h':
         case '?':
         default:
@@ -274,6 +368,14 @@ int main(int argc, char *argv[])
     }
 
     printf("**** SUCCESS: All PUBLISH executed\n");
+
+    /* barrier after all timelines */
+    ret = pthread_barrier_wait(&global_barrier);
+    if (ret != 0 && ret != PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+        fprintf(stderr, "Barrier synchronization failed!\n");
+        return -1;
+    }
         
     
     for(i=0; i < nb_threads; i++){
@@ -1,9 +1,18 @@
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "thread_pool.h"
 
+/* bit of the state of a pool set once it is closed */
+#define THREAD_POOL_CLOSED (1UL << 63)
 
 static void await_flag(await_flag_t* flag)
 {
@@ -12,14 +21,14 @@ static void await_flag(await_flag_t* flag)
 		pthread_cond_wait(&flag->con, &flag->mx);
 	}
 	flag->is_set=0;
-	pthread_mutex_unlock(&flag->mx);    
+	pthread_mutex_unlock(&flag->mx);
 }
 static void notify_flag(await_flag_t* flag)
 {
 	pthread_mutex_lock(&flag->mx);
 	flag->is_set = 1;
 	pthread_cond_signal(&flag->con);
-	pthread_mutex_unlock(&flag->mx);    
+	pthread_mutex_unlock(&flag->mx);
 }
 static void init_await_flag(await_flag_t* flag)
 {
@@ -28,80 +37,721 @@ static void init_await_flag(await_flag_t* flag)
     flag->is_set = 0;
 }
 
-static void worker_run(thread_pool_t* pool_ptr)
+/* pool of the calling thread, if it is a worker */
+static __thread thread_pool_t *current_pool = NULL;
+
+static const int class_weight[THREAD_POOL_NB_CLASSES] = {
+    THREAD_POOL_CHEAP_WEIGHT,
+    THREAD_POOL_HEAVY_WEIGHT
+};
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* move the round robin (cls, cls_end) to the next class */
+static void next_class(int *cls, long *cls_end, long now)
+{
+    *cls = (*cls + 1) % THREAD_POOL_NB_CLASSES;
+    *cls_end = now + class_weight[*cls] * THREAD_POOL_QUANTUM_NS;
+}
+
+static void count_submitted(thread_pool_t* pool_ptr, int cls)
+{
+    pool_class_t *class = &pool_ptr->classes[cls];
+    unsigned long submitted = __atomic_add_fetch(&class->submitted, 1, __ATOMIC_RELAXED);
+    long depth = submitted - __atomic_load_n(&class->started, __ATOMIC_RELAXED);
+    long max = __atomic_load_n(&class->max_depth, __ATOMIC_RELAXED);
+
+    while(depth > max){
+        if(__atomic_compare_exchange_n(&class->max_depth, &max, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+            break;
+        }
+    }
+}
+
+static void count_started(thread_pool_t* pool_ptr, int cls)
+{
+    __atomic_add_fetch(&pool_ptr->classes[cls].started, 1, __ATOMIC_RELAXED);
+}
+
+/* the tasks submitted by a task are counted before its completion (see
+ * thread_pool_drain()) */
+static void count_completed(thread_pool_t* pool_ptr, int cls)
+{
+    __atomic_add_fetch(&pool_ptr->classes[cls].completed, 1, __ATOMIC_RELEASE);
+}
+
+static void locked_worker_run(thread_pool_t* pool_ptr)
 {
     task_t* task_ptr;
     void (*task_cb)(void* param);
     void* param;
-    
+    long now;
+    int i, cls;
+
+    current_pool = pool_ptr;
+
     while(1){
         await_flag(&(pool_ptr->task_rdy_flag));
         pthread_mutex_lock(&(pool_ptr->task_queue_lock));
-        task_ptr = pool_ptr->top;
-        switch(pool_ptr->len){            
-            case 0:  break;            
-            case 1: pool_ptr->top = NULL;
-                    pool_ptr->bot = NULL;
-                    pool_ptr->len = 0;
-                    break;
-            default: pool_ptr->top = task_ptr->prev;
-                     pool_ptr->len--;
-                     notify_flag(&(pool_ptr->task_rdy_flag));
-                        
+        task_ptr = NULL;
+        cls = 0;
+        now = now_ns();
+        if(now >= pool_ptr->cls_end){
+            next_class(&pool_ptr->cls, &pool_ptr->cls_end, now);
+        }
+        for(i=0; pool_ptr->len && i<THREAD_POOL_NB_CLASSES; i++){
+            cls = pool_ptr->cls;
+            task_ptr = pool_ptr->top[cls];
+            if(task_ptr != NULL){
+                break;
+            }
+            next_class(&pool_ptr->cls, &pool_ptr->cls_end, now);
+        }
+        if(task_ptr != NULL){
+            pool_ptr->top[cls] = task_ptr->prev;
+            if(pool_ptr->top[cls] == NULL){
+                pool_ptr->bot[cls] = NULL;
+            }
+            if(--pool_ptr->len){
+                notify_flag(&(pool_ptr->task_rdy_flag));
+            }
         }
         pthread_mutex_unlock(&(pool_ptr->task_queue_lock));
-        
+
         if (task_ptr) {
+            count_started(pool_ptr, cls);
             task_cb = task_ptr->callback;
             param  = task_ptr->param;
             task_cb(param);
             free(task_ptr);
+            count_completed(pool_ptr, cls);
+        }
+        else if(__atomic_load_n(&pool_ptr->stopping, __ATOMIC_SEQ_CST)){
+            /* pass the wake up on to the next worker */
+            notify_flag(&(pool_ptr->task_rdy_flag));
+            break;
+        }
+    }
+}
+
+static void locked_submit(thread_pool_t* pool_ptr, int cls, void (*task)(void*), void* param)
+{
+	task_t* task_ptr;
+	task_ptr=(task_t*)malloc(sizeof(task_t));
+	task_ptr->callback=task;
+	task_ptr->param=param;
+    task_ptr->prev = NULL;
+
+    pthread_mutex_lock(&(pool_ptr->task_queue_lock));
+	if(pool_ptr->bot[cls] != NULL){
+        pool_ptr->bot[cls]->prev = task_ptr;
+        pool_ptr->bot[cls] = task_ptr;
+    }else{
+        pool_ptr->top[cls] = task_ptr;
+        pool_ptr->bot[cls] = task_ptr;
+	}
+	pool_ptr->len++;
+	notify_flag(&(pool_ptr->task_rdy_flag));
+    pthread_mutex_unlock(&(pool_ptr->task_queue_lock));
+}
+
+
+/* lock-free ring: a slot is free for the producer of position pos
+ * when its seq is pos, and holds a task for the consumer of position
+ * pos when its seq is pos+1 */
+/* returns -1 if the slots cannot be allocated */
+static int ring_init(task_ring_t *ring)
+{
+    unsigned long i;
+
+    ring->slots = malloc(THREAD_POOL_RING_SIZE * sizeof(task_slot_t));
+    if(ring->slots == NULL){
+        return -1;
+    }
+    for(i=0; i<THREAD_POOL_RING_SIZE; i++){
+        ring->slots[i].seq = i;
+    }
+    ring->enqueue_pos = 0;
+    ring->dequeue_pos = 0;
+
+    return 0;
+}
+
+static int ring_push(task_ring_t *ring, void (*task)(void*), void* param)
+{
+    unsigned long mask = THREAD_POOL_RING_SIZE - 1;
+    unsigned long pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    task_slot_t *slot;
+
+    while(1){
+        slot = &ring->slots[pos & mask];
+        long diff = (long)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (long)pos;
+
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        }
+        else if(diff < 0){
+            /* full */
+            return -1;
+        }
+        else{
+            pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
         }
     }
+
+    slot->callback = task;
+    slot->param = param;
+    __atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static int ring_pop(task_ring_t *ring, void (**task)(void*), void** param)
+{
+    unsigned long mask = THREAD_POOL_RING_SIZE - 1;
+    unsigned long pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    task_slot_t *slot;
+
+    while(1){
+        slot = &ring->slots[pos & mask];
+        long diff = (long)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (long)(pos+1);
+
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                break;
+            }
+        }
+        else if(diff < 0){
+            /* empty */
+            return -1;
+        }
+        else{
+            pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *task = slot->callback;
+    *param = slot->param;
+    __atomic_store_n(&slot->seq, pos + mask + 1, __ATOMIC_RELEASE);
+
+    return 0;
 }
 
-thread_pool_t* thread_pool_create(int num){
 
-	if (num < 0){
+/* Chase-Lev deque (fixed size): only its owner calls deque_push() and
+ * deque_pop() */
+static int deque_push(task_deque_t *deque, void (*task)(void*), void* param)
+{
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    task_t *slot = &deque->tasks[b & (THREAD_POOL_DEQUE_SIZE-1)];
+
+    if(b - t >= THREAD_POOL_DEQUE_SIZE){
+        return -1;
+    }
+
+    __atomic_store_n(&slot->callback, task, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->param, param, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, b+1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static int deque_pop(task_deque_t *deque, void (**task)(void*), void** param)
+{
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    task_t *slot = &deque->tasks[b & (THREAD_POOL_DEQUE_SIZE-1)];
+    int res = 0;
+
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if(t > b){
+        /* empty */
+        __atomic_store_n(&deque->bottom, b+1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    *task = __atomic_load_n(&slot->callback, __ATOMIC_RELAXED);
+    *param = __atomic_load_n(&slot->param, __ATOMIC_RELAXED);
+
+    if(t == b){
+        /* last task: race with the thieves */
+        if(!__atomic_compare_exchange_n(&deque->top, &t, t+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+            res = -1;
+        }
+        __atomic_store_n(&deque->bottom, b+1, __ATOMIC_RELAXED);
+    }
+
+    return res;
+}
+
+static int deque_steal(task_deque_t *deque, void (**task)(void*), void** param)
+{
+    long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    task_t *slot = &deque->tasks[t & (THREAD_POOL_DEQUE_SIZE-1)];
+
+    if(t >= b){
+        return -1;
+    }
+
+    *task = __atomic_load_n(&slot->callback, __ATOMIC_RELAXED);
+    *param = __atomic_load_n(&slot->param, __ATOMIC_RELAXED);
+
+    /* lost against the owner or another thief */
+    if(!__atomic_compare_exchange_n(&deque->top, &t, t+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void overflow_push(pool_class_t* class, void (*task)(void*), void* param)
+{
+    task_t* task_ptr=(task_t*)malloc(sizeof(task_t));
+    task_ptr->callback=task;
+    task_ptr->param=param;
+    task_ptr->prev = NULL;
+
+    pthread_mutex_lock(&class->overflow_lock);
+    if(class->overflow_bot != NULL){
+        class->overflow_bot->prev = task_ptr;
+    }
+    else{
+        class->overflow_top = task_ptr;
+    }
+    class->overflow_bot = task_ptr;
+    __atomic_add_fetch(&class->overflow_len, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&class->overflow_lock);
+}
+
+static int overflow_pop(pool_class_t* class, void (**task)(void*), void** param)
+{
+    task_t* task_ptr;
+
+    if(__atomic_load_n(&class->overflow_len, __ATOMIC_ACQUIRE) == 0){
+        return -1;
+    }
+
+    pthread_mutex_lock(&class->overflow_lock);
+    task_ptr = class->overflow_top;
+    if(task_ptr != NULL){
+        class->overflow_top = task_ptr->prev;
+        if(class->overflow_top == NULL){
+            class->overflow_bot = NULL;
+        }
+        __atomic_sub_fetch(&class->overflow_len, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&class->overflow_lock);
+
+    if(task_ptr == NULL){
+        return -1;
+    }
+
+    *task = task_ptr->callback;
+    *param = task_ptr->param;
+    free(task_ptr);
+
+    return 0;
+}
+
+/* worker of the calling thread, if it belongs to a stealing pool */
+static __thread pool_worker_t *current_worker = NULL;
+
+/* next task of class cls for worker self: its own work first, then
+ * the work of the others */
+static int class_pop(thread_pool_t* pool_ptr, pool_worker_t *self, int cls, void (**task)(void*), void** param)
+{
+    int i;
+
+    if(pool_ptr->kind == THREAD_POOL_SHARED){
+        if(ring_pop(&pool_ptr->ring[cls], task, param) == 0){
+            return 0;
+        }
+        return overflow_pop(&pool_ptr->classes[cls], task, param);
+    }
+
+    if(deque_pop(&self->deque[cls], task, param) == 0 || ring_pop(&self->inbox[cls], task, param) == 0){
+        return 0;
+    }
+
+    for(i=1; i<pool_ptr->nb_workers; i++){
+        pool_worker_t *victim = pool_ptr->workers[(self->id + i) % pool_ptr->nb_workers];
+
+        if(deque_steal(&victim->deque[cls], task, param) == 0 || ring_pop(&victim->inbox[cls], task, param) == 0){
+            return 0;
+        }
+    }
+
+    return overflow_pop(&pool_ptr->classes[cls], task, param);
+}
+
+/* next task for worker self, from the class it serves unless its
+ * time is over or it is empty */
+static int pool_pop(thread_pool_t* pool_ptr, pool_worker_t *self, void (**task)(void*), void** param, int *task_cls)
+{
+    long now = now_ns();
+    int i, cls;
+
+    if(now >= self->cls_end){
+        next_class(&self->cls, &self->cls_end, now);
+    }
+
+    for(i=0; i<THREAD_POOL_NB_CLASSES; i++){
+        cls = self->cls;
+        if(class_pop(pool_ptr, self, cls, task, param) == 0){
+            count_started(pool_ptr, cls);
+            *task_cls = cls;
+            return 0;
+        }
+        next_class(&self->cls, &self->cls_end, now);
+    }
+
+    return -1;
+}
+
+static void futex_wait(unsigned int *addr, unsigned int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(unsigned int *addr, int nb)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nb, NULL, NULL, 0);
+}
+
+static void worker_run(pool_worker_t *self)
+{
+    thread_pool_t* pool_ptr = self->pool;
+    void (*task_cb)(void* param);
+    void* param;
+    unsigned int key;
+    int spin, cls;
+
+    current_pool = pool_ptr;
+    if(pool_ptr->kind == THREAD_POOL_STEALING){
+        current_worker = self;
+    }
+
+    while(1){
+        for(spin=0; spin < THREAD_POOL_SPIN; spin++){
+            if(pool_pop(pool_ptr, self, &task_cb, &param, &cls) == 0){
+                break;
+            }
+            sched_yield();
+        }
+
+        if(spin == THREAD_POOL_SPIN){
+            /* park: announce it, then check again, so that a task
+             * submitted meanwhile either is seen here or wakes us */
+            __atomic_add_fetch(&pool_ptr->nb_parked, 1, __ATOMIC_SEQ_CST);
+            key = __atomic_load_n(&pool_ptr->wake_seq, __ATOMIC_SEQ_CST);
+
+            if(pool_pop(pool_ptr, self, &task_cb, &param, &cls) == -1){
+                /* idle and shut down (no task can come anymore) */
+                if(__atomic_load_n(&pool_ptr->stopping, __ATOMIC_SEQ_CST)){
+                    __atomic_sub_fetch(&pool_ptr->nb_parked, 1, __ATOMIC_SEQ_CST);
+                    break;
+                }
+                futex_wait(&pool_ptr->wake_seq, key);
+                __atomic_sub_fetch(&pool_ptr->nb_parked, 1, __ATOMIC_SEQ_CST);
+                continue;
+            }
+            __atomic_sub_fetch(&pool_ptr->nb_parked, 1, __ATOMIC_SEQ_CST);
+        }
+
+        task_cb(param);
+        count_completed(pool_ptr, cls);
+    }
+}
+
+
+/* run the calling thread on cpu only (-1: on the CPUs of set) */
+static void pin_self(int cpu, cpu_set_t *set)
+{
+	cpu_set_t one;
+
+	if(cpu != -1){
+		CPU_ZERO(&one);
+		CPU_SET(cpu, &one);
+		set = &one;
+	}
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+}
+
+/* free a pool whose workers are not running: its queues and the
+ * state of the nb_workers workers allocated */
+static void pool_free(thread_pool_t* pool_ptr)
+{
+	int n, cls;
+
+	/* the rings that were not allocated are NULL */
+	for(cls=0; cls<THREAD_POOL_NB_CLASSES; cls++){
+		free(pool_ptr->ring[cls].slots);
+		for(n=0; n<pool_ptr->nb_workers; n++){
+			free(pool_ptr->workers[n]->inbox[cls].slots);
+		}
+		pthread_mutex_destroy(&pool_ptr->classes[cls].overflow_lock);
+	}
+	pthread_mutex_destroy(&pool_ptr->task_queue_lock);
+	pthread_mutex_destroy(&pool_ptr->task_rdy_flag.mx);
+	pthread_cond_destroy(&pool_ptr->task_rdy_flag.con);
+	for(n=0; n<pool_ptr->nb_workers; n++){
+		free(pool_ptr->workers[n]);
+	}
+	free(pool_ptr->workers);
+	free(pool_ptr);
+}
+
+thread_pool_t* thread_pool_create_pinned(int num, thread_pool_kind_t kind, const int *cpus)
+{
+	if (num <= 0){
 		num = 1;
 	}
 	thread_pool_t* pool_ptr;
-	pool_ptr = (thread_pool_t*)malloc(sizeof(thread_pool_t));
+	int cls;
+	/* the hot fields are on their own cache lines */
+	if(posix_memalign((void**)&pool_ptr, 64, sizeof(thread_pool_t))){
+		return NULL;
+	}
+	bzero(pool_ptr, sizeof(thread_pool_t));
+	pool_ptr->kind = kind;
     pool_ptr->len = 0;
-	pool_ptr->top = NULL;
-    pool_ptr->bot = NULL;
+    pool_ptr->cls = 0;
+    pool_ptr->cls_end = now_ns() + class_weight[0] * THREAD_POOL_QUANTUM_NS;
     pthread_mutex_init(&(pool_ptr->task_queue_lock), NULL);
 	init_await_flag(&pool_ptr->task_rdy_flag);
+
+	int failed = 0;
+	for(cls=0; cls<THREAD_POOL_NB_CLASSES; cls++){
+		pthread_mutex_init(&pool_ptr->classes[cls].overflow_lock, NULL);
+		if(kind == THREAD_POOL_SHARED && ring_init(&pool_ptr->ring[cls]) == -1){
+			failed = 1;
+		}
+	}
+
+	/* nb_workers counts the workers allocated so far */
+	pool_ptr->nb_workers = 0;
+	pool_ptr->workers = malloc(num * sizeof(pool_worker_t*));
+	if(failed || pool_ptr->workers == NULL){
+		pool_free(pool_ptr);
+		return NULL;
+	}
+
+	/* the state of a pinned worker is allocated and initialized from
+	 * its CPU: its pages are placed on the local NUMA node (first
+	 * touch) */
+	cpu_set_t creator_cpus;
+	pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &creator_cpus);
+
 	int n;
-    pthread_t thread_ptr;
 	for (n=0; n<num; n++){
-        pthread_create(&thread_ptr, NULL, (void *)worker_run, pool_ptr);
-        pthread_detach(thread_ptr);
+		pool_worker_t *worker;
+
+		if(cpus != NULL){
+			pin_self(cpus[n], NULL);
+		}
+		if(posix_memalign((void**)&worker, 64, sizeof(pool_worker_t))){
+			failed = 1;
+			break;
+		}
+		bzero(worker, sizeof(pool_worker_t));
+		pool_ptr->workers[n] = worker;
+		pool_ptr->nb_workers = n + 1;
+
+		worker->pool = pool_ptr;
+		worker->id = n;
+		worker->cls = 0;
+		worker->cls_end = pool_ptr->cls_end;
+		for(cls=0; kind == THREAD_POOL_STEALING && cls<THREAD_POOL_NB_CLASSES; cls++){
+			if(ring_init(&worker->inbox[cls]) == -1){
+				failed = 1;
+			}
+		}
+		if(failed){
+			break;
+		}
+	}
+	if(cpus != NULL){
+		pin_self(-1, &creator_cpus);
+	}
+	if(failed){
+		pool_free(pool_ptr);
+		return NULL;
+	}
+
+	for (n=0; n<num; n++){
+		pthread_attr_t attr;
+		cpu_set_t set;
+
+		pthread_attr_init(&attr);
+		if(cpus != NULL){
+			CPU_ZERO(&set);
+			CPU_SET(cpus[n], &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &set);
+		}
+		if(kind == THREAD_POOL_LOCKED){
+			pthread_create(&pool_ptr->workers[n]->thread, &attr, (void *)locked_worker_run, pool_ptr);
+		}
+		else{
+			pthread_create(&pool_ptr->workers[n]->thread, &attr, (void *)worker_run, pool_ptr->workers[n]);
+		}
+		pthread_attr_destroy(&attr);
     }
 
 	return pool_ptr;
 }
 
-void thread_pool_submit(thread_pool_t* pool_ptr, void (*task)(void*), void* param)
+thread_pool_t* thread_pool_create_kind(int num, thread_pool_kind_t kind)
 {
-	task_t* task_ptr;
-	task_ptr=(task_t*)malloc(sizeof(task_t));
-	task_ptr->callback=task;
-	task_ptr->param=param;
-    task_ptr->prev = NULL;
+	return thread_pool_create_pinned(num, kind, NULL);
+}
 
-    pthread_mutex_lock(&(pool_ptr->task_queue_lock));
-	if(pool_ptr->len){
-        pool_ptr->bot->prev = task_ptr;
-        pool_ptr->bot = task_ptr;
-    }else{
-        pool_ptr->top = task_ptr;
-        pool_ptr->bot = task_ptr;					
+thread_pool_t* thread_pool_create(int num)
+{
+	return thread_pool_create_kind(num, THREAD_POOL_STEALING);
+}
+
+int thread_pool_submit_class(thread_pool_t* pool_ptr, thread_pool_class_t cls, void (*task)(void*), void* param)
+{
+	static __thread unsigned int next_worker = 0;
+	int pushed;
+
+	unsigned long state = __atomic_load_n(&pool_ptr->state, __ATOMIC_SEQ_CST);
+
+	/* the closed check and the registration of the submission are a
+	 * single step: the shutdown waits for the submissions that passed
+	 * the check before freeing the pool */
+	do{
+		/* the tasks of the pool finish their work while it drains */
+		if((state & THREAD_POOL_CLOSED) && current_pool != pool_ptr){
+			return -1;
+		}
+	} while(!__atomic_compare_exchange_n(&pool_ptr->state, &state, state + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	count_submitted(pool_ptr, cls);
+
+	switch(pool_ptr->kind){
+	case THREAD_POOL_LOCKED:
+		locked_submit(pool_ptr, cls, task, param);
+		__atomic_sub_fetch(&pool_ptr->state, 1, __ATOMIC_RELEASE);
+		return 0;
+	case THREAD_POOL_SHARED:
+		pushed = (ring_push(&pool_ptr->ring[cls], task, param) == 0);
+		break;
+	default:
+		/* a worker keeps the tasks it spawns, the other threads
+		 * spread theirs */
+		if(current_worker != NULL && current_worker->pool == pool_ptr){
+			pushed = (deque_push(&current_worker->deque[cls], task, param) == 0
+					  || ring_push(&current_worker->inbox[cls], task, param) == 0);
+		}
+		else{
+			pool_worker_t *worker = pool_ptr->workers[next_worker++ % pool_ptr->nb_workers];
+			pushed = (ring_push(&worker->inbox[cls], task, param) == 0);
+		}
+		break;
 	}
-	pool_ptr->len++;
-	notify_flag(&(pool_ptr->task_rdy_flag));
-    pthread_mutex_unlock(&(pool_ptr->task_queue_lock));   
-};
 
+	/* the ring is full: a worker submitting while holding locks must
+	 * not wait for the other workers */
+	if(!pushed){
+		overflow_push(&pool_ptr->classes[cls], task, param);
+	}
+
+	/* pairs with the parking sequence of worker_run() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&pool_ptr->nb_parked, __ATOMIC_SEQ_CST)){
+		__atomic_add_fetch(&pool_ptr->wake_seq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&pool_ptr->wake_seq, 1);
+	}
+
+	/* last access to the pool */
+	__atomic_sub_fetch(&pool_ptr->state, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+int thread_pool_submit(thread_pool_t* pool_ptr, void (*task)(void*), void* param)
+{
+	return thread_pool_submit_class(pool_ptr, THREAD_POOL_CHEAP, task, param);
+}
+
+void thread_pool_drain(thread_pool_t* pool_ptr)
+{
+	unsigned long submitted, completed, submitting;
+	int cls;
+
+	while(1){
+		/* completed first: a task submitted by a completed task is
+		 * then counted in submitted */
+		completed = 0;
+		for(cls=0; cls<THREAD_POOL_NB_CLASSES; cls++){
+			completed += __atomic_load_n(&pool_ptr->classes[cls].completed, __ATOMIC_ACQUIRE);
+		}
+		/* then the submissions in progress, counted before their
+		 * task */
+		submitting = __atomic_load_n(&pool_ptr->state, __ATOMIC_ACQUIRE) & ~THREAD_POOL_CLOSED;
+		submitted = 0;
+		for(cls=0; cls<THREAD_POOL_NB_CLASSES; cls++){
+			submitted += __atomic_load_n(&pool_ptr->classes[cls].submitted, __ATOMIC_ACQUIRE);
+		}
+		if(submitting == 0 && submitted == completed){
+			return;
+		}
+		usleep(1000);
+	}
+}
+
+void thread_pool_shutdown(thread_pool_t* pool_ptr)
+{
+	int n;
+
+	__atomic_or_fetch(&pool_ptr->state, THREAD_POOL_CLOSED, __ATOMIC_SEQ_CST);
+	thread_pool_drain(pool_ptr);
 
+	/* wake up all the workers: they find nothing to do and leave */
+	__atomic_store_n(&pool_ptr->stopping, 1, __ATOMIC_SEQ_CST);
+	if(pool_ptr->kind == THREAD_POOL_LOCKED){
+		notify_flag(&pool_ptr->task_rdy_flag);
+	}
+	else{
+		__atomic_add_fetch(&pool_ptr->wake_seq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&pool_ptr->wake_seq, pool_ptr->nb_workers);
+	}
 
+	for(n=0; n<pool_ptr->nb_workers; n++){
+		pthread_join(pool_ptr->workers[n]->thread, NULL);
+	}
+
+	pool_free(pool_ptr);
+}
+
+void thread_pool_get_stats(thread_pool_t* pool_ptr, thread_pool_class_t cls, thread_pool_stats_t *stats)
+{
+	pool_class_t *class = &pool_ptr->classes[cls];
+
+	stats->completed = __atomic_load_n(&class->completed, __ATOMIC_RELAXED);
+	stats->started = __atomic_load_n(&class->started, __ATOMIC_RELAXED);
+	stats->submitted = __atomic_load_n(&class->submitted, __ATOMIC_RELAXED);
+	stats->depth = stats->submitted - stats->started;
+	/* the counters are read one after the other */
+	if(stats->depth < 0){
+		stats->depth = 0;
+	}
+	stats->max_depth = __atomic_load_n(&class->max_depth, __ATOMIC_RELAXED);
+}
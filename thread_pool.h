@@ -3,6 +3,40 @@
 
 #include <pthread.h>
 
+/* slots of a task ring (power of 2): tasks submitted while it is
+ * full go to a locked overflow list */
+#define THREAD_POOL_RING_SIZE 4096
+/* slots of the deque of a worker (power of 2) */
+#define THREAD_POOL_DEQUE_SIZE 1024
+/* attempts to find a task before an idle worker parks */
+#define THREAD_POOL_SPIN 64
+
+/* classes of tasks: each one has its own queues, and the workers serve
+ * them by weighted round robin on time (a worker starts tasks of a
+ * class for weight quanta before moving to the next non-empty one), so
+ * that a burst of heavy tasks does not delay the cheap ones */
+#define THREAD_POOL_NB_CLASSES 2
+typedef enum{
+    THREAD_POOL_CHEAP =0,
+    THREAD_POOL_HEAVY
+} thread_pool_class_t;
+#define THREAD_POOL_CHEAP_WEIGHT 4
+#define THREAD_POOL_HEAVY_WEIGHT 1
+#define THREAD_POOL_QUANTUM_NS 50000
+
+/* how the tasks reach the workers
+   + LOCKED: a single list, protected by a mutex
+   + SHARED: a single lock-free ring
+   + STEALING: each worker has a lock-free inbox, fed by the other
+     threads (round robin), and a Chase-Lev deque for the tasks it
+     submits itself; an idle worker steals from the others
+*/
+typedef enum{
+    THREAD_POOL_LOCKED,
+    THREAD_POOL_SHARED,
+    THREAD_POOL_STEALING
+} thread_pool_kind_t;
+
 typedef struct await_flag {
 	char is_set;
 	pthread_mutex_t mx;
@@ -10,21 +44,121 @@ typedef struct await_flag {
 } await_flag_t;
 
 typedef struct task{
-	struct task*  prev;                   
-	void   (*callback)(void* param);     
-	void*  param;                         
+	struct task*  prev;
+	void   (*callback)(void* param);
+	void*  param;
 } task_t;
 
-typedef struct thread_pool{                
+/* slot of a lock-free ring (bounded MPMC queue, one sequence number
+ * per slot) */
+typedef struct task_slot{
+	unsigned long seq;
+	void   (*callback)(void* param);
+	void*  param;
+} task_slot_t;
+
+typedef struct task_ring{
+	task_slot_t *slots;
+	unsigned long enqueue_pos __attribute__((aligned(64)));
+	unsigned long dequeue_pos __attribute__((aligned(64)));
+} task_ring_t;
+
+/* Chase-Lev deque: the owner pushes and pops at the bottom, thieves
+ * steal at the top */
+typedef struct task_deque{
+	long top __attribute__((aligned(64)));
+	long bottom __attribute__((aligned(64)));
+	task_t tasks[THREAD_POOL_DEQUE_SIZE];   /* prev is unused */
+} task_deque_t;
+
+typedef struct pool_worker{
+	struct thread_pool *pool;
+	int id;
+	pthread_t thread;
+	int cls;       /* class being served */
+	long cls_end;  /* date (ns) to move to the next class */
+	task_ring_t inbox[THREAD_POOL_NB_CLASSES];
+	task_deque_t deque[THREAD_POOL_NB_CLASSES];
+} pool_worker_t;
+
+/* queue depth of a class */
+typedef struct thread_pool_stats{
+	unsigned long submitted;
+	unsigned long started;
+	unsigned long completed;
+	long depth;        /* submitted but not started yet */
+	long max_depth;
+} thread_pool_stats_t;
+
+typedef struct pool_class{
+	unsigned long submitted __attribute__((aligned(64)));
+	unsigned long started __attribute__((aligned(64)));
+	unsigned long completed;
+	long max_depth;
+
+	/* tasks that did not fit in the rings */
+	int overflow_len;
+	pthread_mutex_t overflow_lock;
+	task_t* overflow_top;
+	task_t* overflow_bot;
+} pool_class_t;
+
+typedef struct thread_pool{
+	thread_pool_kind_t kind;
+	/* THREAD_POOL_CLOSED once no new task is accepted, plus the
+	 * number of submissions in progress */
+	unsigned long state;
+	int stopping;    /* the workers leave once idle */
+
+	/* locked queue (one list per class) */
 	await_flag_t task_rdy_flag;
-    pthread_mutex_t task_queue_lock;    
-	task_t* top;                         
-	task_t* bot;                          
-	int   len;       
+    pthread_mutex_t task_queue_lock;
+	task_t* top[THREAD_POOL_NB_CLASSES];
+	task_t* bot[THREAD_POOL_NB_CLASSES];
+	int   len;
+	int   cls;       /* round robin of the locked queue */
+	long  cls_end;
+
+	/* shared lock-free ring (one per class) */
+	task_ring_t ring[THREAD_POOL_NB_CLASSES];
+
+	/* work stealing */
+	int nb_workers;
+	pool_worker_t **workers;
+
+	pool_class_t classes[THREAD_POOL_NB_CLASSES];
+
+	/* idle workers park on a futex (eventcount) */
+	unsigned int wake_seq __attribute__((aligned(64)));
+	int nb_parked;
 } thread_pool_t;
 
+/* pool of num workers, with work stealing */
+/* the create functions return NULL if there is not enough memory */
 thread_pool_t* thread_pool_create(int num);
 
-void thread_pool_submit(thread_pool_t* pool, void (*task)(void*), void* param);
+thread_pool_t* thread_pool_create_kind(int num, thread_pool_kind_t kind);
+
+/* worker n runs on cpus[n] only, and its state (rings, deques) is
+ * allocated on the NUMA node of this CPU */
+thread_pool_t* thread_pool_create_pinned(int num, thread_pool_kind_t kind, const int *cpus);
+
+/* submit a cheap task */
+/* returns -1 if the pool is shut down */
+int thread_pool_submit(thread_pool_t* pool, void (*task)(void*), void* param);
+
+int thread_pool_submit_class(thread_pool_t* pool, thread_pool_class_t cls, void (*task)(void*), void* param);
+
+/* wait until every task submitted, including the ones submitted by the
+ * tasks themselves, has completed */
+void thread_pool_drain(thread_pool_t* pool);
+
+/* stop accepting tasks, drain the pool, join the workers and free the
+ * pool */
+/* only the tasks of the pool may still submit while it is shut down */
+void thread_pool_shutdown(thread_pool_t* pool);
+
+/* queue depth metrics of class cls */
+void thread_pool_get_stats(thread_pool_t* pool, thread_pool_class_t cls, thread_pool_stats_t *stats);
 
-#endif
\ No newline at end of file
+#endif